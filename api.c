@@ -17,6 +17,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +25,10 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
 
 #include "compat.h"
 #include "miner.h"
@@ -48,6 +53,11 @@
 // However lots of PGA's may mean more
 #define QUEUE	100
 
+// Most clients connected at once, and seconds one may sit idle
+#define API_CLIENTS	64
+#define API_TIMEOUT	30
+#define API_EVENTS	16
+
 #if defined WIN32
 static char WSAbuf[1024];
 
@@ -124,6 +134,7 @@ char *WSAErrorMsg(void) {
 #endif
 static SOCKETTYPE sock = INVSOCK;
 
+static const char *localaddr = "127.0.0.1";
 static const char *UNAVAILABLE = " - API will not be available";
 static const char *INVAPIGROUPS = "Invalid --api-groups parameter";
 
@@ -134,7 +145,7 @@ static const char SEPARATOR = '|';
 #define SEPSTR "|"
 static const char GPUSEP = ',';
 
-static const char *APIVERSION = "1.24";
+static const char *APIVERSION = "1.25";
 static const char *DEAD = "Dead";
 static const char *SICK = "Sick";
 static const char *NOSTART = "NoStart";
@@ -234,6 +245,7 @@ static const char *OSINFO =
 #define _MINECOIN	"COIN"
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
+#define _HISTORY	"HISTORY"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -273,6 +285,7 @@ static const char ISJSON = '{';
 #define JSON_MINESTATS	JSON1 _MINESTATS JSON2
 #define JSON_CHECK	JSON1 _CHECK JSON2
 #define JSON_MINECOIN	JSON1 _MINECOIN JSON2
+#define JSON_HISTORY	JSON1 _HISTORY JSON2
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_END	JSON4 JSON5
@@ -394,6 +407,13 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_ZERSUM 96
 #define MSG_ZERNOSUM 97
 
+#define MSG_HISTMIS 98
+#define MSG_HISTINV 99
+#define MSG_INVDEV 100
+#define MSG_HISTORY 101
+#define MSG_KEEPALIVE 102
+#define MSG_NOKEEPALIVE 103
+
 enum code_severity {
 	SEVERITY_ERR,
 	SEVERITY_WARN,
@@ -412,6 +432,7 @@ enum code_parameters {
 	PARAM_CPUMAX,
 	PARAM_PMAX,
 	PARAM_POOLMAX,
+	PARAM_DEVMAX,
 
 // Single generic case: have the code resolve it - see below
 	PARAM_DMAX,
@@ -568,6 +589,12 @@ struct CODES {
  { SEVERITY_ERR,   MSG_ZERINV,	PARAM_STR,	"Invalid zero parameter '%s'" },
  { SEVERITY_SUCC,  MSG_ZERSUM,	PARAM_STR,	"Zeroed %s stats with summary" },
  { SEVERITY_SUCC,  MSG_ZERNOSUM, PARAM_STR,	"Zeroed %s stats without summary" },
+ { SEVERITY_ERR,   MSG_HISTMIS,	PARAM_NONE,	"Missing history parameters" },
+ { SEVERITY_ERR,   MSG_HISTINV,	PARAM_STR,	"Invalid history parameter '%s'" },
+ { SEVERITY_ERR,   MSG_INVDEV,	PARAM_DEVMAX,	"Invalid device id %d - range is 0 - %d" },
+ { SEVERITY_SUCC,  MSG_HISTORY,	PARAM_STR,	"%s history" },
+ { SEVERITY_SUCC,  MSG_KEEPALIVE,	PARAM_NONE,	"Connection kept open for more requests" },
+ { SEVERITY_ERR,   MSG_NOKEEPALIVE,	PARAM_NONE,	"Keepalive is not supported on this platform" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -673,17 +700,10 @@ static struct io_data *_io_new(size_t initial, bool socket_buf)
 	return io_data;
 }
 
-static bool io_add(struct io_data *io_data, char *buf)
+// Make room for tot bytes in all, including the terminating null, with
+// dif of them already in use
+static bool io_grow(struct io_data *io_data, size_t dif, size_t tot)
 {
-	size_t len, dif, tot;
-
-	if (io_data->full)
-		return false;
-
-	len = strlen(buf);
-	dif = io_data->cur - io_data->ptr;
-	tot = len + 1 + dif;
-
 	if (tot > io_data->siz) {
 		size_t new = io_data->siz * 2;
 
@@ -706,12 +726,59 @@ static bool io_add(struct io_data *io_data, char *buf)
 		io_data->siz = new;
 	}
 
+	return true;
+}
+
+static bool io_add(struct io_data *io_data, char *buf)
+{
+	size_t len, dif, tot;
+
+	if (io_data->full)
+		return false;
+
+	len = strlen(buf);
+	dif = io_data->cur - io_data->ptr;
+	tot = len + 1 + dif;
+
+	if (!io_grow(io_data, dif, tot))
+		return false;
+
 	memcpy(io_data->cur, buf, len + 1);
 	io_data->cur += len;
 
 	return true;
 }
 
+static bool io_printf(struct io_data *io_data, const char *fmt, ...)
+{
+	va_list ap;
+	size_t dif;
+	int len;
+
+	if (io_data->full)
+		return false;
+
+	dif = io_data->cur - io_data->ptr;
+	va_start(ap, fmt);
+	len = vsnprintf(io_data->cur, io_data->siz - dif, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return false;
+
+	// Didn't fit, so grow and go again
+	if ((size_t)len >= io_data->siz - dif) {
+		if (!io_grow(io_data, dif, dif + len + 1))
+			return false;
+		va_start(ap, fmt);
+		vsnprintf(io_data->cur, io_data->siz - dif, fmt, ap);
+		va_end(ap);
+	}
+
+	io_data->cur += len;
+
+	return true;
+}
+
 static bool io_put(struct io_data *io_data, char *buf)
 {
 	io_reinit(io_data);
@@ -804,6 +871,80 @@ static char *escape_string(char *str, bool isjson)
 	return buf;
 }
 
+/*
+ * The api_data items of a reply, and the copies of their values, come from
+ * an arena that is emptied at the start of each request.  It is resized to
+ * the largest reply seen, after which building a reply costs no mallocs.
+ */
+#define API_ARENA_BLOCK	65536
+
+struct api_block {
+	struct api_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+static struct api_block *api_arena;
+
+static struct api_block *api_block_new(size_t size)
+{
+	struct api_block *block;
+
+	block = malloc(sizeof(*block) + size);
+	if (unlikely(!block))
+		quit(1, "Failed to malloc API arena");
+	block->size = size;
+	block->used = 0;
+	block->next = api_arena;
+	api_arena = block;
+
+	return block;
+}
+
+static void *api_alloc(size_t size)
+{
+	struct api_block *block = api_arena;
+	void *ptr;
+
+	size = (size + 7) & ~(size_t)7;
+	if (!block || block->used + size > block->size)
+		block = api_block_new(size > API_ARENA_BLOCK ? size : API_ARENA_BLOCK);
+
+	ptr = block->data + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+static void api_arena_free()
+{
+	struct api_block *block;
+
+	while ((block = api_arena)) {
+		api_arena = block->next;
+		free(block);
+	}
+}
+
+static void api_arena_reset()
+{
+	struct api_block *block;
+	size_t total = 0;
+
+	if (api_arena && !api_arena->next) {
+		api_arena->used = 0;
+		return;
+	}
+
+	// Outgrew one block, so swap them all for one that fits
+	for (block = api_arena; block; block = block->next)
+		total += block->size;
+	api_arena_free();
+	if (total)
+		api_block_new(total);
+}
+
 static struct api_data *api_add_extra(struct api_data *root, struct api_data *extra)
 {
 	struct api_data *tmp;
@@ -835,7 +976,7 @@ static struct api_data *api_add_data_full(struct api_data *root, char *name, enu
 {
 	struct api_data *api_data;
 
-	api_data = (struct api_data *)malloc(sizeof(struct api_data));
+	api_data = api_alloc(sizeof(struct api_data));
 
 	api_data->name = name;
 	api_data->type = type;
@@ -852,13 +993,11 @@ static struct api_data *api_add_data_full(struct api_data *root, char *name, enu
 		api_data->prev->next = api_data;
 	}
 
-	api_data->data_was_malloc = copy_data;
-
 	// Avoid crashing on bad data
 	if (data == NULL) {
 		api_data->type = type = API_CONST;
 		data = (void *)NULLSTR;
-		api_data->data_was_malloc = copy_data = false;
+		copy_data = false;
 	}
 
 	if (!copy_data)
@@ -872,23 +1011,23 @@ static struct api_data *api_add_data_full(struct api_data *root, char *name, enu
 			case API_ESCAPE:
 			case API_STRING:
 			case API_CONST:
-				api_data->data = (void *)malloc(strlen((char *)data) + 1);
+				api_data->data = api_alloc(strlen((char *)data) + 1);
 				strcpy((char*)(api_data->data), (char *)data);
 				break;
 			case API_INT:
-				api_data->data = (void *)malloc(sizeof(int));
+				api_data->data = api_alloc(sizeof(int));
 				*((int *)(api_data->data)) = *((int *)data);
 				break;
 			case API_UINT:
-				api_data->data = (void *)malloc(sizeof(unsigned int));
+				api_data->data = api_alloc(sizeof(unsigned int));
 				*((unsigned int *)(api_data->data)) = *((unsigned int *)data);
 				break;
 			case API_UINT32:
-				api_data->data = (void *)malloc(sizeof(uint32_t));
+				api_data->data = api_alloc(sizeof(uint32_t));
 				*((uint32_t *)(api_data->data)) = *((uint32_t *)data);
 				break;
 			case API_UINT64:
-				api_data->data = (void *)malloc(sizeof(uint64_t));
+				api_data->data = api_alloc(sizeof(uint64_t));
 				*((uint64_t *)(api_data->data)) = *((uint64_t *)data);
 				break;
 			case API_DOUBLE:
@@ -899,34 +1038,32 @@ static struct api_data *api_add_data_full(struct api_data *root, char *name, enu
 			case API_FREQ:
 			case API_HS:
 			case API_DIFF:
-				api_data->data = (void *)malloc(sizeof(double));
+				api_data->data = api_alloc(sizeof(double));
 				*((double *)(api_data->data)) = *((double *)data);
 				break;
 			case API_BOOL:
-				api_data->data = (void *)malloc(sizeof(bool));
+				api_data->data = api_alloc(sizeof(bool));
 				*((bool *)(api_data->data)) = *((bool *)data);
 				break;
 			case API_TIMEVAL:
-				api_data->data = (void *)malloc(sizeof(struct timeval));
+				api_data->data = api_alloc(sizeof(struct timeval));
 				memcpy(api_data->data, data, sizeof(struct timeval));
 				break;
 			case API_TIME:
-				api_data->data = (void *)malloc(sizeof(time_t));
+				api_data->data = api_alloc(sizeof(time_t));
 				*(time_t *)(api_data->data) = *((time_t *)data);
 				break;
 			case API_VOLTS:
 			case API_TEMP:
-				api_data->data = (void *)malloc(sizeof(float));
+				api_data->data = api_alloc(sizeof(float));
 				*((float *)(api_data->data)) = *((float *)data);
 				break;
 			case API_JSON:
-				api_data->data_was_malloc = false;
 				api_data->data = (void *)json_deep_copy((json_t *)data);
 				break;
 			default:
 				applog(LOG_ERR, "API: unknown1 data type %d ignored", type);
 				api_data->type = API_STRING;
-				api_data->data_was_malloc = false;
 				api_data->data = (void *)UNKNOWN;
 				break;
 		}
@@ -1039,131 +1176,116 @@ struct api_data *api_add_json(struct api_data *root, char *name, json_t *data, b
 	return api_add_data_full(root, name, API_JSON, (void *)data, copy_data);
 }
 
-static struct api_data *print_data(struct api_data *root, char *buf, bool isjson, bool precom)
+// Appends one record straight to io_data, or nothing if it doesn't all fit
+static struct api_data *print_data(struct io_data *io_data, struct api_data *root, bool isjson, bool precom)
 {
-	struct api_data *tmp;
+	struct api_data *item;
+	size_t start = io_data->cur - io_data->ptr;
 	bool first = true;
 	char *original, *escape;
 	char *quote;
 
-	*buf = '\0';
-
-	if (precom) {
-		*(buf++) = *COMMA;
-		*buf = '\0';
-	}
+	if (precom)
+		io_add(io_data, (char *)COMMA);
 
 	if (isjson) {
-		strcpy(buf, JSON0);
-		buf = strchr(buf, '\0');
+		io_add(io_data, JSON0);
 		quote = JSON1;
 	} else
 		quote = (char *)BLANK;
 
-	while (root) {
+	for (item = root; item; item = (item->next == root) ? NULL : item->next) {
 		if (!first)
-			*(buf++) = *COMMA;
+			io_add(io_data, (char *)COMMA);
 		else
 			first = false;
 
-		sprintf(buf, "%s%s%s%s", quote, root->name, quote, isjson ? ":" : "=");
-
-		buf = strchr(buf, '\0');
+		io_printf(io_data, "%s%s%s%s", quote, item->name, quote, isjson ? ":" : "=");
 
-		switch(root->type) {
+		switch(item->type) {
 			case API_STRING:
 			case API_CONST:
-				sprintf(buf, "%s%s%s", quote, (char *)(root->data), quote);
+				io_printf(io_data, "%s%s%s", quote, (char *)(item->data), quote);
 				break;
 			case API_ESCAPE:
-				original = (char *)(root->data);
-				escape = escape_string((char *)(root->data), isjson);
-				sprintf(buf, "%s%s%s", quote, escape, quote);
+				original = (char *)(item->data);
+				escape = escape_string((char *)(item->data), isjson);
+				io_printf(io_data, "%s%s%s", quote, escape, quote);
 				if (escape != original)
 					free(escape);
 				break;
 			case API_INT:
-				sprintf(buf, "%d", *((int *)(root->data)));
+				io_printf(io_data, "%d", *((int *)(item->data)));
 				break;
 			case API_UINT:
-				sprintf(buf, "%u", *((unsigned int *)(root->data)));
+				io_printf(io_data, "%u", *((unsigned int *)(item->data)));
 				break;
 			case API_UINT32:
-				sprintf(buf, "%"PRIu32, *((uint32_t *)(root->data)));
+				io_printf(io_data, "%"PRIu32, *((uint32_t *)(item->data)));
 				break;
 			case API_UINT64:
-				sprintf(buf, "%"PRIu64, *((uint64_t *)(root->data)));
+				io_printf(io_data, "%"PRIu64, *((uint64_t *)(item->data)));
 				break;
 			case API_TIME:
-				sprintf(buf, "%lu", *((unsigned long *)(root->data)));
+				io_printf(io_data, "%lu", *((unsigned long *)(item->data)));
 				break;
 			case API_DOUBLE:
-				sprintf(buf, "%f", *((double *)(root->data)));
+				io_printf(io_data, "%f", *((double *)(item->data)));
 				break;
 			case API_ELAPSED:
-				sprintf(buf, "%.0f", *((double *)(root->data)));
+				io_printf(io_data, "%.0f", *((double *)(item->data)));
 				break;
 			case API_UTILITY:
 			case API_FREQ:
 			case API_MHS:
-				sprintf(buf, "%.2f", *((double *)(root->data)));
+				io_printf(io_data, "%.2f", *((double *)(item->data)));
 				break;
 			case API_VOLTS:
-				sprintf(buf, "%.3f", *((float *)(root->data)));
+				io_printf(io_data, "%.3f", *((float *)(item->data)));
 				break;
 			case API_MHTOTAL:
-				sprintf(buf, "%.4f", *((double *)(root->data)));
+				io_printf(io_data, "%.4f", *((double *)(item->data)));
 				break;
 			case API_HS:
-				sprintf(buf, "%.15f", *((double *)(root->data)));
+				io_printf(io_data, "%.15f", *((double *)(item->data)));
 				break;
 			case API_DIFF:
-				sprintf(buf, "%.8f", *((double *)(root->data)));
+				io_printf(io_data, "%.8f", *((double *)(item->data)));
 				break;
 			case API_BOOL:
-				sprintf(buf, "%s", *((bool *)(root->data)) ? TRUESTR : FALSESTR);
+				io_add(io_data, (char *)(*((bool *)(item->data)) ? TRUESTR : FALSESTR));
 				break;
 			case API_TIMEVAL:
-				sprintf(buf, "%"PRIu64".%06lu",
-					(uint64_t)((struct timeval *)(root->data))->tv_sec,
-					(unsigned long)((struct timeval *)(root->data))->tv_usec);
+				io_printf(io_data, "%"PRIu64".%06lu",
+					(uint64_t)((struct timeval *)(item->data))->tv_sec,
+					(unsigned long)((struct timeval *)(item->data))->tv_usec);
 				break;
 			case API_TEMP:
-				sprintf(buf, "%.2f", *((float *)(root->data)));
+				io_printf(io_data, "%.2f", *((float *)(item->data)));
 				break;
 			case API_JSON:
-				escape = json_dumps((json_t *)(root->data), JSON_COMPACT);
-				strcpy(buf, escape);
+				escape = json_dumps((json_t *)(item->data), JSON_COMPACT);
+				io_add(io_data, escape);
 				free(escape);
+				json_decref((json_t *)item->data);
 				break;
 			default:
-				applog(LOG_ERR, "API: unknown2 data type %d ignored", root->type);
-				sprintf(buf, "%s%s%s", quote, UNKNOWN, quote);
+				applog(LOG_ERR, "API: unknown2 data type %d ignored", item->type);
+				io_printf(io_data, "%s%s%s", quote, UNKNOWN, quote);
 				break;
 		}
+	}
 
-		buf = strchr(buf, '\0');
-
-		if (root->type == API_JSON)
-			json_decref((json_t *)root->data);
-		if (root->data_was_malloc)
-			free(root->data);
+	io_add(io_data, isjson ? JSON5 : SEPSTR);
 
-		if (root->next == root) {
-			free(root);
-			root = NULL;
-		} else {
-			tmp = root;
-			root = tmp->next;
-			root->prev = tmp->prev;
-			root->prev->next = root;
-			free(tmp);
-		}
+	// Drop a record that didn't fit rather than send half of it
+	if (io_data->full) {
+		io_data->cur = io_data->ptr + start;
+		*(io_data->cur) = '\0';
 	}
 
-	strcpy(buf, isjson ? JSON5 : SEPSTR);
-
-	return root;
+	// The items themselves go when the arena is reset
+	return NULL;
 }
 
 #ifdef HAVE_AN_FPGA
@@ -1215,7 +1337,6 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 {
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
-	char buf2[TMPBUFSIZ];
 	char severity[2];
 #ifdef HAVE_AN_FPGA
 	int pga;
@@ -1285,6 +1406,9 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 				case PARAM_POOLMAX:
 					sprintf(buf, codes[i].description, paramid, total_pools - 1);
 					break;
+				case PARAM_DEVMAX:
+					sprintf(buf, codes[i].description, paramid, total_devices - 1);
+					break;
 				case PARAM_DMAX:
 #ifdef HAVE_AN_FPGA
 					pga = numpgas();
@@ -1334,8 +1458,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 			root = api_add_escape(root, "Msg", buf, false);
 			root = api_add_escape(root, "Description", opt_api_description, false);
 
-			root = print_data(root, buf2, isjson, false);
-			io_add(io_data, buf2);
+			root = print_data(io_data, root, isjson, false);
 			if (isjson)
 				io_add(io_data, JSON_CLOSE);
 			return;
@@ -1350,8 +1473,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 	root = api_add_escape(root, "Msg", buf, false);
 	root = api_add_escape(root, "Description", opt_api_description, false);
 
-	root = print_data(root, buf2, isjson, false);
-	io_add(io_data, buf2);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson)
 		io_add(io_data, JSON_CLOSE);
 }
@@ -1359,7 +1481,6 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_VERSION, 0, NULL, isjson);
@@ -1368,8 +1489,7 @@ static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	root = api_add_string(root, "CGMiner", VERSION, false);
 	root = api_add_const(root, "API", APIVERSION, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1377,7 +1497,6 @@ static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int gpucount = 0;
 	int pgacount = 0;
@@ -1430,8 +1549,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 	root = api_add_string(root, "Coinbase-Sig", opt_coinbase_sig, true);
 #endif
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1466,7 +1584,6 @@ static const char *status2str(enum alive status)
 static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	int n = 0, i;
 
 	cgpu->utility = cgpu->accepted / ( total_secs ? total_secs : 1 ) * 60;
@@ -1490,14 +1607,12 @@ static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 	if (cgpu->api->get_api_extra_device_detail)
 		root = api_add_extra(root, cgpu->api->get_api_extra_device_detail(cgpu));
 
-	root = print_data(root, buf, isjson, precom);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, precom);
 }
 
 static void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	int n = 0, i;
 
 	cgpu->utility = cgpu->accepted / ( total_secs ? total_secs : 1 ) * 60;
@@ -1524,6 +1639,7 @@ static void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 	root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
 	root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
 	root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
+	root = api_add_int(root, "Duplicate Nonces", &(cgpu->dup_nonces), false);
 	root = api_add_utility(root, "Utility", &(cgpu->utility), false);
 	int last_share_pool = cgpu->last_share_pool_time > 0 ?
 				cgpu->last_share_pool : -1;
@@ -1537,8 +1653,7 @@ static void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 	if (cgpu->api->get_api_extra_device_status)
 		root = api_add_extra(root, cgpu->api->get_api_extra_device_status(cgpu));
 
-	root = print_data(root, buf, isjson, precom);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, precom);
 }
 
 #ifdef HAVE_OPENCL
@@ -1847,9 +1962,9 @@ static void cpudev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	char *status, *lp;
+	bool standby;
 	int i;
 
 	if (total_pools == 0) {
@@ -1891,6 +2006,8 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		else
 			lp = (char *)NO;
 
+		standby = pool_standby(pool);
+
 		root = api_add_int(root, "POOL", &i, false);
 		root = api_add_escape(root, "URL", pool->rpc_url, false);
 		root = api_add_string(root, "Status", status, false);
@@ -1921,9 +2038,12 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		else
 			root = api_add_const(root, "Stratum URL", BLANK, false);
 		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
+		root = api_add_bool(root, "Standby", &standby, true);
+		root = api_add_uint(root, "Failovers", &(pool->failovers), false);
+		root = api_add_double(root, "Failover Time", &(pool->failover_time), false);
+		root = api_add_double(root, "Adaptive Weight", &(pool->adaptive_weight), false);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
@@ -1933,7 +2053,6 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	double utility, mhs, work_utility;
 
@@ -1980,8 +2099,7 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 
 	mutex_unlock(&hash_lock);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2097,7 +2215,6 @@ static void gpurestart(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int numgpu = 0;
 
@@ -2110,8 +2227,7 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &numgpu, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2119,7 +2235,6 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -2132,8 +2247,7 @@ static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2141,7 +2255,6 @@ static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -2154,8 +2267,7 @@ static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2618,7 +2730,6 @@ void privileged(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_un
 void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *reason;
 
 	if (cgpu->device_last_not_well == 0)
@@ -2676,8 +2787,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	root = api_add_int(root, "*Dev Comms Error", &(cgpu->dev_comms_error_count), false);
 	root = api_add_int(root, "*Dev Throttle", &(cgpu->dev_throttle_count), false);
 
-	root = print_data(root, buf, isjson, isjson && (device > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (device > 0));
 }
 
 static void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, char group)
@@ -2705,7 +2815,6 @@ static void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 static void devdetails(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	struct cgpu_info *cgpu;
 	int i;
@@ -2731,8 +2840,7 @@ static void devdetails(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_const(root, "Model", cgpu->name ? : BLANK, false);
 		root = api_add_const(root, "Device Path", cgpu->device_path ? : BLANK, false);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
@@ -2773,7 +2881,6 @@ void dosave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, b
 static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_stats *stats, struct cgminer_pool_stats *pool_stats, struct api_data *extra, bool isjson)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	double elapsed;
 
 	root = api_add_int(root, "STATS", &i, false);
@@ -2807,13 +2914,20 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_uint64(root, "Bytes Recv", &(pool_stats->bytes_received), false);
 		root = api_add_uint64(root, "Net Bytes Sent", &(pool_stats->net_bytes_sent), false);
 		root = api_add_uint64(root, "Net Bytes Recv", &(pool_stats->net_bytes_received), false);
+		root = api_add_uint32(root, "Stratum RTT Count", &(pool_stats->stratum_rtt_count), false);
+		root = api_add_double(root, "Stratum RTT", &(pool_stats->stratum_rtt), false);
+		root = api_add_double(root, "Stratum RTT Av", &(pool_stats->stratum_rtt_rolling), false);
+		root = api_add_double(root, "Stratum RTT Max", &(pool_stats->stratum_rtt_max), false);
+		root = api_add_double(root, "Stratum RTT Min", &(pool_stats->stratum_rtt_min), false);
+		root = api_add_uint32(root, "Notify Count", &(pool_stats->notify_count), false);
+		root = api_add_double(root, "Notify Interval Av", &(pool_stats->notify_interval_rolling), false);
+		root = api_add_double(root, "Notify Interval Max", &(pool_stats->notify_interval_max), false);
 	}
 
 	if (extra)
 		root = api_add_extra(root, extra);
 
-	root = print_data(root, buf, isjson, isjson && (i > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (i > 0));
 
 	return ++i;
 }
@@ -2880,7 +2994,6 @@ static void failoveronly(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_MINECOIN, 0, NULL, isjson);
@@ -2906,8 +3019,7 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_bool(root, "LP", &have_longpoll, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2915,7 +3027,6 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	if (param == NULL)
@@ -2985,8 +3096,7 @@ static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	root = api_add_bool(root, "PerDevice", &want_per_device_stats, false);
 	root = api_add_bool(root, "WorkTime", &opt_worktime, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3144,6 +3254,132 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 		message(io_data, MSG_ZERNOSUM, 0, all ? "All" : "BestShare", isjson);
 }
 
+static void gethistory(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	struct history_sample *samples;
+	struct history **histp;
+	char name[TMPBUFSIZ];
+	enum history_res res;
+	bool io_open = false;
+	bool dev;
+	char *ptr;
+	int count, id, i;
+
+	if (param == NULL || *param == '\0') {
+		message(io_data, MSG_HISTMIS, 0, NULL, isjson);
+		return;
+	}
+
+	ptr = strchr(param, ',');
+	if (ptr)
+		*(ptr++) = '\0';
+
+	if (strcasecmp(param, "dev") == 0)
+		dev = true;
+	else if (strcasecmp(param, "pool") == 0)
+		dev = false;
+	else {
+		message(io_data, MSG_HISTINV, 0, param, isjson);
+		return;
+	}
+
+	if (dev && total_devices == 0) {
+		message(io_data, MSG_NODEVS, 0, NULL, isjson);
+		return;
+	}
+	if (!dev && total_pools == 0) {
+		message(io_data, MSG_NOPOOL, 0, NULL, isjson);
+		return;
+	}
+
+	if (!ptr || !*ptr) {
+		message(io_data, dev ? MSG_MISID : MSG_MISPID, 0, NULL, isjson);
+		return;
+	}
+
+	id = atoi(ptr);
+	ptr = strchr(ptr, ',');
+	if (ptr)
+		*(ptr++) = '\0';
+
+	// Per second unless asked otherwise
+	res = HISTORY_SEC;
+	if (ptr && *ptr) {
+		for (res = 0; res < HISTORY_RES; res++)
+			if (strcasecmp(ptr, history_res_names[res]) == 0)
+				break;
+		if (res == HISTORY_RES) {
+			message(io_data, MSG_HISTINV, 0, ptr, isjson);
+			return;
+		}
+	}
+
+	if (dev) {
+		struct cgpu_info *cgpu;
+
+		if (id < 0 || id >= total_devices) {
+			message(io_data, MSG_INVDEV, id, NULL, isjson);
+			return;
+		}
+		cgpu = devices[id];
+		histp = &cgpu->history;
+		sprintf(name, "%s %d %s", cgpu->api->name, cgpu->device_id, history_res_names[res]);
+	} else {
+		if (id < 0 || id >= total_pools) {
+			message(io_data, MSG_INVPID, id, NULL, isjson);
+			return;
+		}
+		histp = &pools[id]->history;
+		sprintf(name, "Pool %d %s", id, history_res_names[res]);
+	}
+
+	count = history_get(histp, res, &samples);
+
+	message(io_data, MSG_HISTORY, 0, name, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_HISTORY);
+
+	for (i = 0; i < count; i++) {
+		struct history_sample *sample = &samples[i];
+		double secs = sample->ms / 1000.0;
+
+		root = api_add_int(root, "HISTORY", &i, true);
+		root = api_add_time(root, "When", &(sample->when), false);
+		root = api_add_elapsed(root, "Elapsed", &secs, true);
+		// Pools don't know how many hashes went into their shares
+		if (dev) {
+			double mhs = sample->ms ? (double)sample->hashes / sample->ms / 1000.0 : 0;
+
+			root = api_add_mhs(root, "MHS", &mhs, true);
+		}
+		root = api_add_diff(root, "Difficulty Accepted", &(sample->diff_accepted), false);
+		root = api_add_diff(root, "Difficulty Rejected", &(sample->diff_rejected), false);
+		root = api_add_int(root, "Hardware Errors", &(sample->hw_errors), false);
+
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+
+	free(samples);
+}
+
+// Set by the keepalive command for the client that sent it
+static bool keepalive_asked;
+
+static void keepalive(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	keepalive_asked = true;
+	message(io_data, MSG_KEEPALIVE, 0, NULL, isjson);
+#else
+	message(io_data, MSG_NOKEEPALIVE, 0, NULL, isjson);
+#endif
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
 struct CMDS {
@@ -3204,13 +3440,14 @@ struct CMDS {
 	{ "pgaset",		pgaset,		true },
 #endif
 	{ "zero",		dozero,		true },
+	{ "history",		gethistory,	false },
+	{ "keepalive",		keepalive,	false },
 	{ NULL,			NULL,		false }
 };
 
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	char cmdbuf[100];
 	bool found, access;
@@ -3241,17 +3478,129 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 	root = api_add_const(root, "Exists", found ? YES : NO, false);
 	root = api_add_const(root, "Access", access ? YES : NO, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+#ifdef HAVE_SYS_EPOLL_H
+struct api_client {
+	SOCKETTYPE fd;
+	int slot;
+	char group;
+	char addr[16];
+	time_t last;
+	bool persist;	// asked for keepalive so more requests may follow
+	bool eof;
+	bool closing;	// close once the replies are out
+	bool writing;	// waiting for EPOLLOUT
+	int inlen;
+	char in[TMPBUFSIZ];
+	char *out;
+	size_t outsiz, outlen, outpos;
+};
+
+static struct api_client *api_clients[API_CLIENTS];
+// The client whose request is being processed
+static struct api_client *api_current;
+static int api_epfd = -1;
+
+static void api_client_queue(struct api_client *client, char *buf, size_t len)
+{
+	if (client->outlen + len > client->outsiz) {
+		size_t new = client->outsiz * 2;
+
+		if (new < client->outlen + len)
+			new = client->outlen + len;
+		client->out = realloc(client->out, new);
+		if (unlikely(!client->out))
+			quit(1, "Failed to realloc API client buffer");
+		client->outsiz = new;
+	}
+
+	memcpy(client->out + client->outlen, buf, len);
+	client->outlen += len;
+}
+
+// Returns true once all queued replies have been sent
+static bool api_client_flush(struct api_client *client)
+{
+	int n;
+
+	while (client->outpos < client->outlen) {
+		n = send(client->fd, client->out + client->outpos, client->outlen - client->outpos, 0);
+		if (SOCKETFAIL(n)) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+
+			applog(LOG_WARNING, "API: send failed: %s", SOCKERRMSG);
+			client->closing = true;
+			break;
+		}
+
+		applog(LOG_DEBUG, "API: sent %d", n);
+		client->outpos += n;
+		client->last = time(NULL);
+	}
+
+	client->outpos = client->outlen = 0;
+	return true;
+}
+
+static void api_client_new(SOCKETTYPE c, char group, char *connectaddr)
+{
+	struct api_client *client;
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < API_CLIENTS; i++)
+		if (!api_clients[i])
+			break;
+	if (i == API_CLIENTS) {
+		applog(LOG_WARNING, "API: too many clients, dropping %s", connectaddr);
+		CLOSESOCKET(c);
+		return;
+	}
+
+	client = calloc(1, sizeof(*client));
+	if (unlikely(!client))
+		quit(1, "Failed to calloc API client");
+	client->fd = c;
+	client->slot = i;
+	client->group = group;
+	strncpy(client->addr, connectaddr, sizeof(client->addr) - 1);
+	client->last = time(NULL);
+
+	fcntl(c, F_SETFL, fcntl(c, F_GETFL, 0) | O_NONBLOCK);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	if (epoll_ctl(api_epfd, EPOLL_CTL_ADD, c, &ev)) {
+		applog(LOG_WARNING, "API: epoll_ctl failed: %s", SOCKERRMSG);
+		CLOSESOCKET(c);
+		free(client);
+		return;
+	}
+
+	api_clients[i] = client;
+}
+
+static void api_client_free(struct api_client *client)
+{
+	// Closing removes it from the epoll set
+	CLOSESOCKET(client->fd);
+	api_clients[client->slot] = NULL;
+	free(client->out);
+	free(client);
+}
+#endif
+
+static void send_result(struct io_data *io_data, __maybe_unused SOCKETTYPE c, bool isjson)
 {
 	char buf[SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END)];
 	int len;
-	int n;
 
 	strcpy(buf, io_data->ptr);
 
@@ -3269,13 +3618,18 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 
 	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", len+1, buf, len > 10 ? "..." : BLANK);
 
+#ifdef HAVE_SYS_EPOLL_H
+	// api_client_flush() sends it when the socket can take it
+	api_client_queue(api_current, buf, len+1);
+#else
 	// ignore failure - it's closed immediately anyway
-	n = send(c, buf, len+1, 0);
+	int n = send(c, buf, len+1, 0);
 
 	if (SOCKETFAIL(n))
 		applog(LOG_WARNING, "API: send failed: %s", SOCKERRMSG);
 	else
 		applog(LOG_DEBUG, "API: sent %d", n);
+#endif
 }
 
 static void tidyup(__maybe_unused void *arg)
@@ -3295,7 +3649,21 @@ static void tidyup(__maybe_unused void *arg)
 		ipaccess = NULL;
 	}
 
+#ifdef HAVE_SYS_EPOLL_H
+	int i;
+
+	for (i = 0; i < API_CLIENTS; i++)
+		if (api_clients[i])
+			api_client_free(api_clients[i]);
+
+	if (api_epfd >= 0) {
+		close(api_epfd);
+		api_epfd = -1;
+	}
+#endif
+
 	io_free();
+	api_arena_free();
 
 	mutex_unlock(&quit_restart_lock);
 }
@@ -3454,10 +3822,11 @@ static void setup_groups()
 /*
  * N.B. IP4 addresses are by Definition 32bit big endian on all platforms
  */
-static void setup_ipaccess()
+static struct IP4ACCESS *parse_ipaccess(int *count)
 {
+	struct IP4ACCESS *list;
 	char *buf, *ptr, *comma, *slash, *dot;
-	int ipcount, mask, octet, i;
+	int ipcount, mask, octet, i, n;
 	char group;
 
 	buf = malloc(strlen(opt_api_allow) + 1);
@@ -3473,11 +3842,11 @@ static void setup_ipaccess()
 			ipcount++;
 
 	// possibly more than needed, but never less
-	ipaccess = calloc(ipcount, sizeof(struct IP4ACCESS));
-	if (unlikely(!ipaccess))
+	list = calloc(ipcount, sizeof(struct IP4ACCESS));
+	if (unlikely(!list))
 		quit(1, "Failed to calloc ipaccess");
 
-	ips = 0;
+	n = 0;
 	ptr = buf;
 	while (ptr && *ptr) {
 		while (*ptr == ' ' || *ptr == '\t')
@@ -3501,28 +3870,28 @@ static void setup_ipaccess()
 			ptr += 2;
 		}
 
-		ipaccess[ips].group = group;
+		list[n].group = group;
 
 		if (strcmp(ptr, ALLIP4) == 0)
-			ipaccess[ips].ip = ipaccess[ips].mask = 0;
+			list[n].ip = list[n].mask = 0;
 		else {
 			slash = strchr(ptr, '/');
 			if (!slash)
-				ipaccess[ips].mask = 0xffffffff;
+				list[n].mask = 0xffffffff;
 			else {
 				*(slash++) = '\0';
 				mask = atoi(slash);
 				if (mask < 1 || mask > 32)
 					goto popipo; // skip invalid/zero
 
-				ipaccess[ips].mask = 0;
+				list[n].mask = 0;
 				while (mask-- >= 0) {
 					octet = 1 << (mask % 8);
-					ipaccess[ips].mask |= (octet << (24 - (8 * (mask >> 3))));
+					list[n].mask |= (octet << (24 - (8 * (mask >> 3))));
 				}
 			}
 
-			ipaccess[ips].ip = 0; // missing default to '.0'
+			list[n].ip = 0; // missing default to '.0'
 			for (i = 0; ptr && (i < 4); i++) {
 				dot = strchr(ptr, '.');
 				if (dot)
@@ -3532,22 +3901,433 @@ static void setup_ipaccess()
 				if (octet < 0 || octet > 0xff)
 					goto popipo; // skip invalid
 
-				ipaccess[ips].ip |= (octet << (24 - (i * 8)));
+				list[n].ip |= (octet << (24 - (i * 8)));
 
 				ptr = dot;
 			}
 
-			ipaccess[ips].ip &= ipaccess[ips].mask;
+			list[n].ip &= list[n].mask;
 		}
 
-		ips++;
+		n++;
 popipo:
 		ptr = comma;
 	}
 
 	free(buf);
+	*count = n;
+	return list;
 }
 
+static void setup_ipaccess()
+{
+	ipaccess = parse_ipaccess(&ips);
+}
+
+static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *group)
+{
+	bool addrok = false;
+	int i;
+
+	*connectaddr = inet_ntoa(cli->sin_addr);
+
+	*group = NOPRIVGROUP;
+	if (opt_api_allow) {
+		int client_ip = htonl(cli->sin_addr.s_addr);
+		for (i = 0; i < ips; i++) {
+			if ((client_ip & ipaccess[i].mask) == ipaccess[i].ip) {
+				addrok = true;
+				*group = ipaccess[i].group;
+				break;
+			}
+		}
+	} else {
+		if (opt_api_network)
+			addrok = true;
+		else
+			addrok = (strcmp(*connectaddr, localaddr) == 0);
+	}
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: connection from %s - %s", *connectaddr, addrok ? "Accepted" : "Ignored");
+
+	return addrok;
+}
+
+/* The stratum proxy and metrics listeners follow the same --api-allow and
+ * --api-network rules as the API, ignoring groups.  They keep their own copy
+ * of the list since the API's is freed when it restarts */
+static pthread_mutex_t extaccess_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct IP4ACCESS *extaccess;
+static int extips = -1;
+
+void api_listen_addr(struct sockaddr_in *serv)
+{
+	if (!opt_api_allow && !opt_api_network)
+		serv->sin_addr.s_addr = inet_addr(localaddr);
+	else
+		serv->sin_addr.s_addr = htonl(INADDR_ANY);
+}
+
+bool api_access_allowed(struct sockaddr_in *cli)
+{
+	in_addr_t client_ip;
+	int i;
+
+	if (!opt_api_allow)
+		return opt_api_network || cli->sin_addr.s_addr == inet_addr(localaddr);
+
+	mutex_lock(&extaccess_lock);
+	if (extips < 0)
+		extaccess = parse_ipaccess(&extips);
+	mutex_unlock(&extaccess_lock);
+
+	client_ip = htonl(cli->sin_addr.s_addr);
+	for (i = 0; i < extips; i++)
+		if ((client_ip & extaccess[i].mask) == extaccess[i].ip)
+			return true;
+
+	return false;
+}
+
+/*
+ * Run one request of n bytes in buf (which is modified) and send the reply
+ */
+static void process_request(struct io_data *io_data, SOCKETTYPE c, char *buf, int n, char group, char *connectaddr)
+{
+	char param_buf[TMPBUFSIZ];
+	char cmdbuf[100];
+	char *cmd = NULL;
+	char *param;
+	json_error_t json_err;
+	json_t *json_config = NULL;
+	json_t *json_val;
+	bool isjson;
+	bool did;
+	int i;
+
+	// the time of the request in now
+	when = time(NULL);
+	io_reinit(io_data);
+	api_arena_reset();
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, n, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, c, isjson);
+			did = true;
+		}
+		else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, c, isjson);
+				did = true;
+			}
+			else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				}
+				else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+		}
+	}
+
+	if (!did)
+		for (i = 0; cmds[i].name != NULL; i++) {
+			if (strcmp(cmd, cmds[i].name) == 0) {
+				sprintf(cmdbuf, "|%s|", cmd);
+				if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+					(cmds[i].func)(io_data, c, param, isjson, group);
+				else {
+					message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+					applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+				}
+
+				send_result(io_data, c, isjson);
+				did = true;
+				break;
+			}
+		}
+
+	if (isjson)
+		json_decref(json_config);
+
+	if (!did) {
+		message(io_data, MSG_INVCMD, 0, NULL, isjson);
+		send_result(io_data, c, isjson);
+	}
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void api_client_request(struct io_data *io_data, struct api_client *client, int len)
+{
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: recv command: (%d) '%s'", len, client->in);
+
+	api_current = client;
+	keepalive_asked = false;
+	process_request(io_data, client->fd, client->in, len, client->group, client->addr);
+	api_current = NULL;
+
+	if (keepalive_asked)
+		client->persist = true;
+	else if (!client->persist)
+		client->closing = true;
+}
+
+/*
+ * Answer the complete requests buffered for a client, one at a time so
+ * that replies never pile up behind a client that is not reading them.
+ * Until it asks for keepalive, a client's first request is answered and
+ * the connection closed, whether or not it ended with a newline.
+ */
+static void api_client_run(struct io_data *io_data, struct api_client *client)
+{
+	struct epoll_event ev;
+	char *nl;
+	int len, used;
+
+	while (!bye && api_client_flush(client) && !client->closing) {
+		nl = memchr(client->in, '\n', client->inlen);
+		if (nl) {
+			used = nl - client->in + 1;
+			len = used - 1;
+			*nl = '\0';
+			if (len && client->in[len - 1] == '\r')
+				client->in[--len] = '\0';
+
+			if (len)
+				api_client_request(io_data, client, len);
+
+			client->inlen -= used;
+			memmove(client->in, client->in + used, client->inlen);
+			continue;
+		}
+
+		// No newline: a one-shot request, or the last one before EOF
+		if (client->inlen && (!client->persist || client->eof)) {
+			client->in[client->inlen] = '\0';
+			api_client_request(io_data, client, client->inlen);
+			client->inlen = 0;
+			if (client->eof)
+				client->closing = true;
+			continue;
+		}
+
+		if (client->inlen == TMPBUFSIZ - 1) {
+			applog(LOG_DEBUG, "API: request from %s too long", client->addr);
+			client->closing = true;
+		}
+		if (client->eof)
+			client->closing = true;
+		break;
+	}
+
+	if (client->closing && !client->outlen) {
+		api_client_free(client);
+		return;
+	}
+
+	if (client->writing != !!client->outlen) {
+		client->writing = !!client->outlen;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = client->writing ? EPOLLOUT : EPOLLIN;
+		ev.data.ptr = client;
+		epoll_ctl(api_epfd, EPOLL_CTL_MOD, client->fd, &ev);
+	}
+}
+
+static void api_client_event(struct io_data *io_data, struct api_client *client, uint32_t events)
+{
+	int n;
+
+	if (events & EPOLLERR) {
+		api_client_free(client);
+		return;
+	}
+
+	if (events & (EPOLLIN | EPOLLHUP)) {
+		n = recv(client->fd, client->in + client->inlen, TMPBUFSIZ - 1 - client->inlen, 0);
+		if (n == 0)
+			client->eof = true;
+		else if (SOCKETFAIL(n)) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+				api_client_free(client);
+				return;
+			}
+		} else {
+			client->inlen += n;
+			client->last = time(NULL);
+		}
+	}
+
+	api_client_run(io_data, client);
+}
+
+/*
+ * Serve all API clients from this one thread with epoll.  Every socket is
+ * non-blocking, so a slow client only ever holds up itself.  Requests are
+ * answered and the connection closed, exactly as before, unless the client
+ * sends 'keepalive'; after that it can send newline terminated requests for
+ * as long as it likes.  Clients that go quiet for API_TIMEOUT seconds are
+ * dropped.
+ */
+static void api_serve(struct io_data *io_data)
+{
+	struct epoll_event ev, events[API_EVENTS];
+	struct api_client *client;
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	char *connectaddr;
+	char group;
+	SOCKETTYPE c;
+	time_t now, lastcheck = 0;
+	int i, n;
+
+	api_epfd = epoll_create(API_CLIENTS);
+	if (api_epfd < 0) {
+		applog(LOG_ERR, "API epoll_create failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+		return;
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(api_epfd, EPOLL_CTL_ADD, sock, &ev)) {
+		applog(LOG_ERR, "API epoll_ctl failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+		return;
+	}
+
+	while (!bye) {
+		n = epoll_wait(api_epfd, events, API_EVENTS, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			applog(LOG_ERR, "API epoll_wait failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+			return;
+		}
+
+		for (i = 0; i < n && !bye; i++) {
+			client = events[i].data.ptr;
+			if (client) {
+				api_client_event(io_data, client, events[i].events);
+				continue;
+			}
+
+			while (42) {
+				clisiz = sizeof(cli);
+				c = accept(sock, (struct sockaddr *)(&cli), &clisiz);
+				if (SOCKETFAIL(c)) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+						applog(LOG_WARNING, "API accept failed: %s", SOCKERRMSG);
+					break;
+				}
+
+				if (!check_connect(&cli, &connectaddr, &group))
+					CLOSESOCKET(c);
+				else
+					api_client_new(c, group, connectaddr);
+			}
+		}
+
+		now = time(NULL);
+		if (now != lastcheck) {
+			lastcheck = now;
+			for (i = 0; i < API_CLIENTS; i++) {
+				client = api_clients[i];
+				if (client && now - client->last > API_TIMEOUT) {
+					applog(LOG_DEBUG, "API: %s timed out", client->addr);
+					api_client_free(client);
+				}
+			}
+		}
+	}
+
+	// Let a quit or restart reply get out before the sockets close
+	for (i = 0; i < API_CLIENTS; i++)
+		if (api_clients[i])
+			api_client_flush(api_clients[i]);
+}
+#else
+static void api_serve(struct io_data *io_data)
+{
+	char buf[TMPBUFSIZ];
+	SOCKETTYPE c;
+	int n;
+	char *connectaddr;
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	char group;
+
+	while (!bye) {
+		clisiz = sizeof(cli);
+		if (SOCKETFAIL(c = accept(sock, (struct sockaddr *)(&cli), &clisiz))) {
+			applog(LOG_ERR, "API failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
+			return;
+		}
+
+		if (check_connect(&cli, &connectaddr, &group)) {
+			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
+			if (SOCKETFAIL(n))
+				buf[0] = '\0';
+			else
+				buf[n] = '\0';
+
+			if (opt_debug) {
+				if (SOCKETFAIL(n))
+					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+				else
+					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
+			}
+
+			if (!SOCKETFAIL(n))
+				process_request(io_data, c, buf, n, group, connectaddr);
+		}
+		CLOSESOCKET(c);
+	}
+}
+#endif
+
 static void *quit_thread(__maybe_unused void *userdata)
 {
 	RenameThread("rpc_quit");
@@ -3584,29 +4364,11 @@ void api(int api_thr_id)
 {
 	struct io_data *io_data;
 	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
-	char param_buf[TMPBUFSIZ];
-	const char *localaddr = "127.0.0.1";
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
+	int bound;
 	char *binderror;
 	time_t bindstart;
 	short int port = opt_api_port;
 	struct sockaddr_in serv;
-	struct sockaddr_in cli;
-	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd;
-	char *param;
-	bool addrok;
-	char group;
-	json_error_t json_err;
-	json_t *json_config;
-	json_t *json_val;
-	bool isjson;
-	bool did;
-	int i;
 
 	if (!opt_api_listen) {
 		applog(LOG_DEBUG, "API not running%s", UNAVAILABLE);
@@ -3705,147 +4467,8 @@ void api(int api_thr_id)
 			applog(LOG_WARNING, "API running in local read access mode on port %d", port);
 	}
 
-	while (!bye) {
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept(sock, (struct sockaddr *)(&cli), &clisiz))) {
-			applog(LOG_ERR, "API failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
-			goto die;
-		}
-
-		connectaddr = inet_ntoa(cli.sin_addr);
-
-		addrok = false;
-		group = NOPRIVGROUP;
-		if (opt_api_allow) {
-			int client_ip = htonl(cli.sin_addr.s_addr);
-			for (i = 0; i < ips; i++) {
-				if ((client_ip & ipaccess[i].mask) == ipaccess[i].ip) {
-					addrok = true;
-					group = ipaccess[i].group;
-					break;
-				}
-			}
-		} else {
-			if (opt_api_network)
-				addrok = true;
-			else
-				addrok = (strcmp(connectaddr, localaddr) == 0);
-		}
-
-		if (opt_debug)
-			applog(LOG_DEBUG, "API: connection from %s - %s", connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
-			}
+	api_serve(io_data);
 
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did)
-					for (i = 0; cmds[i].name != NULL; i++) {
-						if (strcmp(cmd, cmds[i].name) == 0) {
-							sprintf(cmdbuf, "|%s|", cmd);
-							if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								(cmds[i].func)(io_data, c, param, isjson, group);
-							else {
-								message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-								applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-							}
-
-							send_result(io_data, c, isjson);
-							did = true;
-							break;
-						}
-					}
-
-				if (isjson)
-					json_decref(json_config);
-
-				if (!did) {
-					message(io_data, MSG_INVCMD, 0, NULL, isjson);
-					send_result(io_data, c, isjson);
-				}
-			}
-		}
-		CLOSESOCKET(c);
-	}
-die:
-	/* Blank line fix for older compilers since pthread_cleanup_pop is a
-	 * macro that gets confused by a label existing immediately before it
-	 */
-	;
 	pthread_cleanup_pop(true);
 
 	if (opt_debug)
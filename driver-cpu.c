@@ -42,6 +42,11 @@
 	#include <fcntl.h>
 #endif
 
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 #if defined(__linux) && defined(CPU_ZERO)  /* Linux specific policy and affinity management */
 #include <sched.h>
 static inline void drop_policy(void)
@@ -219,6 +224,7 @@ enum algo_types opt_algo = ALGO_C;
 enum algo_types opt_algo = ALGO_VOID;
 #endif /* USE_SHA256D */
 bool opt_usecpu = false;
+bool opt_cpu_perf = false;
 static bool forced_n_threads;
 #endif
 
@@ -769,7 +775,7 @@ static void cpu_detect()
 	if (num_processors < 1)
 		return;
 
-	cpus = calloc(opt_n_threads, sizeof(struct cgpu_info));
+	cpus = cacheline_calloc(opt_n_threads, sizeof(struct cgpu_info));
 	if (unlikely(!cpus))
 		quit(1, "Failed to calloc cpus");
 	for (i = 0; i < opt_n_threads; ++i) {
@@ -797,6 +803,125 @@ static uint64_t cpu_can_limit_work(struct thr_info __maybe_unused *thr)
 	return 0xffff;
 }
 
+#ifdef HAVE_LINUX_PERF_EVENT_H
+/* Hardware counters of one CPU mining thread for --cpu-perf */
+#define CPU_PERF_CACHE(cache, op, result) \
+	(PERF_COUNT_HW_CACHE_##cache | (PERF_COUNT_HW_CACHE_OP_##op << 8) | \
+	 (PERF_COUNT_HW_CACHE_RESULT_##result << 16))
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} cpu_perf_events[] = {
+	{ "Cycles/Hash",	PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "Instructions/Hash",	PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "L1D Misses/Hash",	PERF_TYPE_HW_CACHE, CPU_PERF_CACHE(L1D, READ, MISS) },
+	{ "LLC Misses/Hash",	PERF_TYPE_HW_CACHE, CPU_PERF_CACHE(LL, READ, MISS) },
+	{ "dTLB Misses/Hash",	PERF_TYPE_HW_CACHE, CPU_PERF_CACHE(DTLB, READ, MISS) },
+};
+
+#define CPU_PERF_EVENTS (sizeof(cpu_perf_events) / sizeof(cpu_perf_events[0]))
+
+struct cpu_perf {
+	int fd[CPU_PERF_EVENTS];
+};
+
+/* Counts for the calling thread only, user space only, so it works at the
+ * default perf_event_paranoid level.  Counters the CPU or a VM doesn't have
+ * are just left out of the stats. */
+static void cpu_perf_open(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct cpu_perf *perf;
+	unsigned int i, opened = 0;
+
+	perf = malloc(sizeof(*perf));
+	if (unlikely(!perf))
+		quit(1, "Failed to malloc cpu_perf");
+
+	for (i = 0; i < CPU_PERF_EVENTS; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = cpu_perf_events[i].type;
+		attr.config = cpu_perf_events[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		/* Other counters may share the PMU, so scale what we get */
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		perf->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf->fd[i] >= 0)
+			opened++;
+		else
+			applog(LOG_DEBUG, "%s %d: perf_event_open for %s failed: %s",
+			       cgpu->api->name, cgpu->device_id,
+			       cpu_perf_events[i].name, strerror(errno));
+	}
+
+	if (!opened) {
+		applog(LOG_WARNING, "%s %d: No hardware performance counters available for --cpu-perf",
+		       cgpu->api->name, cgpu->device_id);
+		free(perf);
+		return;
+	}
+
+	cgpu->cgpu_data = perf;
+}
+
+static struct api_data *cpu_api_stats(struct cgpu_info *cgpu)
+{
+	struct api_data *root = NULL;
+	struct cpu_perf *perf = cgpu->cgpu_data;
+	struct thr_info *thr = cgpu->thr[0];
+	double count[CPU_PERF_EVENTS];
+	uint64_t hashes, val[3];
+	unsigned int i;
+
+	if (!perf)
+		return NULL;
+
+	hashes = __atomic_load_n(&thr->hash_slot.hashes, __ATOMIC_RELAXED);
+	for (i = 0; i < CPU_PERF_EVENTS; i++) {
+		double rate;
+
+		count[i] = -1;
+		if (perf->fd[i] < 0)
+			continue;
+		if (read(perf->fd[i], val, sizeof(val)) != sizeof(val) || !val[2])
+			continue;
+		count[i] = (double)val[0] * val[1] / val[2];
+		rate = hashes ? count[i] / hashes : 0;
+		root = api_add_double(root, (char *)cpu_perf_events[i].name, &rate, true);
+	}
+
+	if (count[0] > 0 && count[1] >= 0) {
+		double ipc = count[1] / count[0];
+
+		root = api_add_double(root, "IPC", &ipc, true);
+	}
+
+	return root;
+}
+
+static void cpu_thread_shutdown(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct cpu_perf *perf = cgpu->cgpu_data;
+	unsigned int i;
+
+	if (!perf)
+		return;
+
+	cgpu->cgpu_data = NULL;
+	for (i = 0; i < CPU_PERF_EVENTS; i++)
+		if (perf->fd[i] >= 0)
+			close(perf->fd[i]);
+	free(perf);
+}
+#endif
+
 static bool cpu_thread_init(struct thr_info *thr)
 {
 	const int thr_id = thr->id;
@@ -810,6 +935,11 @@ static bool cpu_thread_init(struct thr_info *thr)
 	 * of the number of CPUs */
 	if (!(opt_n_threads % num_processors))
 		affine_to_cpu(dev_from_id(thr_id), dev_from_id(thr_id) % num_processors);
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	/* After binding, so the counters follow the thread where it runs */
+	if (opt_cpu_perf)
+		cpu_perf_open(thr);
+#endif
 	return true;
 }
 
@@ -950,6 +1080,10 @@ struct device_api cpu_api = {
 	.can_limit_work = cpu_can_limit_work,
 	.thread_init = cpu_thread_init,
 	.scanhash = cpu_scanhash,
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	.get_api_stats = cpu_api_stats,
+	.thread_shutdown = cpu_thread_shutdown,
+#endif
 };
 #endif
 
@@ -63,6 +63,7 @@ enum algo_types {
 
 extern const char *algo_names[];
 extern bool opt_usecpu;
+extern bool opt_cpu_perf;
 extern struct device_api cpu_api;
 
 extern char *set_algo(const char *arg, enum algo_types *algo);
@@ -618,7 +618,7 @@ bool icarus_detect_custom(const char *devpath, struct device_api *api, struct IC
 
 	/* We have a real Icarus! */
 	struct cgpu_info *icarus;
-	icarus = calloc(1, sizeof(struct cgpu_info));
+	icarus = cacheline_calloc(1, sizeof(struct cgpu_info));
 	icarus->api = api;
 	icarus->device_path = strdup(devpath);
 	icarus->device_fd = -1;
@@ -137,7 +137,7 @@ modminer_detect_one(const char *devpath)
 	serial_close(fd);
 
 	struct cgpu_info *modminer;
-	modminer = calloc(1, sizeof(*modminer));
+	modminer = cacheline_calloc(1, sizeof(*modminer));
 	modminer->api = &modminer_api;
 	mutex_init(&modminer->device_mutex);
 	modminer->device_path = strdup(devpath);
@@ -126,7 +126,7 @@ uint32_t x6500_get_register(struct jtag_port *jp, uint8_t addr)
 static bool x6500_foundusb(libusb_device *dev, const char *product, const char *serial)
 {
 	struct cgpu_info *x6500;
-	x6500 = calloc(1, sizeof(*x6500));
+	x6500 = cacheline_calloc(1, sizeof(*x6500));
 	x6500->api = &x6500_api;
 	mutex_init(&x6500->device_mutex);
 	x6500->device_path = strdup(serial);
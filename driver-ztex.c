@@ -54,7 +54,7 @@ static struct cgpu_info *ztex_setup(struct libztex_device *dev, int j)
 	struct cgpu_info *ztex;
 	char fpganame[LIBZTEX_SNSTRING_LEN+3+1];
 
-	ztex = calloc(1, sizeof(struct cgpu_info));
+	ztex = cacheline_calloc(1, sizeof(struct cgpu_info));
 	ztex->api = &ztex_api;
 	ztex->device_ztex = dev;
 	ztex->threads = 1;
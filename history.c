@@ -0,0 +1,216 @@
+/*
+ * Copyright 2015-2017 John Doering
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Per-device and per-pool time series.  Once a second the timer thread reads
+ * the cumulative counters - the device hash counts straight out of each
+ * thread's hash_slot - and adds the difference to fixed-size rings at one
+ * second, one minute and one hour resolution.  Mining threads never see the
+ * lock; it is only shared between the sampler and the API.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "miner.h"
+#include "timerwheel.h"
+
+struct history_ring {
+	struct history_sample *samples;
+	int head, count;
+	/* The interval currently being filled */
+	struct history_sample acc;
+};
+
+struct history {
+	struct history_ring ring[HISTORY_RES];
+	/* Counter values and time at the previous sample */
+	struct history_sample last;
+	struct timeval last_tv;
+};
+
+static const int history_len[HISTORY_RES] = {
+	HISTORY_SECS,
+	HISTORY_MINS,
+	HISTORY_HOURS,
+};
+
+static const int history_period[HISTORY_RES] = {
+	1,
+	60,
+	3600,
+};
+
+const char *history_res_names[HISTORY_RES] = {
+	"sec",
+	"min",
+	"hour",
+};
+
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer_ent history_timer;
+
+static struct history *history_new(const struct history_sample *now, const struct timeval *tv)
+{
+	struct history *hist;
+	int i;
+
+	hist = calloc(1, sizeof(*hist));
+	if (unlikely(!hist))
+		quit(1, "Failed to calloc history");
+	for (i = 0; i < HISTORY_RES; i++) {
+		hist->ring[i].samples = calloc(history_len[i], sizeof(struct history_sample));
+		if (unlikely(!hist->ring[i].samples))
+			quit(1, "Failed to calloc history ring");
+	}
+	hist->last = *now;
+	hist->last_tv = *tv;
+
+	return hist;
+}
+
+static void history_push(struct history_ring *ring, int len)
+{
+	ring->samples[ring->head] = ring->acc;
+	if (++ring->head == len)
+		ring->head = 0;
+	if (ring->count < len)
+		ring->count++;
+	memset(&ring->acc, 0, sizeof(ring->acc));
+}
+
+/* A counter that went backwards was zeroed, so all of it is new */
+#define HISTORY_DELTA(field) \
+	(now->field >= hist->last.field ? now->field - hist->last.field : now->field)
+
+static void history_add(struct history *hist, const struct history_sample *now, const struct timeval *tv)
+{
+	struct history_sample d;
+	struct timeval diff;
+	int i;
+
+	timersub(tv, &hist->last_tv, &diff);
+	d.when = hist->last_tv.tv_sec;
+	d.ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	d.hashes = HISTORY_DELTA(hashes);
+	d.diff_accepted = HISTORY_DELTA(diff_accepted);
+	d.diff_rejected = HISTORY_DELTA(diff_rejected);
+	d.hw_errors = HISTORY_DELTA(hw_errors);
+	hist->last = *now;
+	hist->last_tv = *tv;
+
+	for (i = 0; i < HISTORY_RES; i++) {
+		struct history_ring *ring = &hist->ring[i];
+		int period = history_period[i];
+
+		/* Intervals line up with wall clock seconds, minutes and hours */
+		if (ring->acc.ms && d.when / period != ring->acc.when / period)
+			history_push(ring, history_len[i]);
+		if (!ring->acc.ms)
+			ring->acc.when = d.when - d.when % period;
+		ring->acc.ms += d.ms;
+		ring->acc.hashes += d.hashes;
+		ring->acc.diff_accepted += d.diff_accepted;
+		ring->acc.diff_rejected += d.diff_rejected;
+		ring->acc.hw_errors += d.hw_errors;
+	}
+}
+
+static void history_sample(struct history **histp, const struct history_sample *now, const struct timeval *tv)
+{
+	if (!*histp)
+		*histp = history_new(now, tv);
+	else
+		history_add(*histp, now, tv);
+}
+
+static void history_tick(void __maybe_unused *arg)
+{
+	struct history_sample now;
+	struct timeval tv, next;
+	int i, j;
+
+	gettimeofday(&tv, NULL);
+	memset(&now, 0, sizeof(now));
+
+	mutex_lock(&history_lock);
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = devices[i];
+
+		now.hashes = 0;
+		for (j = 0; j < cgpu->threads; j++)
+			now.hashes += __atomic_load_n(&cgpu->thr[j]->hash_slot.hashes, __ATOMIC_RELAXED);
+		now.diff_accepted = cgpu->diff_accepted;
+		now.diff_rejected = cgpu->diff_rejected;
+		now.hw_errors = cgpu->hw_errors;
+		history_sample(&cgpu->history, &now, &tv);
+	}
+
+	now.hashes = 0;
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		now.diff_accepted = pool->diff_accepted;
+		now.diff_rejected = pool->diff_rejected;
+		now.hw_errors = pool->hw_errors;
+		history_sample(&pool->history, &now, &tv);
+	}
+	mutex_unlock(&history_lock);
+
+	next.tv_sec = tv.tv_sec + 1;
+	next.tv_usec = 0;
+	timer_set(&history_timer, &next);
+}
+
+/* Copies out the finished intervals at the given resolution, oldest first.
+ * Returns the number of samples, which the caller must free. */
+int history_get(struct history **histp, enum history_res res, struct history_sample **samples)
+{
+	struct history *hist;
+	struct history_ring *ring;
+	int count, first, n;
+
+	*samples = NULL;
+	mutex_lock(&history_lock);
+	hist = *histp;
+	if (!hist || !hist->ring[res].count) {
+		mutex_unlock(&history_lock);
+		return 0;
+	}
+
+	ring = &hist->ring[res];
+	count = ring->count;
+	*samples = malloc(count * sizeof(struct history_sample));
+	if (unlikely(!*samples))
+		quit(1, "Failed to malloc history samples");
+	first = (ring->head - count + history_len[res]) % history_len[res];
+	n = history_len[res] - first;
+	if (n > count)
+		n = count;
+	memcpy(*samples, &ring->samples[first], n * sizeof(struct history_sample));
+	memcpy(*samples + n, ring->samples, (count - n) * sizeof(struct history_sample));
+	mutex_unlock(&history_lock);
+
+	return count;
+}
+
+void history_start(void)
+{
+	struct timeval now;
+
+	timer_init(&history_timer, history_tick, NULL);
+	gettimeofday(&now, NULL);
+	timer_set(&history_timer, &now);
+}
@@ -6,6 +6,7 @@
  */
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -152,22 +153,98 @@ uint64_t blkmk_init_generation(blktemplate_t *tmpl, void *script, size_t scripts
 	return blkmk_init_generation2(tmpl, script, scriptsz, NULL);
 }
 
+// 0 uses one thread per online CPU, 1 disables threaded hashing
+unsigned int blkmk_hash_threads = 0;
+
+// Templates with fewer transactions than this are hashed inline
+#define BLKMK_HASH_THREAD_MIN_TXNS  256
+#define BLKMK_HASH_MAX_THREADS  16
+
+struct blkmk_hash_job {
+	blktemplate_t *tmpl;
+	unsigned long first;
+	unsigned long last;
+	bool ok;
+};
+
 static
-bool blkmk_hash_transactions(blktemplate_t * const tmpl)
+void *blkmk_hash_txn_range(void * const userdata)
 {
-	for (unsigned long i = 0; i < tmpl->txncount; ++i)
+	struct blkmk_hash_job * const job = userdata;
+	
+	job->ok = true;
+	for (unsigned long i = job->first; i < job->last; ++i)
 	{
-		struct blktxn_t * const txn = &tmpl->txns[i];
+		struct blktxn_t * const txn = &job->tmpl->txns[i];
 		if (txn->hash_)
 			continue;
 		txn->hash_ = malloc(sizeof(*txn->hash_));
-		if (!dblsha256(txn->hash_, txn->data, txn->datasz))
+		if (!(txn->hash_ && dblsha256(txn->hash_, txn->data, txn->datasz)))
 		{
 			free(txn->hash_);
-			return false;
+			txn->hash_ = NULL;
+			job->ok = false;
+			break;
 		}
 	}
-	return true;
+	return NULL;
+}
+
+static
+unsigned int blkmk_hash_thread_count(const unsigned long txncount)
+{
+	long n = blkmk_hash_threads;
+	
+	if (txncount < BLKMK_HASH_THREAD_MIN_TXNS)
+		return 1;
+	if (!n)
+	{
+#ifdef _SC_NPROCESSORS_ONLN
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (n < 1)
+			n = 1;
+	}
+	if (n > BLKMK_HASH_MAX_THREADS)
+		n = BLKMK_HASH_MAX_THREADS;
+	if ((unsigned long)n > txncount / (BLKMK_HASH_THREAD_MIN_TXNS / 4))
+		n = txncount / (BLKMK_HASH_THREAD_MIN_TXNS / 4);
+	return n;
+}
+
+// Transactions are split into contiguous ranges, hashed by worker threads
+// alongside the caller; the sha256 implementation must be reentrant
+static
+bool blkmk_hash_transactions(blktemplate_t * const tmpl)
+{
+	const unsigned long txncount = tmpl->txncount;
+	const unsigned int n = blkmk_hash_thread_count(txncount);
+	struct blkmk_hash_job jobs[BLKMK_HASH_MAX_THREADS];
+	pthread_t threads[BLKMK_HASH_MAX_THREADS];
+	bool started[BLKMK_HASH_MAX_THREADS];
+	bool rv = true;
+	
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		jobs[i].tmpl = tmpl;
+		jobs[i].first = txncount * i / n;
+		jobs[i].last = txncount * (i + 1) / n;
+		started[i] = (i && !pthread_create(&threads[i], NULL, blkmk_hash_txn_range, &jobs[i]));
+	}
+	
+	// Ranges whose thread could not be started are done here
+	for (unsigned int i = 0; i < n; ++i)
+		if (!started[i])
+			blkmk_hash_txn_range(&jobs[i]);
+	
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (!jobs[i].ok)
+			rv = false;
+	}
+	return rv;
 }
 
 static
@@ -193,7 +270,14 @@ bool blkmk_build_merkle_branches(blktemplate_t * const tmpl)
 	branches = malloc(branchcount * sizeof(*branches));
 	
 	size_t hashcount = tmpl->txncount + 1;
-	unsigned char hashes[(hashcount + 1) * 32];
+	// Large templates would overflow the stack as a VLA
+	unsigned char *hashes = malloc((hashcount + 1) * 32);
+	if (!(branches && hashes))
+	{
+		free(branches);
+		free(hashes);
+		return false;
+	}
 	
 	for (i = 0; i < tmpl->txncount; ++i)
 		memcpy(&hashes[0x20 * (i + 1)], tmpl->txns[i].hash_, 0x20);
@@ -211,11 +295,13 @@ bool blkmk_build_merkle_branches(blktemplate_t * const tmpl)
 			if (!dblsha256(&hashes[i / 2 * 32], &hashes[32 * i], 64))
 			{
 				free(branches);
+				free(hashes);
 				return false;
 			}
 		hashcount /= 2;
 	}
 	
+	free(hashes);
 	tmpl->_mrklbranch = branches;
 	tmpl->_mrklbranchcount = branchcount;
 	
@@ -480,31 +566,75 @@ char varintEncode(unsigned char *out, uint64_t n) {
 	return L;
 }
 
-char *blkmk_assemble_submission_(blktemplate_t * const tmpl, const unsigned char * const data, const unsigned int dataid, blknonce_t nonce, const bool foreign)
+// Each part of the block is hex encoded straight into a single buffer
+// between prefix and suffix, so callers can hand the result to their
+// transport without assembling or copying the binary block first
+char *blkmk_assemble_submission2_(blktemplate_t * const tmpl, const unsigned char * const data, const unsigned int dataid, blknonce_t nonce, const bool foreign, const char * const prefix, const char * const suffix)
 {
-	unsigned char blk[80 + 8 + 1000000];
-	memcpy(blk, data, 76);
-	nonce = htonl(nonce);
-	memcpy(&blk[76], &nonce, 4);
+	const bool full = (foreign || (!(tmpl->mutations & BMAb_TRUNCATE && !dataid)));
+	const bool txns = (full && (foreign || !(tmpl->mutations & BMAb_COINBASE)));
+	const size_t prefixsz = strlen(prefix), suffixsz = strlen(suffix);
+	size_t blksz = 80;
+	
+	if (full)
+	{
+		if (!tmpl->cbtxn)
+			return NULL;
+		blksz += 9 + tmpl->cbtxn->datasz + sizeof(dataid);
+	}
+	if (txns)
+		for (unsigned long i = 0; i < tmpl->txncount; ++i)
+			blksz += tmpl->txns[i].datasz;
+	
+	char * const out = malloc(prefixsz + (blksz * 2) + suffixsz + 1);
+	if (!out)
+		return NULL;
+	char *p = out;
+	unsigned char buf[80 + 9];
 	size_t offs = 80;
 	
-	if (foreign || (!(tmpl->mutations & BMAb_TRUNCATE && !dataid)))
+	memcpy(p, prefix, prefixsz);
+	p += prefixsz;
+	
+	memcpy(buf, data, 76);
+	nonce = htonl(nonce);
+	memcpy(&buf[76], &nonce, 4);
+	
+	if (full)
 	{
-		offs += varintEncode(&blk[offs], 1 + tmpl->txncount);
+		offs += varintEncode(&buf[offs], 1 + tmpl->txncount);
+		_blkmk_bin2hex(p, buf, offs);
+		p += offs * 2;
 		
-		if (!_blkmk_extranonce(tmpl, &blk[offs], dataid, &offs))
+		unsigned char cbtxndata[tmpl->cbtxn->datasz + sizeof(dataid)];
+		size_t cbtxndatasz = 0;
+		if (!_blkmk_extranonce(tmpl, cbtxndata, dataid, &cbtxndatasz))
+		{
+			free(out);
 			return NULL;
+		}
+		_blkmk_bin2hex(p, cbtxndata, cbtxndatasz);
+		p += cbtxndatasz * 2;
 		
-		if (foreign || !(tmpl->mutations & BMAb_COINBASE))
+		if (txns)
 			for (unsigned long i = 0; i < tmpl->txncount; ++i)
 			{
-				memcpy(&blk[offs], tmpl->txns[i].data, tmpl->txns[i].datasz);
-				offs += tmpl->txns[i].datasz;
+				_blkmk_bin2hex(p, tmpl->txns[i].data, tmpl->txns[i].datasz);
+				p += tmpl->txns[i].datasz * 2;
 			}
 	}
+	else
+	{
+		_blkmk_bin2hex(p, buf, offs);
+		p += offs * 2;
+	}
 	
-	char *blkhex = malloc((offs * 2) + 1);
-	_blkmk_bin2hex(blkhex, blk, offs);
+	memcpy(p, suffix, suffixsz + 1);
 	
-	return blkhex;
+	return out;
+}
+
+char *blkmk_assemble_submission_(blktemplate_t * const tmpl, const unsigned char * const data, const unsigned int dataid, const blknonce_t nonce, const bool foreign)
+{
+	return blkmk_assemble_submission2_(tmpl, data, dataid, nonce, foreign, "", "");
 }
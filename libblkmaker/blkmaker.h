@@ -15,6 +15,7 @@ extern "C" {
 #define BLKMAKER_MAX_BLOCK_VERSION (4)
 
 extern bool (*blkmk_sha256_impl)(void *hash_out, const void *data, size_t datasz);
+extern unsigned int blkmk_hash_threads;
 
 extern uint64_t blkmk_init_generation(blktemplate_t *, void *script, size_t scriptsz);
 extern uint64_t blkmk_init_generation2(blktemplate_t *, void *script, size_t scriptsz, bool *out_newcb);
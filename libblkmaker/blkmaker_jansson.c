@@ -7,6 +7,7 @@
 
 #define _BSD_SOURCE
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -378,3 +379,35 @@ json_t *blkmk_submit_jansson(blktemplate_t *tmpl, const unsigned char *data, uns
 json_t *blkmk_submit_foreign_jansson(blktemplate_t *tmpl, const unsigned char *data, unsigned int dataid, blknonce_t nonce) {
 	return _blkmk_submit_jansson(tmpl, data, dataid, nonce, true);
 }
+
+// Same request as blkmk_submit_jansson, serialised directly: the block hex is
+// written once into the returned string rather than being copied into a
+// json_t and again by json_dumps
+char *blkmk_submit_string(blktemplate_t *tmpl, const unsigned char *data, unsigned int dataid, blknonce_t nonce) {
+	json_t *ja, *jb;
+	char *params, *suffix, *rv = NULL;
+	
+	if (!(ja = json_object()))
+		return NULL;
+	if (tmpl->workid)
+	{
+		if (!(jb = json_string(tmpl->workid)))
+			goto out;
+		if (json_object_set_new(ja, "workid", jb))
+			goto out;
+	}
+	if (!(params = json_dumps(ja, JSON_COMPACT)))
+		goto out;
+	suffix = malloc(strlen(params) + 5);
+	if (suffix)
+	{
+		sprintf(suffix, "\",%s]}", params);
+		rv = blkmk_assemble_submission2_(tmpl, data, dataid, nonce, false, "{\"id\":0,\"method\":\"submitblock\",\"params\":[\"", suffix);
+		free(suffix);
+	}
+	free(params);
+
+out:
+	json_decref(ja);
+	return rv;
+}
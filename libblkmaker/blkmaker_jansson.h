@@ -14,6 +14,7 @@ extern const char *blktmpl_add_jansson(blktemplate_t *, const json_t *, time_t t
 extern json_t *blktmpl_propose_jansson(blktemplate_t *, uint32_t caps, bool foreign);
 extern json_t *blkmk_submit_jansson(blktemplate_t *, const unsigned char *data, unsigned int dataid, blknonce_t);
 extern json_t *blkmk_submit_foreign_jansson(blktemplate_t *, const unsigned char *data, unsigned int dataid, blknonce_t);
+extern char *blkmk_submit_string(blktemplate_t *, const unsigned char *data, unsigned int dataid, blknonce_t);
 
 #ifdef __cplusplus
 }
@@ -10,6 +10,7 @@
 extern bool _blkmk_dblsha256(void *hash, const void *data, size_t datasz);
 extern bool blkmk_sample_data_(blktemplate_t *, uint8_t *, unsigned int dataid);
 extern char *blkmk_assemble_submission_(blktemplate_t *, const unsigned char *data, unsigned int dataid, blknonce_t nonce, bool foreign);
+extern char *blkmk_assemble_submission2_(blktemplate_t *, const unsigned char *data, unsigned int dataid, blknonce_t nonce, bool foreign, const char *prefix, const char *suffix);
 
 // blktemplate.c
 extern void _blktxn_free(struct blktxn_t *);
@@ -9,8 +9,17 @@
  * any later version.  See COPYING for more details.
  */
 
+/*
+ * Once logging_start() has run, applog only formats the message into a slot of
+ * a bounded lock-free ring and a logger thread does the timestamps, syslog,
+ * stderr and curses output, so a thread that logs while holding a lock never
+ * waits for the console or the disk.  When the ring is full the message is
+ * counted as dropped rather than making the caller wait.
+ */
+
 #include "config.h"
 
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "compat.h"
@@ -20,6 +29,7 @@
 bool opt_debug = false;
 bool opt_debug_console = false;  // Only used if opt_debug is also enabled
 bool opt_log_output = false;
+bool opt_log_sync = false;
 
 uint last_day = 0;
 bool opt_log_show_date = false;
@@ -27,6 +37,36 @@ bool opt_log_show_date = false;
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
+/* Slots in the ring, a power of two */
+#define LOG_SLOTS	1024
+#define LOG_MASK	(LOG_SLOTS - 1)
+/* Longer messages are put on the heap */
+#define LOG_MSGSIZ	256
+/* How long the logger sleeps if nobody wakes it */
+#define LOG_WAIT_MS	100
+
+struct log_slot {
+	/* Which lap of the ring the slot is ready for, see log_push */
+	unsigned long seq;
+	int prio;
+	struct timeval tv;
+	char *big;
+	char msg[LOG_MSGSIZ];
+};
+
+static struct log_slot *log_ring;
+static unsigned long log_head __cacheline_aligned;
+static unsigned long log_tail __cacheline_aligned;
+static unsigned long log_dropped;
+static unsigned long log_dropped_seen;
+static bool log_sleeping;
+static bool log_to_file;
+static bool log_running;
+static pthread_t log_thread;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
 static void my_log_curses(int prio, char *f, va_list ap) FORMAT_SYNTAX_CHECK(printf, 2, 0);
 
 static void my_log_curses(__maybe_unused int prio, char *f, va_list ap)
@@ -78,61 +118,259 @@ void applog(int prio, const char *fmt, ...)
 
 /* high-level logging functions, based on global opt_log_level */
 
-/*
- * generic log function used by priority specific ones
- * equals vapplog() without additional priority checks
- */
-static void log_generic(int prio, const char *fmt, va_list ap)
+static void log_curses_str(int prio, char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	my_log_curses(prio, f, ap);
+	va_end(ap);
+}
+
+static bool log_wanted(int prio, bool tofile)
+{
+#ifdef HAVE_SYSLOG_H
+	if (use_syslog)
+		return true;
+#endif
+	return tofile || opt_debug_console || (opt_log_output && prio != LOG_DEBUG) || prio <= LOG_NOTICE;
+}
+
+/* Writes one formatted message wherever it should go */
+static void log_output(int prio, const struct timeval *tv, const char *msg, bool writetofile)
 {
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
-		vsyslog(prio, fmt, ap);
+		syslog(prio, "%s", msg);
 	}
 #else
 	if (0) {}
 #endif
 	else {
 		bool writetocon = opt_debug_console || (opt_log_output && prio != LOG_DEBUG) || prio <= LOG_NOTICE;
-		bool writetofile = !isatty(fileno((FILE *)stderr));
 		if (!(writetocon || writetofile))
 			return;
 
-		char *f;
-		int len;
-		struct timeval tv = {0, 0};
+		/* Room for the date and the spaces my_log_curses pads with */
+		char f[64];
 		struct tm _tm;
 		struct tm *tm = &_tm;
 
-		gettimeofday(&tv, NULL);
-
-		localtime_r(&tv.tv_sec, tm);
-
-		len = 40 + strlen(fmt) + 22;
-		f = alloca(len);
+		localtime_r(&tv->tv_sec, tm);
 
         if(opt_log_show_date || (last_day != tm->tm_mday)) {
             last_day = tm->tm_mday;
-            sprintf(f, "[%d-%02d-%02d %02d:%02d:%02d] %s\n",
+            sprintf(f, "[%d-%02d-%02d %02d:%02d:%02d] %%s\n",
               tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-              tm->tm_hour, tm->tm_min, tm->tm_sec, fmt);
+              tm->tm_hour, tm->tm_min, tm->tm_sec);
         } else {
-            sprintf(f, "[%02d:%02d:%02d] %s\n",
-              tm->tm_hour, tm->tm_min, tm->tm_sec, fmt);
+            sprintf(f, "[%02d:%02d:%02d] %%s\n",
+              tm->tm_hour, tm->tm_min, tm->tm_sec);
         }
 
 		/* Only output to stderr if it's not going to the screen as well */
 		if (writetofile) {
-			va_list apc;
-
-			va_copy(apc, ap);
-			vfprintf(stderr, f, apc);	/* atomic write to stderr */
-			va_end(apc);
+			fprintf(stderr, f, msg);	/* atomic write to stderr */
 			fflush(stderr);
 		}
 
 		if (writetocon)
-			my_log_curses(prio, f, ap);
+			log_curses_str(prio, f, msg);
+	}
+}
+
+/* Returns false if the ring is full */
+static bool log_push(int prio, const char *fmt, va_list ap)
+{
+	unsigned long pos;
+	struct log_slot *slot;
+	int cancelstate;
+	va_list apc;
+	bool scs;
+	int len;
+
+	/* Mining threads are cancelled asynchronously; one that died holding a
+	 * slot would stall the ring for good */
+	scs = !pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+
+	/* A slot is free for the producer at pos when its seq is pos, and
+	 * holds a message for the consumer at pos when its seq is pos + 1 */
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	while (42) {
+		long dif;
+
+		slot = &log_ring[pos & LOG_MASK];
+		dif = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			if (scs)
+				pthread_setcancelstate(cancelstate, &cancelstate);
+			return false;
+		} else
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	}
+
+	slot->prio = prio;
+	gettimeofday(&slot->tv, NULL);
+	slot->big = NULL;
+	va_copy(apc, ap);
+	len = vsnprintf(slot->msg, LOG_MSGSIZ, fmt, apc);
+	va_end(apc);
+	if (len >= LOG_MSGSIZ) {
+		slot->big = malloc(len + 1);
+		if (slot->big)
+			vsnprintf(slot->big, len + 1, fmt, ap);
+	}
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST))
+		pthread_cond_signal(&log_cond);
+	if (scs)
+		pthread_setcancelstate(cancelstate, &cancelstate);
+
+	return true;
+}
+
+/* Writes out whatever is in the ring.  Returns true if it wrote anything. */
+static bool log_drain(void)
+{
+	unsigned long dropped;
+	bool ret = false;
+
+	mutex_lock(&log_drain_lock);
+	while (42) {
+		struct log_slot *slot = &log_ring[log_tail & LOG_MASK];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+			break;
+		log_output(slot->prio, &slot->tv, slot->big ? : slot->msg, log_to_file);
+		free(slot->big);
+		__atomic_store_n(&slot->seq, log_tail + LOG_SLOTS, __ATOMIC_RELEASE);
+		log_tail++;
+		ret = true;
+	}
+
+	dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+	if (dropped != log_dropped_seen) {
+		struct timeval tv;
+		char msg[64];
+
+		gettimeofday(&tv, NULL);
+		snprintf(msg, sizeof(msg), "Logger ring full, %lu messages dropped",
+			 dropped - log_dropped_seen);
+		log_dropped_seen = dropped;
+		log_output(LOG_WARNING, &tv, msg, log_to_file);
+	}
+	mutex_unlock(&log_drain_lock);
+
+	return ret;
+}
+
+static void *logger_thread(void __maybe_unused *userdata)
+{
+	RenameThread("logger");
+
+	while (42) {
+		struct timespec abstime;
+		struct timeval now;
+
+		if (log_drain())
+			continue;
+
+		gettimeofday(&now, NULL);
+		abstime.tv_sec = now.tv_sec;
+		abstime.tv_nsec = (now.tv_usec + LOG_WAIT_MS * 1000) * 1000;
+		if (abstime.tv_nsec >= 1000000000) {
+			abstime.tv_nsec -= 1000000000;
+			abstime.tv_sec++;
+		}
+
+		mutex_lock(&log_wait_lock);
+		__atomic_store_n(&log_sleeping, true, __ATOMIC_SEQ_CST);
+		/* Look again in case a message came in before we said so */
+		if (__atomic_load_n(&log_ring[log_tail & LOG_MASK].seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+			pthread_cond_timedwait(&log_cond, &log_wait_lock, &abstime);
+		__atomic_store_n(&log_sleeping, false, __ATOMIC_RELAXED);
+		mutex_unlock(&log_wait_lock);
+	}
+
+	return NULL;
+}
+
+/* Writes out anything still queued; safe to call at any time */
+void logging_flush(void)
+{
+	if (log_ring)
+		log_drain();
+}
+
+/* Hands all further output to the logger thread unless --log-sync is set.
+ * Call once stderr has been redirected where it will stay. */
+void logging_start(void)
+{
+	unsigned long i;
+
+	if (opt_log_sync || log_running)
+		return;
+
+	log_ring = calloc(LOG_SLOTS, sizeof(*log_ring));
+	if (unlikely(!log_ring))
+		quit(1, "Failed to calloc log ring");
+	for (i = 0; i < LOG_SLOTS; i++)
+		log_ring[i].seq = i;
+	log_to_file = !isatty(fileno((FILE *)stderr));
+
+	if (unlikely(pthread_create(&log_thread, NULL, logger_thread, NULL)))
+		quit(1, "Logger thread create failed");
+	pthread_detach(log_thread);
+	atexit(logging_flush);
+	__atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * generic log function used by priority specific ones
+ * equals vapplog() without additional priority checks
+ */
+static void log_generic(int prio, const char *fmt, va_list ap)
+{
+	struct timeval tv;
+	char buf[LOG_MSGSIZ];
+	char *msg = buf;
+	bool writetofile;
+	va_list apc;
+	int len;
+
+	if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) &&
+	    !pthread_equal(pthread_self(), log_thread)) {
+		if (!log_wanted(prio, log_to_file))
+			return;
+		if (!log_push(prio, fmt, ap))
+			__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+		return;
 	}
+
+	writetofile = !isatty(fileno((FILE *)stderr));
+	if (!log_wanted(prio, writetofile))
+		return;
+
+	gettimeofday(&tv, NULL);
+	va_copy(apc, ap);
+	len = vsnprintf(buf, sizeof(buf), fmt, apc);
+	va_end(apc);
+	if (len >= (int)sizeof(buf)) {
+		msg = malloc(len + 1);
+		if (msg)
+			vsnprintf(msg, len + 1, fmt, ap);
+		else
+			msg = buf;
+	}
+
+	log_output(prio, &tv, msg, writetofile);
+	if (msg != buf)
+		free(msg);
 }
 /* we can not generalize variable argument list */
 #define LOG_TEMPLATE(PRIO)		\
@@ -31,6 +31,7 @@ extern bool opt_debug;
 extern bool opt_debug_console;
 extern bool opt_log_output;
 extern bool opt_log_show_date;
+extern bool opt_log_sync;
 extern bool opt_realquiet;
 extern bool want_per_device_stats;
 
@@ -41,6 +42,9 @@ extern int opt_log_level;
 extern void vapplog(int prio, const char *fmt, va_list ap) FORMAT_SYNTAX_CHECK(printf, 2, 0);
 extern void applog(int prio, const char *fmt, ...) FORMAT_SYNTAX_CHECK(printf, 2, 3);
 
+extern void logging_start(void);
+extern void logging_flush(void);
+
 /* high-level logging functions with implicit priority */
 extern void log_error(const char *fmt, ...) FORMAT_SYNTAX_CHECK(printf, 1, 2);
 extern void log_warning(const char *fmt, ...) FORMAT_SYNTAX_CHECK(printf, 1, 2);
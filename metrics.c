@@ -0,0 +1,546 @@
+/*
+ * Copyright 2015-2017 John Doering
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * OpenMetrics exporter: the watchdog renders every global, device and pool
+ * counter into one text snapshot, and a small HTTP server hands the latest
+ * snapshot to whoever asks for /metrics.  A scrape costs one buffer write no
+ * matter how many devices and pools there are.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "compat.h"
+#include "miner.h"
+#include "util.h"
+
+#define METRICS_QUEUE		8
+#define METRICS_CLIENTS		16
+#define METRICS_REQSIZ		4096
+/* Give up on a scraper that hasn't been served within this long */
+#define METRICS_TIMEOUT		5
+
+#define METRICS_CONTENT_TYPE	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/* Upper bounds of the latency histogram buckets, in seconds */
+const double latency_bounds[LATENCY_BUCKETS] = {
+	0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+struct metrics_snapshot {
+	int refs;
+	size_t len;
+	char data[];
+};
+
+struct metrics_buf {
+	char *s;
+	size_t len;
+	size_t size;
+};
+
+/* A scrape in progress, only touched by the metrics thread */
+struct metrics_conn {
+	SOCKETTYPE sock;
+	time_t deadline;
+	char req[METRICS_REQSIZ];
+	size_t reqlen;
+	/* Once the request is in: the header, then the body */
+	bool replying;
+	char hdr[256];
+	size_t hdrlen;
+	const char *body;
+	size_t bodylen;
+	size_t sent;
+	struct metrics_snapshot *snap;
+};
+
+static pthread_mutex_t metrics_lock;
+static struct metrics_snapshot *metrics_current;
+static struct metrics_conn conns[METRICS_CLIENTS];
+
+void latency_hist_add(struct latency_hist *hist, double secs)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		if (secs <= latency_bounds[i])
+			break;
+	++hist->bucket[i];
+	hist->sum += secs;
+}
+
+static void mb_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (42) {
+		va_start(ap, fmt);
+		n = vsnprintf(mb->s + mb->len, mb->size - mb->len, fmt, ap);
+		va_end(ap);
+		if (unlikely(n < 0))
+			quit(1, "Failed to format metrics");
+		if (mb->len + n < mb->size)
+			break;
+		mb->size = (mb->size + n) * 2;
+		mb->s = realloc(mb->s, mb->size);
+		if (unlikely(!mb->s))
+			quit(1, "Failed to realloc metrics buffer");
+	}
+	mb->len += n;
+}
+
+/* Label values may hold anything a user typed, such as pool URLs */
+static char *label_escape(const char *s)
+{
+	char *ret = malloc(strlen(s) * 2 + 1), *p = ret;
+
+	if (unlikely(!ret))
+		quit(1, "Failed to malloc label_escape");
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			*p++ = '\\';
+		if (*s == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+			continue;
+		}
+		*p++ = *s;
+	}
+	*p = '\0';
+	return ret;
+}
+
+static void mb_family(struct metrics_buf *mb, const char *name, const char *type, const char *help)
+{
+	mb_printf(mb, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void mb_sample(struct metrics_buf *mb, const char *name, const char *labels, double val)
+{
+	if (labels && *labels)
+		mb_printf(mb, "%s{%s} %.15g\n", name, labels, val);
+	else
+		mb_printf(mb, "%s %.15g\n", name, val);
+}
+
+static void mb_hist(struct metrics_buf *mb, const char *name, const char *labels, const struct latency_hist *hist)
+{
+	const char *sep = (labels && *labels) ? "," : "";
+	uint64_t count = 0;
+	int i;
+
+	if (!labels)
+		labels = "";
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		count += hist->bucket[i];
+		mb_printf(mb, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+			  latency_bounds[i], (unsigned long long)count);
+	}
+	count += hist->bucket[LATENCY_BUCKETS];
+	mb_printf(mb, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)count);
+	if (*labels) {
+		mb_printf(mb, "%s_count{%s} %llu\n", name, labels, (unsigned long long)count);
+		mb_printf(mb, "%s_sum{%s} %.15g\n", name, labels, hist->sum);
+	} else {
+		mb_printf(mb, "%s_count %llu\n", name, (unsigned long long)count);
+		mb_printf(mb, "%s_sum %.15g\n", name, hist->sum);
+	}
+}
+
+/* Each family's samples have to be contiguous, so these walk every device or
+ * pool once per family */
+#define DEVICE_FAMILY(name, type, suffix, help, expr)  do {  \
+	mb_family(&mb, "nsgminer_device_" name, type, help);  \
+	for (i = 0; i < total_devices; i++) {  \
+		struct cgpu_info *cgpu = devices[i];  \
+		mb_sample(&mb, "nsgminer_device_" name suffix, dev_labels[i], (expr));  \
+	}  \
+} while (0)
+#define DEVICE_COUNTER(name, help, expr)  DEVICE_FAMILY(name, "counter", "_total", help, expr)
+#define DEVICE_GAUGE(name, help, expr)  DEVICE_FAMILY(name, "gauge", "", help, expr)
+
+#define POOL_FAMILY(name, type, suffix, help, expr)  do {  \
+	mb_family(&mb, "nsgminer_pool_" name, type, help);  \
+	for (i = 0; i < npools; i++) {  \
+		struct pool *pool = pools[i];  \
+		mb_sample(&mb, "nsgminer_pool_" name suffix, pool_labels[i], (expr));  \
+	}  \
+} while (0)
+#define POOL_COUNTER(name, help, expr)  POOL_FAMILY(name, "counter", "_total", help, expr)
+#define POOL_GAUGE(name, help, expr)  POOL_FAMILY(name, "gauge", "", help, expr)
+
+static void global_counter(struct metrics_buf *mb, const char *name, const char *help, double val)
+{
+	char sample[64];
+
+	mb_family(mb, name, "counter", help);
+	snprintf(sample, sizeof(sample), "%s_total", name);
+	mb_sample(mb, sample, NULL, val);
+}
+
+static void global_gauge(struct metrics_buf *mb, const char *name, const char *help, double val)
+{
+	mb_family(mb, name, "gauge", help);
+	mb_sample(mb, name, NULL, val);
+}
+
+/* Called from the watchdog to render a fresh snapshot */
+void metrics_update(void)
+{
+	struct metrics_buf mb = { NULL, 0, 0 };
+	struct metrics_snapshot *snap, *old;
+	struct pool *cp = current_pool();
+	char **dev_labels, **pool_labels;
+	int i, npools = total_pools;
+
+	if (!opt_metrics_port)
+		return;
+
+	mb_family(&mb, "nsgminer_build", "info", "Miner version");
+	mb_printf(&mb, "nsgminer_build_info{version=\"%s\"} 1\n", VERSION);
+
+	global_gauge(&mb, "nsgminer_uptime_seconds", "Seconds since mining started or stats were zeroed", total_secs);
+	global_gauge(&mb, "nsgminer_hashrate_hashes_per_second", "Rolling hashrate of all devices", (double)global_hashrate);
+	global_counter(&mb, "nsgminer_hashes", "Hashes done by all devices", total_mhashes_done * 1e6);
+	global_counter(&mb, "nsgminer_accepted_shares", "Shares accepted by pools", total_accepted);
+	global_counter(&mb, "nsgminer_rejected_shares", "Shares rejected by pools", total_rejected);
+	global_counter(&mb, "nsgminer_stale_shares", "Shares discarded or submitted as stale", total_stale);
+	global_counter(&mb, "nsgminer_accepted_difficulty", "Difficulty of shares accepted by pools", total_diff_accepted);
+	global_counter(&mb, "nsgminer_rejected_difficulty", "Difficulty of shares rejected by pools", total_diff_rejected);
+	global_counter(&mb, "nsgminer_stale_difficulty", "Difficulty of stale shares", total_diff_stale);
+	global_counter(&mb, "nsgminer_hardware_errors", "Nonces that failed verification", hw_errors);
+	global_counter(&mb, "nsgminer_getworks", "Work items fetched from pools", total_getworks);
+	global_counter(&mb, "nsgminer_discarded_work", "Work items discarded unused", total_discarded);
+	global_counter(&mb, "nsgminer_local_work", "Work items generated locally", local_work);
+	global_counter(&mb, "nsgminer_get_failures", "Failed requests for work", total_go);
+	global_counter(&mb, "nsgminer_remote_failures", "Failed share submissions", total_ro);
+	global_counter(&mb, "nsgminer_network_blocks", "New blocks seen on the network", new_blocks);
+	global_counter(&mb, "nsgminer_found_blocks", "Blocks found", found_blocks);
+	global_counter(&mb, "nsgminer_network_bytes", "Bytes transferred to and from pools", total_bytes_xfer);
+	global_gauge(&mb, "nsgminer_best_share_difficulty", "Best share difficulty found", (double)best_diff);
+
+	dev_labels = malloc(sizeof(char *) * (total_devices + 1));
+	if (unlikely(!dev_labels))
+		quit(1, "Failed to malloc dev_labels");
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = devices[i];
+		char *name = label_escape(cgpu->api->name);
+
+		dev_labels[i] = malloc(strlen(name) + 32);
+		if (unlikely(!dev_labels[i]))
+			quit(1, "Failed to malloc dev_labels");
+		sprintf(dev_labels[i], "device=\"%s%d\"", name, cgpu->device_id);
+		free(name);
+	}
+
+	DEVICE_GAUGE("hashrate_hashes_per_second", "Rolling hashrate", cgpu->rolling * 1e6);
+	DEVICE_COUNTER("hashes", "Hashes done", cgpu->total_mhashes * 1e6);
+	DEVICE_COUNTER("accepted_shares", "Shares accepted by pools", cgpu->accepted);
+	DEVICE_COUNTER("rejected_shares", "Shares rejected by pools", cgpu->rejected);
+	DEVICE_COUNTER("accepted_difficulty", "Difficulty of shares accepted by pools", cgpu->diff_accepted);
+	DEVICE_COUNTER("rejected_difficulty", "Difficulty of shares rejected by pools", cgpu->diff_rejected);
+	DEVICE_COUNTER("hardware_errors", "Nonces that failed verification", cgpu->hw_errors);
+	DEVICE_COUNTER("duplicate_nonces", "Nonces reported more than once", cgpu->dup_nonces);
+	DEVICE_GAUGE("enabled", "Whether the device is enabled", cgpu->deven == DEV_ENABLED);
+	DEVICE_GAUGE("alive", "Whether the device is healthy", cgpu->status == LIFE_WELL);
+	DEVICE_GAUGE("temperature_celsius", "Device temperature, 0 if unknown", cgpu->temp);
+	mb_family(&mb, "nsgminer_device_work_wait_seconds", "histogram", "Time spent waiting for work");
+	for (i = 0; i < total_devices; i++)
+		mb_hist(&mb, "nsgminer_device_work_wait_seconds", dev_labels[i], &devices[i]->cgminer_stats.getwork_wait_hist);
+
+	for (i = 0; i < total_devices; i++)
+		free(dev_labels[i]);
+	free(dev_labels);
+
+	pool_labels = malloc(sizeof(char *) * (npools + 1));
+	if (unlikely(!pool_labels))
+		quit(1, "Failed to malloc pool_labels");
+	for (i = 0; i < npools; i++) {
+		char *url = label_escape(pools[i]->rpc_url);
+
+		pool_labels[i] = malloc(strlen(url) + 32);
+		if (unlikely(!pool_labels[i]))
+			quit(1, "Failed to malloc pool_labels");
+		sprintf(pool_labels[i], "pool=\"%d\",url=\"%s\"", i, url);
+		free(url);
+	}
+
+	POOL_GAUGE("up", "Whether the pool is enabled and responding", pool->enabled == POOL_ENABLED && !pool->idle);
+	POOL_GAUGE("current", "Whether this is the current pool", pool == cp);
+	POOL_GAUGE("priority", "Pool priority, 0 is highest", pool->prio);
+	POOL_GAUGE("difficulty", "Difficulty of the pool's last work", pool->cgminer_pool_stats.last_diff);
+	POOL_COUNTER("accepted_shares", "Shares accepted", pool->accepted);
+	POOL_COUNTER("rejected_shares", "Shares rejected", pool->rejected);
+	POOL_COUNTER("stale_shares", "Shares discarded or submitted as stale", pool->stale_shares);
+	POOL_COUNTER("accepted_difficulty", "Difficulty of shares accepted", pool->diff_accepted);
+	POOL_COUNTER("rejected_difficulty", "Difficulty of shares rejected", pool->diff_rejected);
+	POOL_COUNTER("stale_difficulty", "Difficulty of stale shares", pool->diff_stale);
+	POOL_COUNTER("getworks", "Work items fetched", pool->getwork_requested);
+	POOL_COUNTER("discarded_work", "Work items discarded unused", pool->discarded_work);
+	POOL_COUNTER("get_failures", "Failed requests for work", pool->getfail_occasions);
+	POOL_COUNTER("remote_failures", "Failed share submissions", pool->remotefail_occasions);
+	POOL_COUNTER("found_blocks", "Blocks found", pool->solved);
+	POOL_COUNTER("failovers", "Times mining switched to this pool", pool->failovers);
+	POOL_COUNTER("network_sent_bytes", "Bytes sent to the pool", pool->cgminer_pool_stats.net_bytes_sent);
+	POOL_COUNTER("network_received_bytes", "Bytes received from the pool", pool->cgminer_pool_stats.net_bytes_received);
+	mb_family(&mb, "nsgminer_pool_getwork_latency_seconds", "histogram", "Time for the pool to answer a work request");
+	for (i = 0; i < npools; i++)
+		mb_hist(&mb, "nsgminer_pool_getwork_latency_seconds", pool_labels[i], &pools[i]->cgminer_pool_stats.getwork_hist);
+	mb_family(&mb, "nsgminer_pool_share_latency_seconds", "histogram", "Time for the pool to answer a share submission");
+	for (i = 0; i < npools; i++)
+		mb_hist(&mb, "nsgminer_pool_share_latency_seconds", pool_labels[i], &pools[i]->cgminer_pool_stats.submit_hist);
+
+	for (i = 0; i < npools; i++)
+		free(pool_labels[i]);
+	free(pool_labels);
+
+	mb_printf(&mb, "# EOF\n");
+
+	snap = malloc(sizeof(*snap) + mb.len);
+	if (unlikely(!snap))
+		quit(1, "Failed to malloc metrics snapshot");
+	snap->refs = 1;
+	snap->len = mb.len;
+	memcpy(snap->data, mb.s, mb.len);
+	free(mb.s);
+
+	mutex_lock(&metrics_lock);
+	old = metrics_current;
+	metrics_current = snap;
+	if (old && --old->refs)
+		old = NULL;
+	mutex_unlock(&metrics_lock);
+	free(old);
+}
+
+static void metrics_release(struct metrics_snapshot *snap)
+{
+	mutex_lock(&metrics_lock);
+	if (--snap->refs)
+		snap = NULL;
+	mutex_unlock(&metrics_lock);
+	free(snap);
+}
+
+static void metrics_drop(struct metrics_conn *mc)
+{
+	shutdown(mc->sock, SHUT_RDWR);
+	CLOSESOCKET(mc->sock);
+	mc->sock = INVSOCK;
+	if (mc->snap)
+		metrics_release(mc->snap);
+	mc->snap = NULL;
+}
+
+/* Picks the reply once the request is in; it is sent as the connection
+ * becomes writable */
+static void metrics_reply(struct metrics_conn *mc)
+{
+	static const char notfound[] = "HTTP/1.0 404 Not Found\r\n"
+		"Content-Type: text/plain\r\nContent-Length: 10\r\n"
+		"Connection: close\r\n\r\nNot found\n";
+	static const char unavail[] = "HTTP/1.0 503 Service Unavailable\r\n"
+		"Content-Type: text/plain\r\nContent-Length: 12\r\n"
+		"Connection: close\r\n\r\nNot started\n";
+	struct metrics_snapshot *snap;
+
+	mc->replying = true;
+	mc->hdrlen = 0;
+	if (strncmp(mc->req, "GET /metrics ", 13) && strncmp(mc->req, "GET / ", 6)) {
+		mc->body = notfound;
+		mc->bodylen = sizeof(notfound) - 1;
+		return;
+	}
+
+	mutex_lock(&metrics_lock);
+	snap = metrics_current;
+	if (snap)
+		++snap->refs;
+	mutex_unlock(&metrics_lock);
+
+	if (!snap) {
+		mc->body = unavail;
+		mc->bodylen = sizeof(unavail) - 1;
+		return;
+	}
+
+	mc->snap = snap;
+	mc->hdrlen = snprintf(mc->hdr, sizeof(mc->hdr), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+			      "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+			      METRICS_CONTENT_TYPE, (unsigned long)snap->len);
+	mc->body = snap->data;
+	mc->bodylen = snap->len;
+}
+
+static void metrics_read(struct metrics_conn *mc)
+{
+	ssize_t n;
+
+	n = recv(mc->sock, mc->req + mc->reqlen, sizeof(mc->req) - 1 - mc->reqlen, 0);
+	if (n <= 0) {
+		if (!(n < 0 && sock_blocks()))
+			metrics_drop(mc);
+		return;
+	}
+	mc->reqlen += n;
+	mc->req[mc->reqlen] = '\0';
+
+	/* Only the request line matters; wait for the end of the headers so
+	 * the client doesn't see a reset */
+	if (strstr(mc->req, "\r\n\r\n") || strstr(mc->req, "\n\n") ||
+	    mc->reqlen >= sizeof(mc->req) - 1)
+		metrics_reply(mc);
+}
+
+static void metrics_write(struct metrics_conn *mc)
+{
+	const char *s;
+	size_t len;
+	ssize_t n;
+
+	if (mc->sent < mc->hdrlen) {
+		s = mc->hdr + mc->sent;
+		len = mc->hdrlen - mc->sent;
+	} else {
+		s = mc->body + (mc->sent - mc->hdrlen);
+		len = mc->bodylen - (mc->sent - mc->hdrlen);
+	}
+	n = send(mc->sock, s, len, 0);
+	if (SOCKETFAIL(n)) {
+		if (!sock_blocks())
+			metrics_drop(mc);
+		return;
+	}
+	mc->sent += n;
+	if (mc->sent == mc->hdrlen + mc->bodylen)
+		metrics_drop(mc);
+}
+
+static void metrics_accept(SOCKETTYPE listener)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz = sizeof(cli);
+	SOCKETTYPE c;
+	int i;
+
+	c = accept(listener, (struct sockaddr *)(&cli), &clisiz);
+	if (SOCKETFAIL(c))
+		return;
+
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		if (conns[i].sock == INVSOCK)
+			break;
+	if (i == METRICS_CLIENTS || !api_access_allowed(&cli) || !set_sock_nonblocking(c)) {
+		applog(LOG_DEBUG, "Metrics ignoring connection from %s", inet_ntoa(cli.sin_addr));
+		CLOSESOCKET(c);
+		return;
+	}
+
+	memset(&conns[i], 0, sizeof(conns[i]));
+	conns[i].sock = c;
+	conns[i].deadline = time(NULL) + METRICS_TIMEOUT;
+}
+
+static void *metrics_thread(__maybe_unused void *userdata)
+{
+	struct sockaddr_in serv;
+	SOCKETTYPE listener;
+	int i, optval = 1;
+
+	pthread_detach(pthread_self());
+	RenameThread("metrics");
+
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		conns[i].sock = INVSOCK;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == INVSOCK) {
+		applog(LOG_ERR, "Metrics socket failed (%s)", SOCKERRMSG);
+		return NULL;
+	}
+
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	api_listen_addr(&serv);
+	serv.sin_port = htons(opt_metrics_port);
+	if (SOCKETFAIL(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
+		applog(LOG_DEBUG, "Metrics setsockopt SO_REUSEADDR failed (ignored): %s", SOCKERRMSG);
+	if (SOCKETFAIL(bind(listener, (struct sockaddr *)(&serv), sizeof(serv))) ||
+	    SOCKETFAIL(listen(listener, METRICS_QUEUE))) {
+		applog(LOG_ERR, "Metrics bind to port %d failed (%s)", opt_metrics_port, SOCKERRMSG);
+		CLOSESOCKET(listener);
+		return NULL;
+	}
+	applog(LOG_WARNING, "Metrics listening on port %d", opt_metrics_port);
+
+	while (42) {
+		struct timeval timeout = {1, 0};
+		SOCKETTYPE maxfd = listener;
+		fd_set rd, wd;
+		time_t now;
+
+		FD_ZERO(&rd);
+		FD_ZERO(&wd);
+		FD_SET(listener, &rd);
+		for (i = 0; i < METRICS_CLIENTS; i++) {
+			if (conns[i].sock == INVSOCK)
+				continue;
+			FD_SET(conns[i].sock, conns[i].replying ? &wd : &rd);
+			if (conns[i].sock > maxfd)
+				maxfd = conns[i].sock;
+		}
+
+		if (select(maxfd + 1, &rd, &wd, NULL, &timeout) < 0)
+			continue;
+
+		if (FD_ISSET(listener, &rd))
+			metrics_accept(listener);
+		now = time(NULL);
+		for (i = 0; i < METRICS_CLIENTS; i++) {
+			struct metrics_conn *mc = &conns[i];
+
+			if (mc->sock == INVSOCK)
+				continue;
+			if (FD_ISSET(mc->sock, &rd))
+				metrics_read(mc);
+			else if (FD_ISSET(mc->sock, &wd))
+				metrics_write(mc);
+			/* The whole exchange has to fit in METRICS_TIMEOUT */
+			if (mc->sock != INVSOCK && now > mc->deadline)
+				metrics_drop(mc);
+		}
+	}
+
+	return NULL;
+}
+
+void metrics_start(void)
+{
+	pthread_t pth;
+
+	if (!opt_metrics_port)
+		return;
+
+	mutex_init(&metrics_lock);
+	metrics_update();
+
+	if (unlikely(pthread_create(&pth, NULL, metrics_thread, NULL)))
+		quit(1, "Metrics thread create failed");
+}
@@ -94,6 +94,8 @@ struct strategies strategies[] = {
 	{ "Rotate" },
 	{ "Load Balance" },
 	{ "Balance" },
+	{ "Latency" },
+	{ "Adaptive" },
 };
 
 static char packagename[256];
@@ -169,7 +171,17 @@ bool have_libusb;
 static bool opt_submit_stale = true;
 static int opt_shares;
 static int opt_submit_threads = 0x40;
+static int opt_getwork_inflight = 2;
+int opt_standby_pools;
+bool opt_extranonce_subscribe;
+int opt_dns_cache_time = 300;
+int opt_stratum_proxy;
+int opt_metrics_port;
+char *opt_stratum_capture;
+int opt_ntime_roll;
+static int opt_adaptive_quota = 5;
 bool opt_fail_only;
+static bool opt_soft_switch;
 bool opt_autofan;
 bool opt_autoengine;
 
@@ -227,6 +239,19 @@ pthread_rwlock_t netacc_lock;
 static pthread_mutex_t lp_lock;
 static pthread_cond_t lp_cond;
 
+/* Woken by idle pools' retry timers */
+static pthread_mutex_t watchpool_lock;
+static pthread_cond_t watchpool_cond;
+static bool watchpool_due;
+static void pool_idle_timer(void *arg);
+
+/* Sweeps staged work once a pool switch may have made some of it stale */
+static struct timer_ent switch_sweep_timer;
+static void discard_stale_timer(void *arg);
+static void sweep_stale_soon(void);
+static void getwork_sched_wake(void);
+static notifier_t longpoll_notifier;
+
 pthread_mutex_t restart_lock;
 pthread_cond_t restart_cond;
 
@@ -305,6 +330,9 @@ struct stratum_share {
 	bool block;
 	struct work *work;
 	int id;
+	/* Still waiting in the submit thread for its first send */
+	bool queued;
+	struct timeval tv_submit;
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -416,50 +444,6 @@ static void applog_and_exit(const char *fmt, ...)
 	exit(1);
 }
 
-static pthread_mutex_t sharelog_lock;
-static FILE *sharelog_file = NULL;
-
-static void sharelog(const char*disposition, const struct work*work)
-{
-	char *target, *hash, *data;
-	struct cgpu_info *cgpu;
-	unsigned long int t;
-	struct pool *pool;
-	int thr_id, rv;
-	char s[1024];
-	size_t ret;
-
-	if (!sharelog_file)
-		return;
-
-	thr_id = work->thr_id;
-	cgpu = thr_info[thr_id].cgpu;
-	pool = work->pool;
-	t = (unsigned long int)(work->tv_work_found.tv_sec);
-	target = bin2hex(work->target, sizeof(work->target));
-	hash = bin2hex(work->hash, sizeof(work->hash));
-	data = bin2hex(work->data, sizeof(work->data));
-
-	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
-	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->api->name, cgpu->device_id, thr_id, hash, data);
-	free(target);
-	free(hash);
-	free(data);
-	if (rv >= (int)(sizeof(s)))
-		s[sizeof(s) - 1] = '\0';
-	else if (rv < 0) {
-		applog(LOG_ERR, "sharelog printf error");
-		return;
-	}
-
-	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
-	fflush(sharelog_file);
-	mutex_unlock(&sharelog_lock);
-	if (ret != 1)
-		applog(LOG_ERR, "sharelog fwrite error");
-}
-
 static char *getwork_req = "{\"method\": \"getwork\", \"params\": [], \"id\":0}\n";
 
 /* Return value is ignored if not called from add_pool_details */
@@ -481,6 +465,8 @@ struct pool *add_pool(void)
 
 	/* Make sure the pool doesn't think we've been idle since time 0 */
 	pool->tv_idle.tv_sec = ~0UL;
+	timer_init(&pool->idle_timer, pool_idle_timer, pool);
+	timer_init(&pool->drain_timer, discard_stale_timer, NULL);
 	
 	gettimeofday(&pool->cgminer_stats.start_tv, NULL);
 
@@ -546,6 +532,11 @@ static char *set_int_0_to_9999(const char *arg, int *i)
 	return set_int_range(arg, i, 0, 9999);
 }
 
+static char *set_int_0_to_65535(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 65535);
+}
+
 static char *set_int_1_to_65535(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 1, 65535);
@@ -729,6 +720,23 @@ static char *set_loadbalance(enum pool_strategy *strategy)
 	return NULL;
 }
 
+static char *set_latency(enum pool_strategy *strategy)
+{
+	*strategy = POOL_LATENCY;
+	return NULL;
+}
+
+static char *set_adaptive(enum pool_strategy *strategy)
+{
+	*strategy = POOL_ADAPTIVE;
+	return NULL;
+}
+
+static char *set_adaptive_quota(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 100);
+}
+
 static char *set_rotate(const char *arg, int *i)
 {
 	pool_strategy = POOL_ROTATE;
@@ -891,28 +899,6 @@ static char *set_schedtime(const char *arg, struct schedtime *st)
 	return NULL;
 }
 
-static char* set_sharelog(char *arg)
-{
-	char *r = "";
-	long int i = strtol(arg, &r, 10);
-
-	if ((!*r) && i >= 0 && i <= INT_MAX) {
-		sharelog_file = fdopen((int)i, "a");
-		if (!sharelog_file)
-			applog(LOG_ERR, "Failed to open fd %u for share log", (unsigned int)i);
-	} else if (!strcmp(arg, "-")) {
-		sharelog_file = stdout;
-		if (!sharelog_file)
-			applog(LOG_ERR, "Standard output missing for share log");
-	} else {
-		sharelog_file = fopen(arg, "a");
-		if (!sharelog_file)
-			applog(LOG_ERR, "Failed to open %s for share log", arg);
-	}
-
-	return NULL;
-}
-
 static char *temp_cutoff_str = "";
 static char *temp_target_str = "";
 
@@ -1109,6 +1095,12 @@ static struct opt_table opt_config_table[] = {
 		),
 #endif /* USE_SHA256D */
 #endif
+	OPT_WITHOUT_ARG("--adaptive-balance",
+		     set_adaptive, &pool_strategy,
+		     "Change multipool strategy from failover to balance biased towards pools with the most accepted difficulty"),
+	OPT_WITH_ARG("--adaptive-quota",
+		     set_adaptive_quota, opt_show_intval, &opt_adaptive_quota,
+		     "Minimum percentage of work given to each alive pool with --adaptive-balance"),
 	OPT_WITH_ARG("--api-allow",
 		     set_api_allow, NULL, NULL,
 		     "Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
@@ -1141,6 +1133,12 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--benchmark",
 			opt_set_bool, &opt_benchmark,
 			"Run the miner in benchmark mode - produces no shares"),
+	OPT_WITH_ARG("--benchmark-getwork",
+		     set_benchmark_getwork, NULL, NULL,
+		     "Benchmark the getwork scheduler against a built-in mock HTTP pool: reply_ms,fail_every (default: 200,0)"),
+	OPT_WITH_ARG("--benchmark-stratum",
+		     set_benchmark_stratum, NULL, NULL,
+		     "Benchmark the stratum pipeline against a built-in mock pool: notify_ms,clean_every,merkles,diff,delay_ms (default: 1000,10,12,0.001,0)"),
 #if defined(USE_BITFORCE)
 	OPT_WITHOUT_ARG("--bfl-range",
 			opt_set_bool, &opt_bfl_noncerange,
@@ -1175,6 +1173,14 @@ static struct opt_table opt_config_table[] = {
 			"Use compact display without per device statistics"),
 #endif
 #ifdef WANT_CPUMINE
+	OPT_WITHOUT_ARG("--cpu-perf",
+			opt_set_bool, &opt_cpu_perf,
+#ifdef HAVE_LINUX_PERF_EVENT_H
+			"Count cycles, instructions and cache misses per CPU mining thread for the API stats"
+#else
+			opt_hidden
+#endif
+	),
 	OPT_WITH_ARG("--cpu-threads|-t",
 		     force_nthreads_int, opt_show_intval, &opt_n_threads,
 		     "Number of miner CPU threads"),
@@ -1199,6 +1205,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--disable-rejecting",
 			opt_set_bool, &opt_disable_pool,
 			"Automatically disable pools that continually reject shares"),
+	OPT_WITH_ARG("--dns-cache-time",
+		     set_int_0_to_9999, opt_show_intval, &opt_dns_cache_time,
+		     "Seconds to keep resolved stratum pool addresses cached for reconnecting"),
 #if defined(WANT_CPUMINE) && (defined(HAVE_OPENCL) || defined(USE_FPGA))
 	OPT_WITHOUT_ARG("--enable-cpu|-C",
 			opt_set_bool, &opt_usecpu,
@@ -1210,6 +1219,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--expiry-lp",
 		     set_int_0_to_9999, opt_show_intval, &opt_expiry_lp,
 		     "Upper bound on how many seconds after getting work we consider a share from it stale (with longpoll active)"),
+	OPT_WITHOUT_ARG("--extranonce-subscribe",
+		     opt_set_bool, &opt_extranonce_subscribe,
+		     "Ask stratum pools to notify extranonce changes instead of reconnecting"),
 	OPT_WITHOUT_ARG("--failover-only",
 			opt_set_bool, &opt_fail_only,
 			"Don't leak work to backup pools when primary pool is lagging"),
@@ -1218,6 +1230,9 @@ static struct opt_table opt_config_table[] = {
 	        opt_set_bool, &opt_force_dev_init,
 	        "Always initialize devices when possible (such as bitstream uploads to some FPGAs)"),
 #endif
+	OPT_WITH_ARG("--getwork-inflight",
+		     set_int_1_to_10, opt_show_intval, &opt_getwork_inflight,
+		     "Number of getwork or GBT requests to keep in flight per pool"),
 #ifdef HAVE_OPENCL
 	OPT_WITH_ARG("--gpu-dyninterval",
 		     set_int_1_to_65535, opt_show_intval, &opt_dynamic_interval,
@@ -1293,6 +1308,9 @@ static struct opt_table opt_config_table[] = {
 		     set_icarus_timing, NULL, NULL,
 		     opt_hidden),
 #endif
+	OPT_WITHOUT_ARG("--latency-balance",
+		     set_latency, &pool_strategy,
+		     "Change multipool strategy from failover to balance biased towards low latency pools"),
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
 		     "Change multipool strategy from failover to efficiency based balance"),
@@ -1302,6 +1320,12 @@ static struct opt_table opt_config_table[] = {
     OPT_WITHOUT_ARG("--log-show-date",
       opt_set_bool, &opt_log_show_date,
       "Show date on every log line in addition to time"),
+	OPT_WITHOUT_ARG("--log-sync",
+			opt_set_bool, &opt_log_sync,
+			"Write log messages from the thread logging them instead of a logger thread"),
+	OPT_WITH_ARG("--metrics-port",
+		     set_int_0_to_65535, opt_show_intval, &opt_metrics_port,
+		     "Serve OpenMetrics text for Prometheus at /metrics on this port (0 = disabled)"),
 #if defined(unix) || defined(__APPLE__)
 	OPT_WITH_ARG("--monitor|-m",
 		     opt_set_charp, NULL, &opt_stderr_cmd,
@@ -1348,6 +1372,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--no-submit-stale",
 			opt_set_invbool, &opt_submit_stale,
 		        "Don't submit shares if they are detected as stale"),
+	OPT_WITH_ARG("--ntime-roll",
+		     set_int_0_to_9999, opt_show_intval, &opt_ntime_roll,
+		     "Seconds stratum work ntime may be rolled past the job's ntime (0 = never roll)"),
     OPT_WITH_ARG("--pass|-p",
       set_pass, NULL, NULL,
       "Password for a JSON-RPC server"),
@@ -1375,6 +1402,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--remove-disabled",
 		     opt_set_bool, &opt_removedisabled,
 	         "Remove disabled devices entirely, as if they didn't exist"),
+	OPT_WITH_ARG("--replay-speed",
+		     set_replay_speed, NULL, NULL,
+		     "Speed multiplier for --stratum-replay, 0 sends messages as fast as possible (default: 1)"),
 	OPT_WITH_ARG("--retries",
 		     opt_set_intval, opt_show_intval, &opt_retries,
 		     "Number of times to retry failed submissions before giving up (-1 means never)"),
@@ -1412,15 +1442,39 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--sharelog",
 		     set_sharelog, NULL, NULL,
 		     "Append share log to file"),
+	OPT_WITHOUT_ARG("--sharelog-binary",
+			opt_set_bool, &opt_sharelog_binary,
+			"Write the share log as compact binary records instead of CSV"),
+	OPT_WITH_ARG("--sharelog-csv",
+		     sharelog_to_csv, NULL, NULL,
+		     "Print a binary share log file as CSV and exit"),
+	OPT_WITH_ARG("--sharelog-rotate",
+		     set_sharelog_rotate, NULL, NULL,
+		     "Start a new share log file after this many MiB or seconds: size[,seconds] (0 = never)"),
 	OPT_WITH_ARG("--shares",
 		     opt_set_intval, NULL, &opt_shares,
 		     "Quit after mining N shares (default: unlimited)"),
 	OPT_WITH_ARG("--skip-security-checks",
 			set_int_0_to_9999, NULL, &opt_skip_checks,
 			"Skip security checks sometimes to save bandwidth; only check 1/<arg>th of the time (default: never skip)"),
+	OPT_WITHOUT_ARG("--soft-switch",
+			opt_set_bool, &opt_soft_switch,
+			"On pool switch, keep mining work already fetched from the old pool while it stays alive"),
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+	OPT_WITH_ARG("--standby-pools",
+		     set_int_0_to_10, opt_show_intval, &opt_standby_pools,
+		     "Number of backup stratum pools to keep connected and authorised for instant failover"),
+	OPT_WITH_ARG("--stratum-capture",
+		     opt_set_charp, NULL, &opt_stratum_capture,
+		     "Log every stratum line sent and received with timestamps to file for --stratum-replay"),
+	OPT_WITH_ARG("--stratum-proxy",
+		     set_int_0_to_65535, opt_show_intval, &opt_stratum_proxy,
+		     "Serve work from the current stratum pool to other miners on this port (0 = disabled)"),
+	OPT_WITH_ARG("--stratum-replay",
+		     opt_set_charp, NULL, &opt_stratum_replay,
+		     "Mine on a built-in pool replaying the pool messages in a --stratum-capture file"),
 	OPT_WITHOUT_ARG("--submit-stale",
 			opt_set_bool, &opt_submit_stale,
 	                opt_hidden),
@@ -1454,6 +1508,9 @@ static struct opt_table opt_config_table[] = {
 			opt_hidden
 #endif
 	),
+	OPT_WITH_ARG("--trace",
+		     opt_set_charp, NULL, &opt_trace,
+		     "Record work lifecycle events and write them to file as a Chrome trace on exit"),
     OPT_WITH_ARG("--url|-o",
       set_url, NULL, NULL,
       "URL for a JSON-RPC server"),
@@ -1816,6 +1873,9 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
     if(!opt_neoscrypt) data_size = 128;
 
 	if (work->tmpl) {
+		struct timeval tv_tmpl, tv_data;
+
+		gettimeofday(&tv_tmpl, NULL);
 		const char *err = blktmpl_add_jansson(work->tmpl, res_val, time(NULL));
 		if (err) {
 			applog(LOG_ERR, "blktmpl error: %s", err);
@@ -1890,6 +1950,9 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 #endif
 		if (blkmk_get_data(work->tmpl, work->data, 80, time(NULL), NULL, &work->dataid) < 76)
 			return false;
+		gettimeofday(&tv_data, NULL);
+		applog(LOG_DEBUG, "Template with %lu transactions decoded to first work in %.3f ms",
+		       (unsigned long)work->tmpl->txncount, tdiff(&tv_data, &tv_tmpl) * 1000);
         if(!opt_neoscrypt) swap32yes(work->data, work->data, 80 / 4);
 		memcpy(&work->data[80], "\0\0\0\x80\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\x80\x02\0\0", 48);
 
@@ -2354,7 +2417,7 @@ static void curses_print_status(void)
       __total_staged(), total_discarded, total_getworks, local_work, total_go,
       new_blocks, total_submitting, total_ro, efficiency);
 	wclrtoeol(statuswin);
-	if ((pool_strategy == POOL_LOADBALANCE  || pool_strategy == POOL_BALANCE) && total_pools > 1) {
+	if ((pool_strategy == POOL_LOADBALANCE  || pool_strategy == POOL_BALANCE || pool_strategy == POOL_LATENCY || pool_strategy == POOL_ADAPTIVE) && total_pools > 1) {
 		mvwprintw(statuswin, 4, 0, " Connected to multiple pools with%s LP",
 			have_longpoll ? "": "out");
 	} else if (pool->has_stratum) {
@@ -2760,22 +2823,27 @@ static char *submit_upstream_work_request(struct work *work)
 
     if(work->tmpl) {
 
-        json_t *req;
+        struct timeval tv_start, tv_end;
+
+        /* The block hex is written straight into the request buffer which
+         * is then uploaded as is */
+        gettimeofday(&tv_start, NULL);
         if(opt_neoscrypt) {
-            req = blkmk_submit_jansson(work->tmpl, work->data, work->dataid,
+            s = blkmk_submit_string(work->tmpl, work->data, work->dataid,
               be32toh(*((uint32_t *) &work->data[76])));
-            s = json_dumps(req, 0);
-            json_decref(req);
             sd = bin2hex(work->data, 80);
         } else {
             uchar data[80];
             swap32yes(data, work->data, 80 / 4);
-            req = blkmk_submit_jansson(work->tmpl, data, work->dataid,
+            s = blkmk_submit_string(work->tmpl, data, work->dataid,
               le32toh(*((uint32_t *) &work->data[76])));
-            s = json_dumps(req, 0);
-            json_decref(req);
             sd = bin2hex(data, 80);
     }
+        gettimeofday(&tv_end, NULL);
+        if (s)
+            applog(LOG_DEBUG, "Assembled %lu byte submission with %lu transactions in %.3f ms",
+              (unsigned long)strlen(s), (unsigned long)work->tmpl->txncount,
+              tdiff(&tv_end, &tv_start) * 1000);
 
 	} else {
 
@@ -2827,6 +2895,10 @@ static bool submit_upstream_work_completed(struct work *work, bool resubmit, str
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
+	mutex_lock(&stats_lock);
+	latency_hist_add(&pool->cgminer_pool_stats.submit_hist, tdiff(&tv_submit_reply, ptv_submit));
+	mutex_unlock(&stats_lock);
+
 	res = json_object_get(val, "result");
 	err = json_object_get(val, "error");
 
@@ -2928,6 +3000,180 @@ static struct pool *select_balanced(struct pool *cp) {
 	return ret;
 }
 
+/* Best known latency estimate for a pool in seconds, or a negative value if
+ * nothing has been measured yet. Stratum pools use the submit to ack round
+ * trip, getwork/GBT pools the rolling getwork wait. */
+static double pool_latency(struct pool *pool)
+{
+	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
+
+	if (pool->has_stratum && pool_stats->stratum_rtt_count)
+		return pool_stats->stratum_rtt_rolling;
+	if (pool_stats->getwork_calls)
+		return pool_stats->getwork_wait_rolling;
+	return -1;
+}
+
+static double lowest_latency(void)
+{
+	double lowest = -1, latency;
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (pool->idle || pool->enabled != POOL_ENABLED)
+			continue;
+		latency = pool_latency(pool);
+		if (latency > 0 && (lowest < 0 || latency < lowest))
+			lowest = latency;
+	}
+
+	return lowest;
+}
+
+/* Latency of a pool relative to the fastest alive pool, 1 being the fastest.
+ * Pools not measured yet count as the fastest so they get work to measure. */
+static double latency_weight(struct pool *pool, double lowest)
+{
+	double latency = pool_latency(pool);
+
+	if (latency <= 0 || lowest <= 0)
+		return 1;
+	return latency / lowest;
+}
+
+/* In latency mode, work is distributed as in balanced mode but the share
+ * count of each pool is weighted by its relative latency, so pools that
+ * answer faster, and thus produce fewer stales, get proportionally more. */
+static struct pool *select_latency(struct pool *cp) {
+	double lowest_lat = lowest_latency();
+	double lowest = (cp->shares + 1) * latency_weight(cp, lowest_lat);
+	int i;
+	struct pool *ret = cp;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		double score;
+
+		if (pool->idle || pool->enabled != POOL_ENABLED)
+			continue;
+		score = (pool->shares + 1) * latency_weight(pool, lowest_lat);
+		if (score < lowest) {
+			lowest = score;
+			ret = pool;
+		}
+	}
+
+	ret->shares++;
+	return ret;
+}
+
+/* The adaptive strategy values each pool by the fraction of the difficulty it
+ * was sent that it accepted, as decaying sums updated every watchpool pass.
+ * Shares are found in proportion to the hashing done for a pool, so this is
+ * accepted difficulty per hash, with rejects and stales (including those
+ * caused by latency) counting against the pool. */
+#define ADAPTIVE_DECAY		0.95
+#define ADAPTIVE_MIN_SHARES	5
+
+static double adaptive_value(struct pool *pool)
+{
+	double efficiency;
+
+	/* Pools without enough results yet count as perfect so they get work
+	 * to measure */
+	if (pool->adaptive_shares < ADAPTIVE_MIN_SHARES || pool->adaptive_submitted <= 0)
+		return 100;
+	efficiency = pool->adaptive_accepted / pool->adaptive_submitted;
+	if (efficiency > 1)
+		efficiency = 1;
+	/* Roughly the inverse of the loss, so 1% lost (49.5) is worth about
+	 * three times 5% lost (15.8) */
+	return efficiency / (1.01 - efficiency);
+}
+
+/* A counter that went backwards was zeroed, so all of it is new */
+#define ADAPTIVE_DELTA(now, last) ((now) >= (last) ? (now) - (last) : (now))
+
+/* Every alive pool is given at least --adaptive-quota percent of the work and
+ * the rest is split in proportion to the pools' value */
+static void update_adaptive_weights(void)
+{
+	double quota = opt_adaptive_quota / 100.0, total_value = 0;
+	int i, alive = 0;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		double accepted = pool->diff_accepted;
+		double submitted = accepted + pool->diff_rejected + pool->diff_stale;
+		int shares = pool->accepted + pool->rejected;
+
+		pool->adaptive_accepted = pool->adaptive_accepted * ADAPTIVE_DECAY + ADAPTIVE_DELTA(accepted, pool->adaptive_last_accepted);
+		pool->adaptive_submitted = pool->adaptive_submitted * ADAPTIVE_DECAY + ADAPTIVE_DELTA(submitted, pool->adaptive_last_submitted);
+		pool->adaptive_shares = pool->adaptive_shares * ADAPTIVE_DECAY + ADAPTIVE_DELTA(shares, pool->adaptive_last_shares);
+		pool->adaptive_last_accepted = accepted;
+		pool->adaptive_last_submitted = submitted;
+		pool->adaptive_last_shares = shares;
+
+		if (pool->idle || pool->enabled != POOL_ENABLED)
+			continue;
+		alive++;
+		total_value += adaptive_value(pool);
+	}
+
+	if (!alive)
+		return;
+	if (quota * alive > 1)
+		quota = 1.0 / alive;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (pool->idle || pool->enabled != POOL_ENABLED) {
+			pool->adaptive_weight = 0;
+			continue;
+		}
+		pool->adaptive_weight = quota + (1 - quota * alive) * adaptive_value(pool) / total_value;
+		applog(LOG_DEBUG, "Pool %d adaptive accepted %.1f of %.1f diff, weight %.3f",
+		       pool->pool_no, pool->adaptive_accepted, pool->adaptive_submitted, pool->adaptive_weight);
+	}
+}
+
+/* Share of the work a pool should get, pools not weighted yet get an even
+ * share */
+static double adaptive_weight(struct pool *pool)
+{
+	if (pool->adaptive_weight > 0)
+		return pool->adaptive_weight;
+	return 1.0 / (total_pools ?: 1);
+}
+
+/* In adaptive mode, work is distributed as in balanced mode but each pool's
+ * share count is divided by its adaptive weight, so pools end up with work in
+ * proportion to their weights */
+static struct pool *select_adaptive(struct pool *cp) {
+	double lowest = (cp->shares + 1) / adaptive_weight(cp);
+	int i;
+	struct pool *ret = cp;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		double score;
+
+		if (pool->idle || pool->enabled != POOL_ENABLED)
+			continue;
+		score = (pool->shares + 1) / adaptive_weight(pool);
+		if (score < lowest) {
+			lowest = score;
+			ret = pool;
+		}
+	}
+
+	ret->shares++;
+	return ret;
+}
+
 static bool pool_active(struct pool *, bool pinging);
 static void pool_died(struct pool *);
 
@@ -2946,6 +3192,18 @@ retry:
 		goto have_pool;
 	}
 
+	if (pool_strategy == POOL_LATENCY)
+	{
+		pool = select_latency(cp);
+		goto have_pool;
+	}
+
+	if (pool_strategy == POOL_ADAPTIVE)
+	{
+		pool = select_adaptive(cp);
+		goto have_pool;
+	}
+
 	if (pool_strategy != POOL_LOADBALANCE && (!lagging || opt_fail_only))
 		pool = cp;
 	else
@@ -3182,47 +3440,41 @@ static enum pool_protocol pool_protocol_fallback(enum pool_protocol proto)
 	}
 }
 
-static bool get_upstream_work(struct work *work, CURL *curl)
+/* Returns the getwork or GBT request for work from its pool */
+static char *get_upstream_work_req(struct work *work)
 {
 	struct pool *pool = work->pool;
-	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
-	struct timeval tv_elapsed;
-	json_t *val = NULL;
-	bool rc = false;
-	char *url;
-	enum pool_protocol proto;
-
 	char *rpc_req;
 
 	if (pool->proto == PLP_NONE)
 		pool->proto = PLP_GETBLOCKTEMPLATE;
 
-tryagain:
 	rpc_req = prepare_rpc_req(work, pool->proto, NULL);
 	work->pool = pool;
 	if (!rpc_req)
-		return false;
+		return NULL;
 
 	applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, rpc_req);
 
-	url = pool->rpc_url;
-
 	gettimeofday(&(work->tv_getwork), NULL);
 
-	val = json_rpc_call(curl, url, pool->rpc_userpass, rpc_req, false,
-			    false, &work->rolltime, pool, false);
-	pool_stats->getwork_attempts++;
+	return rpc_req;
+}
 
-	free(rpc_req);
+/* Decodes the reply to get_upstream_work_req, val is NULL if it failed */
+static bool get_upstream_work_completed(struct work *work, json_t *val)
+{
+	struct pool *pool = work->pool;
+	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
+	struct timeval tv_elapsed;
+	bool rc = false;
+
+	pool_stats->getwork_attempts++;
 
 	if (likely(val)) {
 		rc = work_decode(pool, work, val);
 		if (unlikely(!rc))
 			applog(LOG_DEBUG, "Failed to decode work in get_upstream_work");
-	} else if (PLP_NONE != (proto = pool_protocol_fallback(pool->proto))) {
-		applog(LOG_WARNING, "Pool %u failed getblocktemplate request; falling back to getwork protocol", pool->pool_no);
-		pool->proto = proto;
-		goto tryagain;
 	} else
 		applog(LOG_DEBUG, "Failed json_rpc_call in get_upstream_work");
 
@@ -3230,6 +3482,8 @@ tryagain:
 	timersub(&(work->tv_getwork_reply), &(work->tv_getwork), &tv_elapsed);
 	pool_stats->getwork_wait_rolling += ((double)tv_elapsed.tv_sec + ((double)tv_elapsed.tv_usec / 1000000)) * 0.63;
 	pool_stats->getwork_wait_rolling /= 1.63;
+	if (likely(val))
+		latency_hist_add(&pool_stats->getwork_hist, (double)tv_elapsed.tv_sec + ((double)tv_elapsed.tv_usec / 1000000));
 
 	timeradd(&tv_elapsed, &(pool_stats->getwork_wait), &(pool_stats->getwork_wait));
 	if (timercmp(&tv_elapsed, &(pool_stats->getwork_wait_max), >)) {
@@ -3466,7 +3720,7 @@ static inline bool should_roll(struct work *work)
 	struct timeval now;
 	time_t expiry;
 
-	if (work->pool != current_pool() && pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE)
+	if (work->pool != current_pool() && pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE && pool_strategy != POOL_LATENCY && pool_strategy != POOL_ADAPTIVE)
 		return false;
 
 	if (stale_work(work, false))
@@ -3491,10 +3745,11 @@ static inline bool should_roll(struct work *work)
  * reject blocks as invalid. */
 static inline bool can_roll(struct work *work)
 {
-	if (work->stratum)
-		return false;
 	if (!(work->pool && !work->clone))
 		return false;
+	/* Each stratum roll moves ntime on by a second from the job's */
+	if (work->stratum)
+		return (work->rolls < opt_ntime_roll && !stale_work(work, false));
 	if (work->tmpl) {
 		if (stale_work(work, false))
 			return false;
@@ -3535,6 +3790,15 @@ static void roll_work(struct work *work) {
             *work_ntime = htobe32(ntime);
         }
 
+        /* Shares are submitted with this ntime */
+        if(work->ntime) {
+            free(work->ntime);
+            work->ntime = malloc(9);
+            if(unlikely(!work->ntime))
+              quit(1, "Failed to malloc ntime in roll_work");
+            sprintf(work->ntime, "%08x", ntime);
+        }
+
         applog(LOG_DEBUG, "Successfully rolled time header in work");
     }
 
@@ -3553,6 +3817,7 @@ void __copy_work(struct work *work, struct work *base_work)
 {
 	clean_work(work);
 	memcpy(work, base_work, sizeof(struct work));
+	timer_init(&work->expiry_timer, NULL, NULL);
 	if (base_work->job_id)
 		work->job_id = strdup(base_work->job_id);
 	if (base_work->nonce2)
@@ -3596,7 +3861,8 @@ static struct work *make_clone(struct work *work)
 
 static void stage_work(struct work *work);
 
-static bool clone_available(void)
+/* Clone rollable staged work, only from the given pool unless it is NULL */
+static bool clone_available(struct pool *pool)
 {
 	struct work *work_clone = NULL, *work, *tmp;
 	bool cloned = false;
@@ -3606,7 +3872,7 @@ static bool clone_available(void)
 		goto out_unlock;
 
 	HASH_ITER(hh, staged_work, work, tmp) {
-		if (can_roll(work) && should_roll(work)) {
+		if ((!pool || work->pool == pool) && can_roll(work) && should_roll(work)) {
 			roll_work(work);
 			work_clone = make_clone(work);
 			roll_work(work);
@@ -3624,10 +3890,30 @@ out_unlock:
 	return cloned;
 }
 
+#define POOL_IDLE_RETRY 30
+
+static void pool_idle_timer(void __maybe_unused *arg)
+{
+	mutex_lock(&watchpool_lock);
+	watchpool_due = true;
+	pthread_cond_signal(&watchpool_cond);
+	mutex_unlock(&watchpool_lock);
+}
+
+/* Have watchpool_thread probe an idle pool again once it is due */
+static void arm_idle_timer(struct pool *pool)
+{
+	struct timeval when = pool->tv_idle;
+
+	when.tv_sec += POOL_IDLE_RETRY;
+	timer_set(&pool->idle_timer, &when);
+}
+
 static void pool_died(struct pool *pool)
 {
 	if (!pool_tset(pool, &pool->idle)) {
 		gettimeofday(&pool->tv_idle, NULL);
+		arm_idle_timer(pool);
 		if (pool == current_pool()) {
 			applog(LOG_WARNING, "Pool %d %s not responding!", pool->pool_no, pool->rpc_url);
 			switch_pools(NULL);
@@ -3636,23 +3922,21 @@ static void pool_died(struct pool *pool)
 	}
 }
 
-static bool stale_work(struct work *work, bool share)
+/* With --soft-switch, a pool switched away from while alive keeps its work
+ * valid for up to the expiry time, instead of it being discarded straight
+ * away under --failover-only or losing its stratum connection */
+static bool pool_draining(struct pool *pool)
+{
+	return (pool->drain_until > time(NULL) && !pool->idle && pool->enabled == POOL_ENABLED);
+}
+
+/* How many seconds after being staged work, or a share found in it, expires */
+static unsigned stale_work_expiry(struct work *work, bool share)
 {
+	struct pool *pool = work->pool;
 	unsigned work_expiry;
-	struct pool *pool;
 	unsigned getwork_delay;
 
-	if (opt_benchmark)
-		return false;
-
-    uint block_id;
-    if(opt_neoscrypt)
-      block_id = le32toh(((uint *) work->data)[1]);
-    else
-      block_id = be32toh(((uint *) work->data)[1]);
-
-	pool = work->pool;
-
 	/* Technically the rolltime should be correct but some pools
 	 * advertise a broken expire= that is lower than a meaningful
 	 * scantime */
@@ -3665,6 +3949,36 @@ static bool stale_work(struct work *work, bool share)
 	if (work_expiry > max_expiry)
 		work_expiry = max_expiry;
 
+	if (share)
+		return work_expiry;
+
+	/* Factor in the average getwork delay of this pool, rounding it up to
+	 * the nearest second */
+	getwork_delay = pool->cgminer_pool_stats.getwork_wait_rolling * 5 + 1;
+	if (unlikely(work_expiry <= getwork_delay + 5))
+		work_expiry = 5;
+	else
+		work_expiry -= getwork_delay;
+
+	return work_expiry;
+}
+
+static bool stale_work(struct work *work, bool share)
+{
+	unsigned work_expiry;
+	struct pool *pool;
+
+	if (opt_benchmark)
+		return false;
+
+    uint block_id;
+    if(opt_neoscrypt)
+      block_id = le32toh(((uint *) work->data)[1]);
+    else
+      block_id = be32toh(((uint *) work->data)[1]);
+
+	pool = work->pool;
+
 	if (share) {
 		/* If the share isn't on this pool's latest block, it's stale */
 		if (pool->block_id && pool->block_id != block_id)
@@ -3717,16 +4031,9 @@ static bool stale_work(struct work *work, bool share)
 		}
 	}
 
-	/* Factor in the average getwork delay of this pool, rounding it up to
-	 * the nearest second */
-	getwork_delay = pool->cgminer_pool_stats.getwork_wait_rolling * 5 + 1;
-	if (unlikely(work_expiry <= getwork_delay + 5))
-		work_expiry = 5;
-	else
-		work_expiry -= getwork_delay;
-
 	}
 
+	work_expiry = stale_work_expiry(work, share);
 	double elapsed_since_staged = difftime(time(NULL), work->tv_staged.tv_sec);
 	if (elapsed_since_staged > work_expiry) {
 		applog(LOG_DEBUG, "%s stale due to expiry (%.0f >= %u)", share?"Share":"Work", elapsed_since_staged, work_expiry);
@@ -3735,8 +4042,8 @@ static bool stale_work(struct work *work, bool share)
 
 	/* If the user only wants strict failover, any work from a pool other than
 	 * the current one is always considered stale */
-	if (opt_fail_only && !share && pool != current_pool() && !work->mandatory &&
-	    pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
+	if (opt_fail_only && !share && pool != current_pool() && !work->mandatory && !pool_draining(pool) &&
+	    pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE && pool_strategy != POOL_LATENCY && pool_strategy != POOL_ADAPTIVE) {
 		applog(LOG_DEBUG, "Work stale due to fail only pool mismatch (pool %u vs %u)", pool->pool_no, current_pool()->pool_no);
 		return true;
 	}
@@ -3768,6 +4075,7 @@ struct submit_work_state {
 	int failures;
 	time_t staleexpire;
 	char *s;
+	int sshare_id;
 	struct timeval tv_submit;
 	struct submit_work_state *next;
 };
@@ -3810,11 +4118,35 @@ static void nbits_to_target(uchar *target, uint nbits) {
     target[shift + 2] = pnbits[2];
 }
 
+/* Builds the mining.submit request for a stratum share, with room left for
+ * the newline stratum_send appends */
+static char *stratum_submit_str(struct work *work, int id)
+{
+	uint32_t nonce;
+	char *noncehex;
+	char *s;
+
+        if(opt_neoscrypt)
+          nonce = htobe32(*((uint32_t *)(work->data + 76)));
+        else
+          nonce = *((uint32_t *)(work->data + 76));
+
+	noncehex = bin2hex((const unsigned char *)&nonce, 4);
+	s = malloc(1024);
+	sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+		work->pool->rpc_user, work->job_id, work->nonce2, work->ntime, noncehex, id);
+	free(noncehex);
+
+	return s;
+}
+
 static struct submit_work_state *begin_submission(struct work *work)
 {
 	struct pool *pool;
 	struct submit_work_state *sws = NULL;
 
+	trace_work(TRACE_SUBMIT, work);
+
 	pool = work->pool;
 	sws = malloc(sizeof(*sws));
 	*sws = (struct submit_work_state){
@@ -3863,29 +4195,19 @@ static struct submit_work_state *begin_submission(struct work *work)
 
 	if (work->stratum) {
 		struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
-		uint32_t nonce;
-		char *noncehex;
-		char *s;
 
 		sshare->work = copy_work(work);
+		gettimeofday(&sshare->tv_submit, NULL);
 		mutex_lock(&sshare_lock);
 		/* Give the stratum share a unique id */
 		sshare->id = swork_id++;
+		sshare->queued = true;
 		HASH_ADD_INT(stratum_shares, id, sshare);
 		mutex_unlock(&sshare_lock);
 
-        if(opt_neoscrypt)
-          nonce = htobe32(*((uint32_t *)(work->data + 76)));
-        else
-          nonce = *((uint32_t *)(work->data + 76));
-
-		noncehex = bin2hex((const unsigned char *)&nonce, 4);
-		s = malloc(1024);
-		sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-			pool->rpc_user, work->job_id, work->nonce2, work->ntime, noncehex, sshare->id);
-		free(noncehex);
+		sws->sshare_id = sshare->id;
 
-		sws->s = s;
+		sws->s = stratum_submit_str(work, sshare->id);
 	} else {
 		/* submit solution to bitcoin via JSON-RPC */
 		sws->ce = pop_curl_entry2(pool, false);
@@ -3949,6 +4271,28 @@ static bool retry_submission(struct submit_work_state *sws)
 	return true;
 }
 
+/* The submit thread is done with a stratum share: either it went out on the
+ * socket and now awaits its result, or it was discarded and is forgotten */
+static void sshare_dequeued(struct submit_work_state *sws, bool discarded)
+{
+	struct stratum_share *sshare;
+
+	mutex_lock(&sshare_lock);
+	HASH_FIND_INT(stratum_shares, &sws->sshare_id, sshare);
+	if (sshare) {
+		if (discarded)
+			HASH_DEL(stratum_shares, sshare);
+		else
+			sshare->queued = false;
+	}
+	mutex_unlock(&sshare_lock);
+
+	if (sshare && discarded) {
+		free_work(sshare->work);
+		free(sshare);
+	}
+}
+
 static void free_sws(struct submit_work_state *sws)
 {
 	free(sws->s);
@@ -4025,6 +4369,7 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 			if (fd == INVSOCK) {
 				applog(LOG_WARNING, "Stratum pool %u died while share waiting to submit, discarding", sws->work->pool->pool_no);
 				submit_discard_share2("disconnect", sws->work);
+				sshare_dequeued(sws, true);
 				--wip;
 				++tsreduce;
 				*swsp = sws->next;
@@ -4073,6 +4418,7 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 				total_ro++;
 				pool->remotefail_occasions++;
 			}
+			sshare_dequeued(sws, false);
 			
 			// Clear the fd from wfds, to avoid potentially blocking on other submissions to the same socket
 			FD_CLR(fd, &wfds);
@@ -4124,6 +4470,184 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 	return NULL;
 }
 
+/* Getwork and GBT work is fetched asynchronously by getwork_fetch_thread, so
+ * staging is not held up by a pool's response time */
+struct getwork_fetch {
+	struct work *work;
+	struct curl_ent *ce;
+	char *rpc_req;
+	struct getwork_fetch *next;
+};
+
+static void pool_resus(struct pool *pool);
+
+static pthread_mutex_t getwork_fetch_lock;
+static pthread_cond_t getwork_fetch_cond;
+static struct getwork_fetch *getwork_fetch_waiting;
+static notifier_t getwork_fetch_notifier;
+
+/* Wakes the getwork scheduler when it is waiting on a pool's requests */
+static void getwork_sched_wake(void)
+{
+	mutex_lock(&getwork_fetch_lock);
+	pthread_cond_signal(&getwork_fetch_cond);
+	mutex_unlock(&getwork_fetch_lock);
+}
+
+static void getwork_fetch_done(struct pool *pool)
+{
+	mutex_lock(&getwork_fetch_lock);
+	pool->getworks_inflight--;
+	pthread_cond_signal(&getwork_fetch_cond);
+	mutex_unlock(&getwork_fetch_lock);
+}
+
+/* Make sure the pool just hasn't stopped serving requests but is up, as
+ * otherwise we'll keep hammering it */
+static void getwork_fetch_failed(struct pool *pool, struct work *work)
+{
+	free_work(work);
+	++pool->seq_getfails;
+	pool->getwork_retry = time(NULL) + 5;
+	pool_died(pool);
+	getwork_fetch_done(pool);
+}
+
+static void getwork_fetch_completed(CURLM *curlm, struct getwork_fetch *gf, json_t *val)
+{
+	struct work *work = gf->work;
+	struct pool *pool = work->pool;
+	enum pool_protocol proto;
+
+	free(gf->rpc_req);
+	gf->rpc_req = NULL;
+	if (!val && PLP_NONE != (proto = pool_protocol_fallback(pool->proto))) {
+		applog(LOG_WARNING, "Pool %u failed getblocktemplate request; falling back to getwork protocol", pool->pool_no);
+		pool->proto = proto;
+		gf->rpc_req = get_upstream_work_req(work);
+		if (gf->rpc_req) {
+			json_rpc_call_async(gf->ce->curl, pool->rpc_url, pool->rpc_userpass, gf->rpc_req, false, pool, false, gf);
+			curl_multi_add_handle(curlm, gf->ce->curl);
+			return;
+		}
+	}
+
+	push_curl_entry(gf->ce, pool);
+	if (get_upstream_work_completed(work, val)) {
+		if (total_staged() >= opt_queue)
+			pool_tclear(pool, &pool->lagging);
+		if (pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+
+		applog(LOG_DEBUG, "Generated getwork work");
+		stage_work(work);
+		getwork_fetch_done(pool);
+	} else {
+		applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work", pool->pool_no);
+		getwork_fetch_failed(pool, work);
+	}
+	free(gf);
+}
+
+/* Queues a request for work from pool, whose getworks_inflight the caller has
+ * already accounted for */
+static void queue_getwork_fetch(struct pool *pool, struct work *work)
+{
+	struct getwork_fetch *gf = calloc(sizeof(*gf), 1);
+
+	if (unlikely(!gf))
+		quit(1, "Failed to calloc gf in queue_getwork_fetch");
+	work->pool = pool;
+	gf->work = work;
+	gf->rpc_req = get_upstream_work_req(work);
+	if (unlikely(!gf->rpc_req)) {
+		free(gf);
+		getwork_fetch_failed(pool, work);
+		return;
+	}
+	gf->ce = pop_curl_entry3(pool, 2);
+
+	mutex_lock(&getwork_fetch_lock);
+	gf->next = getwork_fetch_waiting;
+	getwork_fetch_waiting = gf;
+	mutex_unlock(&getwork_fetch_lock);
+	notifier_wake(getwork_fetch_notifier);
+}
+
+static void *getwork_fetch_thread(__maybe_unused void *userdata)
+{
+	long curlm_timeout_ms = -1;
+	struct getwork_fetch *gf, *next;
+	struct timeval timeout, *timeoutp;
+	fd_set rfds, wfds, efds;
+	int maxfd, n;
+	CURLMsg *cm;
+	CURLM *curlm;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("getwork_fetch");
+
+	curlm = curl_multi_init();
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, my_curl_timer_set);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, &curlm_timeout_ms);
+
+	FD_ZERO(&rfds);
+	while (42) {
+		if (FD_ISSET(getwork_fetch_notifier[0], &rfds))
+			notifier_read(getwork_fetch_notifier);
+
+		mutex_lock(&getwork_fetch_lock);
+		gf = getwork_fetch_waiting;
+		getwork_fetch_waiting = NULL;
+		mutex_unlock(&getwork_fetch_lock);
+		for ( ; gf; gf = next) {
+			struct pool *pool = gf->work->pool;
+
+			next = gf->next;
+			json_rpc_call_async(gf->ce->curl, pool->rpc_url, pool->rpc_userpass, gf->rpc_req, false, pool, false, gf);
+			curl_multi_add_handle(curlm, gf->ce->curl);
+		}
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
+		if (curlm_timeout_ms >= 0) {
+			timeout.tv_sec = curlm_timeout_ms / 1000;
+			timeout.tv_usec = (curlm_timeout_ms % 1000) * 1000;
+			timeoutp = &timeout;
+		} else
+			timeoutp = NULL;
+
+		FD_SET(getwork_fetch_notifier[0], &rfds);
+		if (getwork_fetch_notifier[0] > maxfd)
+			maxfd = getwork_fetch_notifier[0];
+
+		if (select(maxfd+1, &rfds, &wfds, &efds, timeoutp) < 0) {
+			FD_ZERO(&rfds);
+			continue;
+		}
+
+		curl_multi_perform(curlm, &n);
+		while ((cm = curl_multi_info_read(curlm, &n))) {
+			int rolltime = 0;
+			json_t *val;
+
+			if (cm->msg != CURLMSG_DONE)
+				continue;
+			val = json_rpc_call_completed(cm->easy_handle, cm->data.result, false, &rolltime, &gf);
+			curl_multi_remove_handle(curlm, cm->easy_handle);
+			if (unlikely(!gf))
+				continue;
+			gf->work->rolltime = rolltime;
+			getwork_fetch_completed(curlm, gf, val);
+		}
+	}
+
+	return NULL;
+}
+
 /* Find the pool that currently has the highest priority */
 static struct pool *priority_pool(int choice)
 {
@@ -4275,6 +4799,48 @@ void switch_pools(struct pool *selected)
 				}
 			}
 			break;
+		/* Fail over to the lowest latency alive pool, by priority on ties */
+		case POOL_LATENCY:
+		{
+			double lowest_lat = lowest_latency(), best = 0;
+			bool found = false;
+
+			for (i = 0; i < total_pools; i++) {
+				double weight;
+
+				pool = priority_pool(i);
+				if (pool->idle || pool->enabled != POOL_ENABLED)
+					continue;
+				weight = latency_weight(pool, lowest_lat);
+				if (!found || weight < best) {
+					best = weight;
+					pool_no = pool->pool_no;
+					found = true;
+				}
+			}
+			break;
+		}
+		/* Fail over to the highest weighted alive pool, by priority on ties */
+		case POOL_ADAPTIVE:
+		{
+			double best = 0;
+			bool found = false;
+
+			for (i = 0; i < total_pools; i++) {
+				double weight;
+
+				pool = priority_pool(i);
+				if (pool->idle || pool->enabled != POOL_ENABLED)
+					continue;
+				weight = adaptive_weight(pool);
+				if (!found || weight > best) {
+					best = weight;
+					pool_no = pool->pool_no;
+					found = true;
+				}
+			}
+			break;
+		}
 		/* Both of these simply increment and cycle */
 		case POOL_ROUNDROBIN:
 		case POOL_ROTATE:
@@ -4311,8 +4877,21 @@ void switch_pools(struct pool *selected)
 
 	if (pool != last_pool)
 	{
+		if (opt_soft_switch && !last_pool->idle && last_pool->enabled == POOL_ENABLED) {
+			struct timeval drained = { .tv_sec = time(NULL) + opt_expiry + 1 };
+
+			last_pool->drain_until = drained.tv_sec - 1;
+			timer_set(&last_pool->drain_timer, &drained);
+			applog(LOG_INFO, "Draining work from pool %d for up to %ds", last_pool->pool_no, opt_expiry);
+		}
+		pool->drain_until = 0;
+		timer_cancel(&pool->drain_timer);
 		pool->block_id = 0;
-		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
+		mutex_lock(&stats_lock);
+		gettimeofday(&pool->tv_failover, NULL);
+		pool->failover_pending = true;
+		mutex_unlock(&stats_lock);
+		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE && pool_strategy != POOL_LATENCY && pool_strategy != POOL_ADAPTIVE) {
 			applog(LOG_WARNING, "Switching to %s", pool->rpc_url);
 		}
 	}
@@ -4320,7 +4899,14 @@ void switch_pools(struct pool *selected)
 	mutex_lock(&lp_lock);
 	pthread_cond_broadcast(&lp_cond);
 	mutex_unlock(&lp_lock);
+	notifier_wake(longpoll_notifier);
 
+	/* Staged work from the old pool may be stale now, and the getwork
+	 * scheduler may be waiting on it */
+	if (pool != last_pool) {
+		sweep_stale_soon();
+		getwork_sched_wake();
+	}
 }
 
 static void discard_work(struct work *work)
@@ -4342,6 +4928,13 @@ static void wake_gws(void)
 	mutex_unlock(stgd_lock);
 }
 
+/* Must be called with stgd_lock held */
+static void unstage_work(struct work *work)
+{
+	HASH_DEL(staged_work, work);
+	timer_cancel_sync(&work->expiry_timer);
+}
+
 static void discard_stale(void)
 {
 	struct work *work, *tmp;
@@ -4350,7 +4943,7 @@ static void discard_stale(void)
 	mutex_lock(stgd_lock);
 	HASH_ITER(hh, staged_work, work, tmp) {
 		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
+			unstage_work(work);
 			discard_work(work);
 			stale++;
 		}
@@ -4362,6 +4955,55 @@ static void discard_stale(void)
 		applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
 }
 
+static void discard_stale_timer(void __maybe_unused *arg)
+{
+	discard_stale();
+}
+
+/* Sweep staged work from the timer thread rather than take stgd_lock here;
+ * requests made before the sweep runs all coalesce into it */
+static void sweep_stale_soon(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	timer_set(&switch_sweep_timer, &now);
+}
+
+/* Must be called with stgd_lock held */
+static void arm_staged_expiry(struct work *work)
+{
+	struct timeval when;
+
+	when.tv_sec = work->tv_staged.tv_sec + stale_work_expiry(work, false) + 1;
+	when.tv_usec = 0;
+	timer_set(&work->expiry_timer, &when);
+}
+
+/* The timer is cancelled synchronously under stgd_lock whenever the work
+ * leaves staged_work, so while we run the work is still staged; only try the
+ * lock, and come back on the next tick if someone is holding it */
+static void staged_expired(void *arg)
+{
+	struct work *work = arg;
+	struct timeval now;
+
+	if (mutex_trylock(stgd_lock)) {
+		gettimeofday(&now, NULL);
+		timer_set(&work->expiry_timer, &now);
+		return;
+	}
+	if (stale_work(work, false)) {
+		HASH_DEL(staged_work, work);
+		discard_work(work);
+		pthread_cond_signal(&gws_cond);
+	} else {
+		/* The pool's getwork delay moved the deadline out */
+		arm_staged_expiry(work);
+	}
+	mutex_unlock(stgd_lock);
+}
+
 void ms_to_abstime(unsigned int mstime, struct timespec *abstime)
 {
 	struct timeval now, then, tdiff;
@@ -4666,7 +5308,7 @@ static int tv_sort(struct work *worka, struct work *workb)
 
 static bool work_rollable(struct work *work)
 {
-	return (!work->clone && work->rolltime);
+	return (!work->clone && (work->rolltime || (work->stratum && opt_ntime_roll)));
 }
 
 static bool hash_push(struct work *work)
@@ -4679,6 +5321,9 @@ static bool hash_push(struct work *work)
 	if (likely(!getq->frozen)) {
 		HASH_ADD_INT(staged_work, id, work);
 		HASH_SORT(staged_work, tv_sort);
+		timer_init(&work->expiry_timer, staged_expired, work);
+		if (!opt_benchmark)
+			arm_staged_expiry(work);
 	} else
 		rc = false;
 	pthread_cond_broadcast(&getq->cond);
@@ -4725,6 +5370,7 @@ static void stage_work(struct work *work)
 {
 	applog(LOG_DEBUG, "Pushing work from pool %d to hash queue", work->pool->pool_no);
 	work->work_restart_id = work->pool->work_restart_id;
+	trace_work(TRACE_STAGE, work);
 	test_work_current(work);
 	hash_push(work);
 }
@@ -4986,6 +5632,7 @@ void write_config(FILE *fcfg)
 
 			if (opt->type & OPT_HASARG &&
 			   ((void *)opt->cb_arg == (void *)set_int_0_to_9999 ||
+			   (void *)opt->cb_arg == (void *)set_int_0_to_65535 ||
 			   (void *)opt->cb_arg == (void *)set_int_1_to_65535 ||
 			   (void *)opt->cb_arg == (void *)set_int_0_to_10 ||
 			   (void *)opt->cb_arg == (void *)set_int_1_to_10) &&
@@ -4999,6 +5646,10 @@ void write_config(FILE *fcfg)
 	fprintf(fcfg, ",\n\"shares\" : \"%d\"", opt_shares);
 	if (pool_strategy == POOL_BALANCE)
 		fputs(",\n\"balance\" : true", fcfg);
+	if (pool_strategy == POOL_LATENCY)
+		fputs(",\n\"latency-balance\" : true", fcfg);
+	if (pool_strategy == POOL_ADAPTIVE)
+		fprintf(fcfg, ",\n\"adaptive-balance\" : true,\n\"adaptive-quota\" : \"%d\"", opt_adaptive_quota);
 	if (pool_strategy == POOL_LOADBALANCE)
 		fputs(",\n\"load-balance\" : true", fcfg);
 	if (pool_strategy == POOL_ROUNDROBIN)
@@ -5129,6 +5780,10 @@ void zero_stats(void)
 		pool->diff_accepted = 0;
 		pool->diff_rejected = 0;
 		pool->diff_stale = 0;
+		pool->hw_errors = 0;
+		pool->adaptive_last_accepted = 0;
+		pool->adaptive_last_submitted = 0;
+		pool->adaptive_last_shares = 0;
 		pool->last_share_diff = 0;
 		pool->cgminer_stats.start_tv = total_tv_start;
 		pool->cgminer_stats.getwork_calls = 0;
@@ -5150,6 +5805,18 @@ void zero_stats(void)
 		pool->cgminer_pool_stats.times_received = 0;
 		pool->cgminer_pool_stats.bytes_received = 0;
 		pool->cgminer_pool_stats.net_bytes_received = 0;
+		pool->cgminer_pool_stats.stratum_rtt_count = 0;
+		pool->cgminer_pool_stats.stratum_rtt = 0;
+		pool->cgminer_pool_stats.stratum_rtt_rolling = 0;
+		pool->cgminer_pool_stats.stratum_rtt_max = 0;
+		pool->cgminer_pool_stats.stratum_rtt_min = 0;
+		pool->cgminer_pool_stats.notify_count = 0;
+		pool->cgminer_pool_stats.notify_interval_rolling = 0;
+		pool->cgminer_pool_stats.notify_interval_max = 0;
+		memset(&pool->cgminer_pool_stats.getwork_hist, 0, sizeof(struct latency_hist));
+		memset(&pool->cgminer_pool_stats.submit_hist, 0, sizeof(struct latency_hist));
+		pool->failovers = 0;
+		pool->failover_time = 0;
 	}
 
 	zero_bestshare();
@@ -5162,6 +5829,7 @@ void zero_stats(void)
 		cgpu->accepted = 0;
 		cgpu->rejected = 0;
 		cgpu->hw_errors = 0;
+		cgpu->dup_nonces = 0;
 		cgpu->utility = 0.0;
 		cgpu->utility_diff1 = 0;
 		cgpu->last_share_pool_time = 0;
@@ -5183,6 +5851,7 @@ void zero_stats(void)
 		cgpu->cgminer_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
 		cgpu->cgminer_stats.getwork_wait_max.tv_sec = 0;
 		cgpu->cgminer_stats.getwork_wait_max.tv_usec = 0;
+		memset(&cgpu->cgminer_stats.getwork_wait_hist, 0, sizeof(struct latency_hist));
 	}
 	mutex_unlock(&hash_lock);
 }
@@ -5675,56 +6344,51 @@ static inline void thread_reportout(struct thr_info *thr)
 	thr->getwork = time(NULL);
 }
 
-static void hashmeter(int thr_id, struct timeval *diff,
-		      uint64_t hashes_done)
+/* Pulls what each mining thread has reported since the last call out of its
+ * hash_slot and folds it into the thread, device and global rates.  Only the
+ * watchdog calls this. */
+static double hashmeter_collect(void)
 {
-	struct timeval temp_tv_end, total_diff;
-	double secs;
-	double local_secs;
-	double utility;
-	static double local_mhashes_done = 0;
-	static double rolling = 0;
-	double local_mhashes = (double)hashes_done / 1000000.0;
-	bool showlog = false;
-	char cHr[h2bs_fmt_size[H2B_NOUNIT]], aHr[h2bs_fmt_size[H2B_NOUNIT]], uHr[h2bs_fmt_size[H2B_SPACED]];
-
-	/* Update the last time this thread reported in */
-	if (thr_id >= 0) {
-		gettimeofday(&thr_info[thr_id].last, NULL);
-		thr_info[thr_id].cgpu->device_last_well = time(NULL);
-	}
-
-	secs = (double)diff->tv_sec + ((double)diff->tv_usec / 1000000.0);
-
-	/* So we can call hashmeter from a non worker thread */
-	if (thr_id >= 0) {
-		struct thr_info *thr = &thr_info[thr_id];
-		struct cgpu_info *cgpu = thr_info[thr_id].cgpu;
-		double thread_rolling = 0.0;
-		int i;
+	double local_mhashes = 0;
+	int i, j;
 
-        applog(LOG_DEBUG, "[thread %d: %llu hashes, %.2f KH/s]",
-          thr_id, (ullong)hashes_done, hashes_done / 1000 / secs);
+	for (i = 0; i < total_devices; ++i) {
+		struct cgpu_info *cgpu = devices[i];
+		double thread_rolling = 0, dev_mhashes = 0;
+		bool reported = false;
 
-		/* Rolling average for each thread and each device */
-		decay_time(&thr->rolling, local_mhashes / secs);
-		for (i = 0; i < cgpu->threads; i++)
-			thread_rolling += cgpu->thr[i]->rolling;
+		for (j = 0; j < cgpu->threads; ++j) {
+			struct thr_info *thr = cgpu->thr[j];
+			uint64_t hashes = __atomic_load_n(&thr->hash_slot.hashes, __ATOMIC_RELAXED);
+			uint64_t us = __atomic_load_n(&thr->hash_slot.hashing_us, __ATOMIC_RELAXED);
+			uint64_t dhashes = hashes - thr->hashes_seen;
+			uint64_t dus = us - thr->hashing_us_seen;
+
+			thr->hashes_seen = hashes;
+			thr->hashing_us_seen = us;
+			if (dus) {
+				/* Rolling average for each thread */
+				decay_time(&thr->rolling, (double)dhashes / dus);
+				reported = true;
+			}
+			thread_rolling += thr->rolling;
+			dev_mhashes += (double)dhashes / 1000000.0;
+		}
 
-		mutex_lock(&hash_lock);
-		decay_time(&cgpu->rolling, thread_rolling);
-		cgpu->total_mhashes += local_mhashes;
-		mutex_unlock(&hash_lock);
+		/* and each device */
+		if (reported)
+			decay_time(&cgpu->rolling, thread_rolling);
+		cgpu->total_mhashes += dev_mhashes;
+		local_mhashes += dev_mhashes;
 
 		// If needed, output detailed, per-device stats
-		if (want_per_device_stats) {
+		if (want_per_device_stats && reported) {
 			struct timeval now;
 			struct timeval elapsed;
 
 			gettimeofday(&now, NULL);
-			timersub(&now, &thr->cgpu->last_message_tv, &elapsed);
+			timersub(&now, &cgpu->last_message_tv, &elapsed);
 			if (opt_log_interval <= elapsed.tv_sec) {
-				struct cgpu_info *cgpu = thr->cgpu;
 				char logline[255];
 
 				cgpu->last_message_tv = now;
@@ -5739,8 +6403,49 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		}
 	}
 
-	/* Totals are updated by all threads so can race without locking */
+	return local_mhashes;
+}
+
+/* Called by a mining thread after every scan so the watchdog and the
+ * history sampler see its progress as it happens */
+static void hash_slot_add(struct thr_info *thr, uint64_t hashes, struct timeval *diff)
+{
+	uint64_t us = (uint64_t)diff->tv_sec * 1000000 + diff->tv_usec;
+
+	/* Nobody else writes the slot, so no read-modify-write needed */
+	__atomic_store_n(&thr->hash_slot.hashes, thr->hash_slot.hashes + hashes, __ATOMIC_RELAXED);
+	__atomic_store_n(&thr->hash_slot.hashing_us, thr->hash_slot.hashing_us + us, __ATOMIC_RELAXED);
+}
+
+static void hashmeter(int thr_id, struct timeval *diff,
+		      uint64_t hashes_done)
+{
+	struct timeval temp_tv_end, total_diff;
+	double local_secs;
+	double utility;
+	static double local_mhashes_done = 0;
+	static double rolling = 0;
+	double local_mhashes;
+	bool showlog = false;
+	char cHr[h2bs_fmt_size[H2B_NOUNIT]], aHr[h2bs_fmt_size[H2B_NOUNIT]], uHr[h2bs_fmt_size[H2B_SPACED]];
+
+	/* Mining threads publish their progress through hash_slot_add; the
+	 * watchdog calls us with a negative thr_id to do the sums */
+	if (thr_id >= 0) {
+		struct thr_info *thr = &thr_info[thr_id];
+		uint64_t us = (uint64_t)diff->tv_sec * 1000000 + diff->tv_usec;
+
+		/* Update the last time this thread reported in */
+		gettimeofday(&thr->last, NULL);
+		thr->cgpu->device_last_well = time(NULL);
+
+		applog(LOG_DEBUG, "[thread %d: %llu hashes, %.2f KH/s]",
+		       thr_id, (ullong)hashes_done, us ? (double)hashes_done * 1000 / us : 0);
+		return;
+	}
+
 	mutex_lock(&hash_lock);
+	local_mhashes = hashmeter_collect();
 	gettimeofday(&temp_tv_end, NULL);
 	timersub(&temp_tv_end, &total_tv_end, &total_diff);
 
@@ -5790,6 +6495,8 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
     char hashshow[100], outhash[20];
     ullong hashdata = le64toh(((ullong *) work->hash)[3]);
 
+    trace_work(TRACE_RESULT, work);
+
     _bin2hex((char *) &outhash[0], (uchar *) &hashdata, 8);
 
     sprintf(hashshow, "%sx0 Diff %.3f/%.3f%s", outhash, share_diff(work),
@@ -5798,6 +6505,35 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
     share_result(val, res_val, err_val, work, hashshow, false, "");
 }
 
+/* Accounts the submit to ack round trip of a stratum share */
+static void stratum_rtt_update(struct pool *pool, struct timeval *tv_submit)
+{
+	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
+	struct timeval now;
+	double rtt;
+
+	gettimeofday(&now, NULL);
+	rtt = tdiff(&now, tv_submit);
+	if (rtt < 0)
+		return;
+
+	mutex_lock(&stats_lock);
+	latency_hist_add(&pool_stats->submit_hist, rtt);
+	pool_stats->stratum_rtt = rtt;
+	if (!pool_stats->stratum_rtt_count++) {
+		pool_stats->stratum_rtt_rolling = rtt;
+		pool_stats->stratum_rtt_min = rtt;
+	} else {
+		pool_stats->stratum_rtt_rolling += rtt * 0.63;
+		pool_stats->stratum_rtt_rolling /= 1.63;
+		if (rtt < pool_stats->stratum_rtt_min)
+			pool_stats->stratum_rtt_min = rtt;
+	}
+	if (rtt > pool_stats->stratum_rtt_max)
+		pool_stats->stratum_rtt_max = rtt;
+	mutex_unlock(&stats_lock);
+}
+
 /* Parses stratum json responses and tries to find the id that the request
  * matched to and treat it accordingly. */
 bool parse_stratum_response(struct pool *pool, char *s)
@@ -5834,6 +6570,15 @@ bool parse_stratum_response(struct pool *pool, char *s)
 	}
 
 	if (!json_is_integer(id_val)) {
+		if (json_is_string(id_val) && !strcmp(json_string_value(id_val), "xnsub")) {
+			if (json_is_true(res_val))
+				applog(LOG_INFO, "Pool %d accepted extranonce subscription", pool->pool_no);
+			else
+				applog(LOG_INFO, "Pool %d does not support extranonce subscription", pool->pool_no);
+			ret = true;
+			goto out;
+		}
+
 		if (json_is_string(id_val)
 		 && !strncmp(json_string_value(id_val), "txlist", 6)
 		 && !strcmp(json_string_value(id_val) + 6, pool->swork.job_id)
@@ -5867,6 +6612,11 @@ fishy:
 	}
 
 	id = json_integer_value(id_val);
+	if (stratum_proxy_result(pool, id, res_val, err_val)) {
+		ret = true;
+		goto out;
+	}
+
 	mutex_lock(&sshare_lock);
 	HASH_FIND_INT(stratum_shares, &id, sshare);
 	if (sshare)
@@ -5884,6 +6634,7 @@ fishy:
 		--total_submitting;
 		mutex_unlock(&submitting_lock);
 	}
+	stratum_rtt_update(pool, &sshare->tv_submit);
 	stratum_share_result(val, res_val, err_val, sshare);
 	free_work(sshare->work);
 	free(sshare);
@@ -5947,6 +6698,38 @@ static void clear_stratum_shares(struct pool *pool)
 	}
 }
 
+/* Shares sent on a connection that dropped may never have reached the pool.
+ * Once the session is resumed, send the ones the pool never answered again
+ * under their original ids so their results still get accounted. Shares still
+ * queued in the submit thread go out on the new connection by themselves. */
+static void resubmit_stratum_shares(struct pool *pool)
+{
+	struct stratum_share *sshare, *tmpshare;
+	char **resubmit = NULL;
+	int count = 0, i;
+
+	mutex_lock(&sshare_lock);
+	HASH_ITER(hh, stratum_shares, sshare, tmpshare) {
+		if (sshare->work->pool != pool || sshare->queued)
+			continue;
+		resubmit = realloc(resubmit, sizeof(char *) * (count + 1));
+		if (unlikely(!resubmit))
+			quit(1, "Failed to realloc resubmit in resubmit_stratum_shares");
+		resubmit[count++] = stratum_submit_str(sshare->work, sshare->id);
+		gettimeofday(&sshare->tv_submit, NULL);
+	}
+	mutex_unlock(&sshare_lock);
+
+	for (i = 0; i < count; i++) {
+		stratum_send(pool, resubmit[i], strlen(resubmit[i]));
+		free(resubmit[i]);
+	}
+	free(resubmit);
+
+	if (count)
+		applog(LOG_INFO, "Resubmitted %d shares to pool %d after resuming session", count, pool->pool_no);
+}
+
 static void clear_pool_work(struct pool *pool)
 {
 	struct work *work, *tmp;
@@ -5955,7 +6738,7 @@ static void clear_pool_work(struct pool *pool)
 	mutex_lock(stgd_lock);
 	HASH_ITER(hh, staged_work, work, tmp) {
 		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
+			unstage_work(work);
 			free_work(work);
 			cleared++;
 		}
@@ -5963,6 +6746,32 @@ static void clear_pool_work(struct pool *pool)
 	mutex_unlock(stgd_lock);
 }
 
+/* With --standby-pools, the first N enabled stratum backup pools by priority
+ * are kept hot so switch_pools can hand out their cached job immediately */
+bool pool_standby(struct pool *pool)
+{
+	struct pool *cp, *bp;
+	int i, standby = 0;
+
+	if (!opt_standby_pools || !pool->has_stratum || pool->enabled != POOL_ENABLED)
+		return false;
+
+	cp = current_pool();
+	if (pool == cp)
+		return false;
+
+	for (i = 0; i < total_pools && standby < opt_standby_pools; i++) {
+		bp = priority_pool(i);
+		if (bp == cp || !bp->has_stratum || bp->enabled != POOL_ENABLED)
+			continue;
+		if (bp == pool)
+			return true;
+		standby++;
+	}
+
+	return false;
+}
+
 /* We only need to maintain a secondary pool connection when we need the
  * capacity to get work from the backup pools while still on the primary */
 static bool cnx_needed(struct pool *pool)
@@ -5972,6 +6781,10 @@ static bool cnx_needed(struct pool *pool)
 	/* Balance strategies need all pools online */
 	if (pool_strategy == POOL_BALANCE)
 		return true;
+	if (pool_strategy == POOL_LATENCY)
+		return true;
+	if (pool_strategy == POOL_ADAPTIVE)
+		return true;
 	if (pool_strategy == POOL_LOADBALANCE)
 		return true;
 
@@ -5979,6 +6792,14 @@ static bool cnx_needed(struct pool *pool)
 	if (pool->has_stratum && pool->idle)
 		return true;
 
+	/* Hot standby pools stay subscribed with their latest job cached */
+	if (pool_standby(pool))
+		return true;
+
+	/* Pools being drained still need a channel for their shares */
+	if (pool_draining(pool))
+		return true;
+
 	/* Getwork pools without opt_fail_only need backup pools up to be able
 	 * to leak shares */
 	cp = current_pool();
@@ -6009,6 +6830,11 @@ static void stratum_resumed(struct pool *pool)
 	}
 }
 
+/* Reconnect delays in ms, doubling per attempt with jitter */
+#define STRATUM_BACKOFF_MIN 250
+#define STRATUM_BACKOFF_MAX 30000
+#define STRATUM_FAST_RETRIES 4
+
 /* One stratum thread per pool that has stratum waits on the socket checking
  * for new messages and for the integrity of the socket connection. We reset
  * the connection based on the integrity of the receive side only as the send
@@ -6046,11 +6872,13 @@ static void *stratum_thread(void *userdata)
 
 			wait_lpcurrent(pool);
 			if (!initiate_stratum(pool) || !auth_stratum(pool)) {
+				unsigned int attempt = 0;
+
 				pool_died(pool);
 				while (!initiate_stratum(pool) || !auth_stratum(pool)) {
 					if (pool->removed)
 						goto out;
-					sleep(30);
+					nmsleep(backoff_ms(&attempt, STRATUM_BACKOFF_MIN, STRATUM_BACKOFF_MAX));
 				}
 			}
 		}
@@ -6068,6 +6896,8 @@ static void *stratum_thread(void *userdata)
 		else
 			s = recv_line(pool);
 		if (!s) {
+			bool notify, initiated, tried;
+
 			if (!pool->has_stratum)
 				break;
 
@@ -6075,11 +6905,32 @@ static void *stratum_thread(void *userdata)
 			pool->getfail_occasions++;
 			total_go++;
 
-			// Make any pending work/shares stale
 			mutex_lock(&pool->stratum_lock);
+			notify = pool->stratum_notify;
 			pool->stratum_active = pool->stratum_notify = false;
 			pool->sock = INVSOCK;
 			mutex_unlock(&pool->stratum_lock);
+
+			/* If the pool resumes our session with the same
+			 * extranonce, the current job and any staged work
+			 * stay valid, so keep mining them while we try.
+			 * Without a session id to offer there is no point
+			 * waiting for the connect before dropping the work */
+			tried = pool->sessionid != NULL;
+			initiated = tried && initiate_stratum(pool);
+			if (initiated && pool->session_resumed) {
+				if (auth_stratum(pool)) {
+					applog(LOG_NOTICE, "Stratum session to pool %d resumed", pool->pool_no);
+					if (notify)
+						pool->stratum_notify = true;
+					resubmit_stratum_shares(pool);
+					continue;
+				}
+				suspend_stratum(pool);
+				initiated = false;
+			}
+
+			// Make any pending work/shares stale
 			pool->submit_old = false;
 			++pool->work_restart_id;
 
@@ -6091,8 +6942,33 @@ static void *stratum_thread(void *userdata)
 			if (pool == current_pool())
 				restart_threads();
 
-			if (initiate_stratum(pool) && auth_stratum(pool))
-				continue;
+			/* The pool gave us a new session instead */
+			if (initiated) {
+				if (auth_stratum(pool))
+					continue;
+				suspend_stratum(pool);
+			}
+
+			/* Retry a few times quickly before treating the pool as
+			 * dead, to ride out brief network hiccups.  The first
+			 * try goes straight away unless one was just made. */
+			{
+				unsigned int attempt = 0;
+				bool reconnected = false;
+
+				while (!reconnected && attempt < STRATUM_FAST_RETRIES) {
+					if (tried)
+						nmsleep(backoff_ms(&attempt, STRATUM_BACKOFF_MIN, STRATUM_BACKOFF_MAX));
+					tried = true;
+					reconnected = initiate_stratum(pool);
+					if (reconnected && !auth_stratum(pool)) {
+						suspend_stratum(pool);
+						reconnected = false;
+					}
+				}
+				if (reconnected)
+					continue;
+			}
 
 			shutdown_stratum(pool);
 			pool_died(pool);
@@ -6132,6 +7008,9 @@ static void *stratum_thread(void *userdata)
 				have_block_height(block_id, height);
 			}
 
+			if (pool == current_pool())
+				stratum_proxy_notify(pool);
+
 			++pool->work_restart_id;
 			if (test_work_current(work)) {
 				/* Only accept a work restart if this stratum
@@ -6139,9 +7018,13 @@ static void *stratum_thread(void *userdata)
 				if (pool == current_pool()) {
 					restart_threads();
 					applog(LOG_NOTICE, "Stratum from pool %d requested work restart", pool->pool_no);
-				}
-			} else
+				} else
+					sweep_stale_soon();
+			} else {
+				/* test_work_current has restarted work for the new block */
+				mock_stratum_restarted();
 				applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
+			}
 			free_work(work);
 		}
 
@@ -6164,7 +7047,7 @@ static void init_stratum_thread(struct pool *pool)
 		quit(1, "Failed to create stratum thread");
 }
 
-static void *longpoll_thread(void *userdata);
+static void longpoll_start_pool(struct pool *pool);
 
 static bool stratum_works(struct pool *pool)
 {
@@ -6356,11 +7239,8 @@ badwork:
 		} else
 			pool->lp_url = NULL;
 
-		if (want_longpoll && !pool->lp_started) {
-			pool->lp_started = true;
-			if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
-				quit(1, "Failed to create pool longpoll thread");
-		}
+		if (want_longpoll && !pool->lp_started)
+			longpoll_start_pool(pool);
 	} else if (PLP_NONE != (proto = pool_protocol_fallback(proto))) {
 		pool->proto = proto;
 		goto tryagain;
@@ -6402,6 +7282,28 @@ static void pool_resus(struct pool *pool)
 		applog(LOG_INFO, "Pool %d %s resumed returning work", pool->pool_no, pool->rpc_url);
 }
 
+/* With --soft-switch, work from a pool being drained is handed out ahead of
+ * any other so devices finish it before it expires, clones first like
+ * hash_pop.  Must be called with stgd_lock held */
+static struct work *__draining_work(void)
+{
+	struct work *work, *tmp, *master = NULL;
+
+	if (!opt_soft_switch)
+		return NULL;
+
+	HASH_ITER(hh, staged_work, work, tmp) {
+		if (!pool_draining(work->pool))
+			continue;
+		if (!work_rollable(work))
+			return work;
+		if (!master)
+			master = work;
+	}
+
+	return master;
+}
+
 static struct work *hash_pop(void)
 {
 	struct work *work = NULL, *tmp;
@@ -6413,24 +7315,27 @@ retry:
 		pthread_cond_wait(&getq->cond, stgd_lock);
 
 	hc = HASH_COUNT(staged_work);
+	work = __draining_work();
 	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
+	if (!work && hc > staged_rollable) {
 		HASH_ITER(hh, staged_work, work, tmp) {
 			if (!work_rollable(work))
 				break;
 		}
-	} else
+	} else if (!work)
 		work = staged_work;
 	
 	if (can_roll(work) && should_roll(work))
 	{
+		struct pool *pool = work->pool;
+
 		// Instead of consuming it, force it to be cloned and grab the clone
 		mutex_unlock(stgd_lock);
-		clone_available();
+		clone_available(pool);
 		goto retry;
 	}
 	
-	HASH_DEL(staged_work, work);
+	unstage_work(work);
 	if (work_rollable(work))
 		staged_rollable--;
 
@@ -6441,6 +7346,8 @@ retry:
 	pthread_cond_signal(&getq->cond);
 	mutex_unlock(stgd_lock);
 
+	trace_work(TRACE_HASH_POP, work);
+
 	return work;
 }
 
@@ -6515,31 +7422,23 @@ static void set_work_target(struct work *work, double diff) {
 
 }
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work) {
-    uchar merkle_root[64], temp_bin[32];
-    uint *data = (uint *) work->data;
+/* Assembles the block header for the pool's current job with the given
+ * extranonce2 and ntime.  Must be called with pool_lock held */
+static void __gen_stratum_header(struct pool *pool, uint *data, uchar *merkle_root,
+                                 const char *nonce2, const char *ntime) {
+    uchar temp_bin[32];
     uchar *coinbase;
     size_t alloc_len;
     uint i, t;
 
-	clean_work(work);
-
-	mutex_lock(&pool->pool_lock);
-
-	/* Generate coinbase */
-	work->nonce2 = bin2hex((const unsigned char *)&pool->nonce2, pool->n2size);
-	pool->nonce2++;
 	alloc_len = pool->swork.cb_len;
 	align_len(&alloc_len);
 	coinbase = calloc(alloc_len, 1);
 	if (unlikely(!coinbase))
-		quit(1, "Failed to calloc coinbase in gen_stratum_work");
+		quit(1, "Failed to calloc coinbase in __gen_stratum_header");
 	hex2bin(coinbase, pool->swork.coinbase1, pool->swork.cb1_len);
 	hex2bin(coinbase + pool->swork.cb1_len, pool->nonce1, pool->n1_len);
-	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len, work->nonce2, pool->n2size);
+	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len, nonce2, pool->n2size);
 	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len + pool->n2size, pool->swork.coinbase2, pool->swork.cb2_len);
 
     /* Generate merkle root */
@@ -6564,7 +7463,7 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
         for(i = 0; i < 8; i++)
           data[i + 9] = le32toh(((uint *) merkle_root)[i]);
         /* Time */
-        hex2bin((uchar *) &t, (char *) pool->swork.ntime, 4);
+        hex2bin((uchar *) &t, (char *) ntime, 4);
         data[17] = be32toh(t);
         /* Difficulty */
         hex2bin((uchar *) &t, (char *) pool->swork.nbit, 4);
@@ -6583,7 +7482,7 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
         for(i = 0; i < 8; i++)
           data[i + 9] = be32toh(((uint *) merkle_root)[i]);
         /* Time */
-        hex2bin((uchar *) &t, (char *) pool->swork.ntime, 4);
+        hex2bin((uchar *) &t, (char *) ntime, 4);
         data[17] = le32toh(t);
         /* Difficulty */
         hex2bin((uchar *) &t, (char *) pool->swork.nbit, 4);
@@ -6594,6 +7493,39 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
         data[20] = 0x80000000;
         data[31] = 0x00000280;
     }
+}
+
+/* Generates stratum based work based on the most recent notify information
+ * from the pool. This will keep generating work while a pool is down so we use
+ * other means to detect when the pool has died in stratum_thread */
+static void gen_stratum_work(struct pool *pool, struct work *work) {
+    uchar merkle_root[64];
+    uint *data = (uint *) work->data;
+    uchar *nonce2;
+    size_t n2off = 0, n2len;
+    bool proxying = stratum_proxy_clients();
+
+	clean_work(work);
+
+	mutex_lock(&pool->pool_lock);
+
+	/* Generate coinbase. While stratum proxy clients are connected, the
+	 * leading extranonce2 bytes are the client prefix and ours is all
+	 * zeroes; otherwise we keep the whole extranonce2 */
+	nonce2 = calloc(pool->n2size + sizeof(pool->nonce2), 1);
+	if (unlikely(!nonce2))
+		quit(1, "Failed to calloc nonce2 in gen_stratum_work");
+	if (proxying && pool->n2size > STRATUM_PROXY_N1_BYTES)
+		n2off = STRATUM_PROXY_N1_BYTES;
+	n2len = pool->n2size - n2off;
+	if (n2len > sizeof(pool->nonce2))
+		n2len = sizeof(pool->nonce2);
+	memcpy(nonce2 + n2off, &pool->nonce2, n2len);
+	work->nonce2 = bin2hex(nonce2, pool->n2size);
+	free(nonce2);
+	pool->nonce2++;
+	pool->cgminer_pool_stats.stratum_works++;
+	__gen_stratum_header(pool, data, merkle_root, work->nonce2, pool->swork.ntime);
 
 	/* Store the stratum work diff to check it still matches the pool's
 	 * stratum diff when submitting shares */
@@ -6635,6 +7567,37 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
 	gettimeofday(&work->tv_staged, NULL);
 }
 
+/* Checks a share from a stratum proxy client against the pool's current job
+ * and difficulty.  Only the current job is known, so shares for any other are
+ * reported stale.  nonce2 is the full upstream extranonce2 and all arguments
+ * must already be validated hex of the right length */
+bool stratum_proxy_test(struct pool *pool, const char *job_id, const char *nonce2,
+			const char *ntime, const char *nonce, bool *stale)
+{
+	struct work work;
+	uchar merkle_root[64];
+	uint32_t t, *work_nonce = (uint32_t *)(work.data + 76);
+
+	memset(&work, 0, sizeof(work));
+	mutex_lock(&pool->pool_lock);
+	*stale = !pool->swork.job_id || strcmp(job_id, pool->swork.job_id);
+	if (!*stale) {
+		__gen_stratum_header(pool, (uint *)work.data, merkle_root, nonce2, ntime);
+		set_work_target(&work, pool->swork.diff);
+	}
+	mutex_unlock(&pool->pool_lock);
+	if (*stale)
+		return false;
+
+	/* Undo the byte order stratum_submit_str puts the nonce in */
+	hex2bin((uchar *)&t, nonce, 4);
+	*work_nonce = opt_neoscrypt ? be32toh(t) : t;
+
+	/* Only used for the hash; its quick checks assume diff 1 or more */
+	_test_nonce2(&work, le32toh(*work_nonce), false);
+	return fulltest_le((uint *)work.hash, (uint *)work.target);
+}
+
 static struct work *get_work(struct thr_info *thr, const int thr_id)
 {
 	struct work *work = NULL;
@@ -6654,6 +7617,22 @@ static struct work *get_work(struct thr_info *thr, const int thr_id)
 	}
 	applog(LOG_DEBUG, "Got work from get queue to get work for thread %d", thr_id);
 
+	if (unlikely(work->pool->failover_pending)) {
+		struct pool *pool = work->pool;
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		mutex_lock(&stats_lock);
+		if (pool->failover_pending) {
+			pool->failover_pending = false;
+			pool->failover_time = tdiff(&now, &pool->tv_failover);
+			pool->failovers++;
+			applog(LOG_INFO, "Pool %d first work handed out %.3fs after switching to it",
+			       pool->pool_no, pool->failover_time);
+		}
+		mutex_unlock(&stats_lock);
+	}
+
 	work->thr_id = thr_id;
 	thread_reportin(thr);
 	work->mined = true;
@@ -6664,6 +7643,7 @@ void submit_work_async(struct work *work_in, struct timeval *tv_work_found)
 {
 	struct work *work = copy_work(work_in);
 
+	trace_work(TRACE_SHARE, work);
 	if (tv_work_found)
 		memcpy(&(work->tv_work_found), tv_work_found, sizeof(struct timeval));
 	applog(LOG_DEBUG, "Pushing submit work to work thread");
@@ -6749,6 +7729,53 @@ enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce,
     return(TNR_BAD);
 }
 
+/* Recently found nonces, keyed on a hash of the whole block header with the
+ * nonce in place.  The header already covers the job, nonce2 and ntime, so
+ * entries from older jobs can never match and are simply overwritten.  Slots
+ * are claimed with compare-and-swap so result threads never take a lock. */
+#define DUP_NONCE_BITS  12
+#define DUP_NONCE_PROBE  4
+static uint64_t dup_nonces[1 << DUP_NONCE_BITS];
+
+static uint64_t dup_nonce_key(const unsigned char *data)
+{
+	uint64_t key = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < 80; i++) {
+		key ^= data[i];
+		key *= 0x100000001b3ULL;
+	}
+	return key ? key : 1;
+}
+
+/* Returns true if this header has been seen before, recording it otherwise */
+static bool dup_nonce_seen(const unsigned char *data)
+{
+	const uint64_t key = dup_nonce_key(data);
+	const unsigned int mask = (1 << DUP_NONCE_BITS) - 1;
+	unsigned int i, slot;
+	uint64_t old;
+
+	for (i = 0; i < DUP_NONCE_PROBE; i++) {
+		slot = (key + i) & mask;
+		old = dup_nonces[slot];
+		if (old == key)
+			return true;
+		if (!old) {
+			old = __sync_val_compare_and_swap(&dup_nonces[slot], 0, key);
+			if (!old)
+				return false;
+			if (old == key)
+				return true;
+		}
+	}
+
+	/* All probed slots hold other nonces; evict the first */
+	dup_nonces[key & mask] = key;
+	return false;
+}
+
 void submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 {
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
@@ -6756,6 +7783,7 @@ void submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 
 	gettimeofday(&tv_work_found, NULL);
 	*work_nonce = htole32(nonce);
+	trace_work(TRACE_NONCE, work);
 
 	/* Do one last check before attempting to submit the work */
 	/* Side effect: sets work->data for us */
@@ -6768,6 +7796,7 @@ void submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 			mutex_lock(&stats_lock);
 			++hw_errors;
 			++thr->cgpu->hw_errors;
+			++work->pool->hw_errors;
 			mutex_unlock(&stats_lock);
 
 			if (thr->cgpu->api->hw_error)
@@ -6781,6 +7810,19 @@ void submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 			share_diff(work);
             break;
         case(TNR_GOOD):
+            /* Drivers can report the same result twice; drop the repeat
+             * rather than earn a certain reject. Only verified nonces are
+             * recorded, so a bad nonce can never mask a good one */
+            if (dup_nonce_seen(work->data)) {
+                struct cgpu_info *cgpu = thr->cgpu;
+
+                applog(LOG_DEBUG, "%s %u: duplicate nonce %08x discarded",
+                       cgpu->api->name, cgpu->device_id, nonce);
+                mutex_lock(&stats_lock);
+                ++cgpu->dup_nonces;
+                mutex_unlock(&stats_lock);
+                break;
+            }
             /* Submit work verified */
             submit_work_async(work, &tv_work_found);
             break;
@@ -6825,7 +7867,7 @@ void *miner_thread(void *userdata)
 
 	/* Try to cycle approximately 5 times before each log update */
 	const long cycle = opt_log_interval / 5 ? : 1;
-	struct timeval tv_start, tv_end, tv_workstart, tv_lastupdate;
+	struct timeval tv_start, tv_end, tv_workstart, tv_lastupdate, tv_lastslot;
 	struct timeval diff, sdiff, wdiff = {0, 0};
 	uint32_t max_nonce = api->can_limit_work ? api->can_limit_work(mythr) : 0xffffffff;
 	int64_t hashes_done = 0;
@@ -6853,6 +7895,7 @@ void *miner_thread(void *userdata)
 
 	sdiff.tv_sec = sdiff.tv_usec = 0;
 	gettimeofday(&tv_lastupdate, NULL);
+	tv_lastslot = tv_lastupdate;
 	cgpu->cgminer_stats.start_tv = tv_lastupdate;
 
 	while (1) {
@@ -6886,6 +7929,7 @@ void *miner_thread(void *userdata)
 				dev_stats->getwork_wait_min.tv_usec = getwork_start.tv_usec;
 			}
 			dev_stats->getwork_calls++;
+			latency_hist_add(&dev_stats->getwork_wait_hist, (double)getwork_start.tv_sec + ((double)getwork_start.tv_usec / 1000000));
 
 			pool_stats = &(work->pool->cgminer_stats);
 
@@ -6905,7 +7949,9 @@ void *miner_thread(void *userdata)
 			gettimeofday(&(work->tv_work_start), NULL);
 
 			thread_reportin(mythr);
+			trace_work(TRACE_SCAN_BEGIN, work);
 			hashes = api->scanhash(mythr, work, work->blk.nonce + max_nonce);
+			trace_work(TRACE_SCAN_END, work);
 			thread_reportin(mythr);
 
 			gettimeofday(&getwork_start, NULL);
@@ -6945,6 +7991,10 @@ void *miner_thread(void *userdata)
 
 			timersub(&tv_end, &tv_workstart, &wdiff);
 
+			timersub(&tv_end, &tv_lastslot, &diff);
+			hash_slot_add(mythr, hashes, &diff);
+			tv_lastslot = tv_end;
+
 			if (unlikely((long)sdiff.tv_sec < cycle)) {
 				int mult;
 
@@ -7080,15 +8130,23 @@ static struct pool *select_longpoll_pool(struct pool *cp)
 	return NULL;
 }
 
-/* This will make the longpoll thread wait till it's the current pool, or it
+/* Longpoll is only issued for a pool once it is the current pool, or it has
+ * been flagged as rejecting. switch_pools wakes the longpoll loop so it can
+ * re-check this. */
+static bool longpoll_current(struct pool *pool)
+{
+	if (cnx_needed(pool))
+		return true;
+
+	return (pool == current_pool() || pool_strategy == POOL_LOADBALANCE || pool_strategy == POOL_BALANCE || pool_strategy == POOL_LATENCY || pool_strategy == POOL_ADAPTIVE);
+}
+
+/* This will make the stratum thread wait till it's the current pool, or it
  * has been flagged as rejecting, before attempting to open any connections.
  */
 static void wait_lpcurrent(struct pool *pool)
 {
-	if (cnx_needed(pool))
-		return;
-
-	while (pool != current_pool() && pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
+	while (!longpoll_current(pool)) {
 		mutex_lock(&lp_lock);
 		pthread_cond_wait(&lp_cond, &lp_lock);
 		mutex_unlock(&lp_lock);
@@ -7102,128 +8160,344 @@ static curl_socket_t save_curl_socket(void *vpool, __maybe_unused curlsocktype p
 	return sock;
 }
 
-static void *longpoll_thread(void *userdata)
-{
-	struct pool *cp = (struct pool *)userdata;
-	/* This *pool is the source of the actual longpoll, not the pool we've
-	 * tied it to */
-	struct pool *pool = NULL;
-	struct timeval start, reply, end;
-	CURL *curl = NULL;
-	int failures = 0;
-	char *lp_url;
+/* Longpolls for all pools are driven from a single curl_multi loop in
+ * longpoll_thread. Each pool with longpoll started has a longpoll_ent, which
+ * either has a request in flight or a time before which it is not retried.
+ * The loop only does the I/O; replies are handed to longpoll_reply_thread,
+ * which converts them to work and restarts the mining threads, so a slow
+ * restart never holds up the other pools' longpolls. */
+struct longpoll_ent {
+	/* The pool the longpoll is tied to */
+	struct pool *cp;
+	/* The source of the actual longpoll, NULL until one is selected */
+	struct pool *pool;
+	CURL *curl;
+	struct work *work;
+	char *lpreq;
+	bool active;
+	bool announced;
+	bool warned;
+	bool done;
+	int failures;
+	struct timeval tv_start;
+	struct timeval tv_next;
+	struct longpoll_ent *next;
+};
+
+/* A longpoll reply on its way from the loop to longpoll_reply_thread */
+struct longpoll_reply {
+	struct pool *pool;
+	struct work *work;
+	json_t *val;
 	int rolltime;
+	struct timeval tv_start;
+	struct timeval tv_reply;
+};
 
-	RenameThread("longpoll");
+static pthread_t longpoll_thr, longpoll_reply_thr;
+static bool longpoll_thr_started;
+static struct thread_q *longpoll_replyq;
 
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return NULL;
+static void *longpoll_thread(void *userdata);
+static void *longpoll_reply_thread(void *userdata);
+
+static void longpoll_start_pool(struct pool *pool)
+{
+	pool->lp_started = true;
+
+	mutex_lock(&lp_lock);
+	if (!longpoll_thr_started) {
+		longpoll_replyq = tq_new();
+		if (unlikely(!longpoll_replyq))
+			quit(1, "Failed to tq_new longpoll_replyq");
+		if (unlikely(pthread_create(&longpoll_reply_thr, NULL, longpoll_reply_thread, NULL)))
+			quit(1, "Failed to create longpoll reply thread");
+		if (unlikely(pthread_create(&longpoll_thr, NULL, longpoll_thread, NULL)))
+			quit(1, "Failed to create longpoll thread");
+		longpoll_thr_started = true;
 	}
+	mutex_unlock(&lp_lock);
+
+	notifier_wake(longpoll_notifier);
+}
+
+static void longpoll_ent_retry(struct longpoll_ent *lp, struct timeval *now, int secs)
+{
+	lp->tv_next.tv_sec = now->tv_sec + secs;
+	lp->tv_next.tv_usec = now->tv_usec;
+}
+
+/* Select the pool to poll for this entry, issuing a request when it is due */
+static void longpoll_ent_poll(CURLM *curlm, struct longpoll_ent *lp, struct timeval *now)
+{
+	struct pool *cp = lp->cp, *pool;
 
-retry_pool:
-	pool = select_longpoll_pool(cp);
-	if (!pool) {
-		applog(LOG_WARNING, "No suitable long-poll found for %s", cp->rpc_url);
-		while (!pool) {
-			sleep(60);
-			pool = select_longpoll_pool(cp);
+	if (lp->done || lp->active || timercmp(now, &lp->tv_next, <))
+		return;
+
+	if (!lp->pool) {
+		pool = select_longpoll_pool(cp);
+		if (!pool) {
+			if (!lp->warned)
+				applog(LOG_WARNING, "No suitable long-poll found for %s", cp->rpc_url);
+			lp->warned = true;
+			longpoll_ent_retry(lp, now, 60);
+			return;
 		}
-	}
+		if (pool->has_stratum) {
+			applog(LOG_WARNING, "Block change for %s detection via %s stratum",
+			       cp->rpc_url, pool->rpc_url);
+			lp->done = true;
+			return;
+		}
+		lp->pool = pool;
+		lp->announced = false;
 
-	if (pool->has_stratum) {
-		applog(LOG_WARNING, "Block change for %s detection via %s stratum",
-		       cp->rpc_url, pool->rpc_url);
-		goto out;
+		/* Any longpoll from any pool is enough for this to be true */
+		have_longpoll = true;
 	}
+	pool = lp->pool;
 
-	/* Any longpoll from any pool is enough for this to be true */
-	have_longpoll = true;
-
-	wait_lpcurrent(cp);
+	if (!longpoll_current(cp))
+		return;
 
-	{
-		lp_url = pool->lp_url;
+	if (!lp->announced) {
 		if (cp == pool)
-			applog(LOG_WARNING, "Long-polling activated for %s (%s)", lp_url, pool_protocol_name(pool->lp_proto));
+			applog(LOG_WARNING, "Long-polling activated for %s (%s)", pool->lp_url, pool_protocol_name(pool->lp_proto));
 		else
-			applog(LOG_WARNING, "Long-polling activated for %s via %s (%s)", cp->rpc_url, lp_url, pool_protocol_name(pool->lp_proto));
+			applog(LOG_WARNING, "Long-polling activated for %s via %s (%s)", cp->rpc_url, pool->lp_url, pool_protocol_name(pool->lp_proto));
+		lp->announced = true;
 	}
 
-	while (42) {
-		json_t *val, *soval;
-
-		struct work *work = make_work();
-		char *lpreq;
-		lpreq = prepare_rpc_req(work, pool->lp_proto, pool->lp_id);
-		work->pool = pool;
-		if (!lpreq)
-		{
-			free_work(work);
-			goto lpfail;
+	if (!lp->curl) {
+		lp->curl = curl_easy_init();
+		if (unlikely(!lp->curl)) {
+			applog(LOG_ERR, "CURL initialisation failed");
+			longpoll_ent_retry(lp, now, 30);
+			return;
 		}
+	}
+
+	lp->work = make_work();
+	lp->lpreq = prepare_rpc_req(lp->work, pool->lp_proto, pool->lp_id);
+	lp->work->pool = pool;
+	if (!lp->lpreq) {
+		free_work(lp->work);
+		lp->work = NULL;
+		longpoll_ent_retry(lp, now, 30);
+		return;
+	}
 
-		wait_lpcurrent(cp);
+	gettimeofday(&lp->tv_start, NULL);
 
-		gettimeofday(&start, NULL);
+	/* Longpoll connections can be persistent for a very long time
+	 * and any number of issues could have come up in the meantime
+	 * so always establish a fresh connection instead of relying on
+	 * a persistent one. */
+	json_rpc_call_async(lp->curl, pool->lp_url, pool->rpc_userpass, lp->lpreq, true, pool, false, lp);
+	curl_easy_setopt(lp->curl, CURLOPT_FRESH_CONNECT, 1);
+	curl_easy_setopt(lp->curl, CURLOPT_OPENSOCKETFUNCTION, save_curl_socket);
+	curl_easy_setopt(lp->curl, CURLOPT_OPENSOCKETDATA, pool);
+	curl_multi_add_handle(curlm, lp->curl);
+	lp->active = true;
+}
 
-		/* Longpoll connections can be persistent for a very long time
-		 * and any number of issues could have come up in the meantime
-		 * so always establish a fresh connection instead of relying on
-		 * a persistent one. */
-		curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
-		curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, save_curl_socket);
-		curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, pool);
-		val = json_rpc_call(curl, lp_url, pool->rpc_userpass,
-				    lpreq, false, true, &rolltime, pool, false);
-		pool->lp_socket = CURL_SOCKET_BAD;
+static void longpoll_ent_completed(struct longpoll_ent *lp, json_t *val, int rolltime)
+{
+	struct pool *cp = lp->cp, *pool = lp->pool;
+	struct longpoll_reply *lpr;
+	struct timeval reply;
 
-		gettimeofday(&reply, NULL);
+	pool->lp_socket = CURL_SOCKET_BAD;
+	gettimeofday(&reply, NULL);
 
-		free(lpreq);
+	free(lp->lpreq);
+	lp->lpreq = NULL;
+	lp->active = false;
 
-		if (likely(val)) {
-			soval = json_object_get(json_object_get(val, "result"), "submitold");
-			if (soval)
-				pool->submit_old = json_is_true(soval);
-			else
-				pool->submit_old = false;
-			convert_to_work(val, rolltime, pool, work, &start, &reply);
-			failures = 0;
+	if (likely(val)) {
+		lpr = malloc(sizeof(*lpr));
+		if (unlikely(!lpr))
+			quit(1, "Failed to malloc longpoll_reply in longpoll_ent_completed");
+		lpr->pool = pool;
+		lpr->work = lp->work;
+		lpr->val = val;
+		lpr->rolltime = rolltime;
+		lpr->tv_start = lp->tv_start;
+		lpr->tv_reply = reply;
+		if (unlikely(!tq_push(longpoll_replyq, lpr))) {
 			json_decref(val);
-		} else {
-			/* Some pools regularly drop the longpoll request so
-			 * only see this as longpoll failure if it happens
-			 * immediately and just restart it the rest of the
-			 * time. */
-			gettimeofday(&end, NULL);
-			free_work(work);
-			if (end.tv_sec - start.tv_sec > 30)
+			free_work(lp->work);
+			free(lpr);
+		}
+		lp->failures = 0;
+	} else {
+		free_work(lp->work);
+
+		/* Some pools regularly drop the longpoll request so
+		 * only see this as longpoll failure if it happens
+		 * immediately and just restart it the rest of the
+		 * time. */
+		if (reply.tv_sec - lp->tv_start.tv_sec <= 30) {
+			if (++lp->failures == 1)
+				applog(LOG_WARNING, "longpoll failed for %s, retrying every 30s", pool->lp_url);
+			longpoll_ent_retry(lp, &reply, 30);
+		}
+	}
+	lp->work = NULL;
+
+	if (pool != cp) {
+		pool = select_longpoll_pool(cp);
+		if (pool && pool->has_stratum) {
+			applog(LOG_WARNING, "Block change for %s detection via %s stratum",
+			       cp->rpc_url, pool->rpc_url);
+			lp->done = true;
+		}
+		lp->pool = pool;
+	}
+
+	if (pool && unlikely(pool->removed))
+		lp->done = true;
+}
+
+static void longpoll_ent_cancel(CURLM *curlm, struct longpoll_ent *lp)
+{
+	if (lp->active) {
+		void *priv;
+
+		curl_multi_remove_handle(curlm, lp->curl);
+		json_rpc_call_completed(lp->curl, CURLE_ABORTED_BY_CALLBACK, false, NULL, &priv);
+		lp->pool->lp_socket = CURL_SOCKET_BAD;
+		free(lp->lpreq);
+		free_work(lp->work);
+	}
+	if (lp->curl)
+		curl_easy_cleanup(lp->curl);
+	free(lp);
+}
+
+static void *longpoll_reply_thread(__maybe_unused void *userdata)
+{
+	struct longpoll_reply *lpr;
+	json_t *soval;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("longpoll_reply");
+
+	while (42) {
+		/* tq_pop can also return NULL on a spurious wakeup */
+		lpr = tq_pop(longpoll_replyq, NULL);
+		if (unlikely(!lpr))
+			continue;
+		soval = json_object_get(json_object_get(lpr->val, "result"), "submitold");
+		if (soval)
+			lpr->pool->submit_old = json_is_true(soval);
+		else
+			lpr->pool->submit_old = false;
+		convert_to_work(lpr->val, lpr->rolltime, lpr->pool, lpr->work, &lpr->tv_start, &lpr->tv_reply);
+		json_decref(lpr->val);
+		free(lpr);
+	}
+
+	return NULL;
+}
+
+static void *longpoll_thread(__maybe_unused void *userdata)
+{
+	long curlm_timeout_ms = -1, next_ms;
+	struct longpoll_ent *lps = NULL, *lp, **lpp;
+	struct timeval now, timeout, *timeoutp;
+	fd_set rfds, wfds, efds;
+	int maxfd, n, i;
+	CURLMsg *cm;
+	CURLM *curlm;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("longpoll");
+
+	curlm = curl_multi_init();
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, my_curl_timer_set);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, &curlm_timeout_ms);
+
+	FD_ZERO(&rfds);
+	while (42) {
+		if (FD_ISSET(longpoll_notifier[0], &rfds))
+			notifier_read(longpoll_notifier);
+
+		/* Pick up pools that have had longpoll started since */
+		for (i = 0; i < total_pools; i++) {
+			struct pool *cp = pools[i];
+
+			if (!cp->lp_started || cp->removed)
+				continue;
+			for (lp = lps; lp && lp->cp != cp; lp = lp->next)
+				;
+			if (lp)
 				continue;
-			if (failures == 1)
-				applog(LOG_WARNING, "longpoll failed for %s, retrying every 30s", lp_url);
-lpfail:
-			sleep(30);
+			lp = calloc(1, sizeof(*lp));
+			if (unlikely(!lp))
+				quit(1, "Failed to calloc longpoll_ent in longpoll_thread");
+			lp->cp = cp;
+			lp->next = lps;
+			lps = lp;
 		}
 
-		if (pool != cp) {
-			pool = select_longpoll_pool(cp);
-			if (pool->has_stratum) {
-				applog(LOG_WARNING, "Block change for %s detection via %s stratum",
-				       cp->rpc_url, pool->rpc_url);
-				break;
+		gettimeofday(&now, NULL);
+		next_ms = -1;
+		for (lpp = &lps; (lp = *lpp); ) {
+			if (!lp->cp->lp_started || lp->cp->removed) {
+				*lpp = lp->next;
+				longpoll_ent_cancel(curlm, lp);
+				continue;
+			}
+			longpoll_ent_poll(curlm, lp, &now);
+			if (!lp->done && !lp->active && timercmp(&now, &lp->tv_next, <)) {
+				long ms = (lp->tv_next.tv_sec - now.tv_sec) * 1000 + (lp->tv_next.tv_usec - now.tv_usec) / 1000 + 1;
+
+				if (next_ms < 0 || ms < next_ms)
+					next_ms = ms;
 			}
-			if (unlikely(!pool))
-				goto retry_pool;
+			lpp = &lp->next;
 		}
 
-		if (unlikely(pool->removed))
-			break;
-	}
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
+		if (curlm_timeout_ms >= 0 && (next_ms < 0 || curlm_timeout_ms < next_ms))
+			next_ms = curlm_timeout_ms;
+		if (next_ms >= 0) {
+			timeout.tv_sec = next_ms / 1000;
+			timeout.tv_usec = (next_ms % 1000) * 1000;
+			timeoutp = &timeout;
+		} else
+			timeoutp = NULL;
 
-out:
-	curl_easy_cleanup(curl);
+		FD_SET(longpoll_notifier[0], &rfds);
+		if (longpoll_notifier[0] > maxfd)
+			maxfd = longpoll_notifier[0];
+
+		if (select(maxfd+1, &rfds, &wfds, &efds, timeoutp) < 0) {
+			FD_ZERO(&rfds);
+			continue;
+		}
+
+		curl_multi_perform(curlm, &n);
+		while ((cm = curl_multi_info_read(curlm, &n))) {
+			int rolltime = 0;
+			json_t *val;
+
+			if (cm->msg != CURLMSG_DONE)
+				continue;
+			val = json_rpc_call_completed(cm->easy_handle, cm->data.result, false, &rolltime, &lp);
+			curl_multi_remove_handle(curlm, cm->easy_handle);
+			if (unlikely(!lp))
+				continue;
+			longpoll_ent_completed(lp, val, rolltime);
+		}
+	}
 
 	return NULL;
 }
@@ -7241,8 +8515,8 @@ static void stop_longpoll(void)
 			continue;
 		
 		pool->lp_started = false;
-		pthread_cancel(pool->longpoll_thread);
 	}
+	notifier_wake(longpoll_notifier);
 	have_longpoll = false;
 }
 
@@ -7258,9 +8532,7 @@ static void start_longpoll(void)
 		if (unlikely(pool->removed || pool->lp_started || !pool->lp_url))
 			continue;
 		
-		pool->lp_started = true;
-		if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
-			quit(1, "Failed to create pool longpoll thread");
+		longpoll_start_pool(pool);
 	}
 }
 
@@ -7299,26 +8571,32 @@ static void reap_curl(struct pool *pool)
 
 static void *watchpool_thread(void __maybe_unused *userdata)
 {
+	struct timespec abstime = { 0, 0 };
 	int intervals = 0;
 
 	RenameThread("watchpool");
 
 	while (42) {
 		struct timeval now;
+		bool interval;
 		int i;
 
-		if (++intervals > 20)
-			intervals = 0;
 		gettimeofday(&now, NULL);
+		interval = (now.tv_sec >= abstime.tv_sec);
+		if (interval) {
+			abstime.tv_sec = now.tv_sec + 30;
+			if (++intervals > 20)
+				intervals = 0;
+		}
 
 		for (i = 0; i < total_pools; i++) {
 			struct pool *pool = pools[i];
 
-			if (!opt_benchmark)
+			if (interval && !opt_benchmark)
 				reap_curl(pool);
 
 			/* Get a rolling utility per pool over 10 mins */
-			if (intervals > 19) {
+			if (interval && intervals > 19) {
                 double shares = pool->diff_accepted - pool->last_shares;
 
                 pool->last_shares = pool->diff_accepted;
@@ -7329,22 +8607,30 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 			if ((pool->enabled == POOL_DISABLED || pool->has_stratum) && pool->probed)
 				continue;
 
-			/* Test pool is idle once every minute */
-			if (pool->idle && now.tv_sec - pool->tv_idle.tv_sec > 30) {
+			/* Test an idle pool again once its retry timer is due */
+			if (pool->idle && now.tv_sec - pool->tv_idle.tv_sec >= POOL_IDLE_RETRY) {
 				gettimeofday(&pool->tv_idle, NULL);
 				if (pool_active(pool, true) && pool_tclear(pool, &pool->idle))
 					pool_resus(pool);
+				else
+					arm_idle_timer(pool);
 			}
 
 		}
 
-		if (pool_strategy == POOL_ROTATE && now.tv_sec - rotate_tv.tv_sec > 60 * opt_rotate_period) {
+		if (interval && pool_strategy == POOL_ADAPTIVE)
+			update_adaptive_weights();
+
+		if (interval && pool_strategy == POOL_ROTATE && now.tv_sec - rotate_tv.tv_sec > 60 * opt_rotate_period) {
 			gettimeofday(&rotate_tv, NULL);
 			switch_pools(NULL);
 		}
 
-		sleep(30);
-			
+		mutex_lock(&watchpool_lock);
+		if (!watchpool_due)
+			pthread_cond_timedwait(&watchpool_cond, &watchpool_lock, &abstime);
+		watchpool_due = false;
+		mutex_unlock(&watchpool_lock);
 	}
 	return NULL;
 }
@@ -7387,9 +8673,8 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 
 		sleep(interval);
 
-		discard_stale();
-
 		hashmeter(-1, &zero_tv, 0);
+		metrics_update();
 
 #ifdef HAVE_CURSES
 		if (curses_active_locked()) {
@@ -7636,6 +8921,8 @@ void print_summary(void)
 	applog(LOG_WARNING, "Submitting work remotely delay occasions: %d", total_ro);
 	applog(LOG_WARNING, "New blocks detected on network: %d\n", new_blocks);
 
+	mock_stratum_summary();
+
 	if (total_pools > 1) {
 		for (i = 0; i < total_pools; i++) {
 			struct pool *pool = pools[i];
@@ -7676,6 +8963,8 @@ void print_summary(void)
 
 static void clean_up(void)
 {
+	logging_flush();
+
 #ifdef HAVE_LIBUSB
 	if (likely(have_libusb))
         libusb_exit(NULL);
@@ -7688,8 +8977,11 @@ static void clean_up(void)
 	if (!opt_realquiet && successful_connect)
 		print_summary();
 
+	sharelog_flush();
+	trace_dump();
+
 	if (opt_n_threads)
-		free(cpus);
+		cacheline_free(cpus);
 
 	curl_global_cleanup();
 
@@ -7778,6 +9070,7 @@ void add_pool_details(struct pool *pool, bool live, char *url, char *user, char
 	if (live && !pool_active(pool, false)) {
 		gettimeofday(&pool->tv_idle, NULL);
 		pool->idle = true;
+		arm_idle_timer(pool);
 	}
 }
 
@@ -8048,7 +9341,6 @@ int main(int argc, char *argv[])
 	mutex_init(&console_lock);
 	mutex_init(&control_lock);
 	mutex_init(&stats_lock);
-	mutex_init(&sharelog_lock);
 	mutex_init(&ch_lock);
 	mutex_init(&sshare_lock);
 	rwlock_init(&blk_lock);
@@ -8057,6 +9349,13 @@ int main(int argc, char *argv[])
 	mutex_init(&lp_lock);
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init lp_cond");
+	notifier_init(longpoll_notifier);
+
+	mutex_init(&watchpool_lock);
+	if (unlikely(pthread_cond_init(&watchpool_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init watchpool_cond");
+	timer_init(&switch_sweep_timer, discard_stale_timer, NULL);
+	timerwheel_start();
 
 	mutex_init(&restart_lock);
 	if (unlikely(pthread_cond_init(&restart_cond, NULL)))
@@ -8065,8 +9364,14 @@ int main(int argc, char *argv[])
 	if (unlikely(pthread_cond_init(&gws_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init gws_cond");
 
+	mutex_init(&getwork_fetch_lock);
+	if (unlikely(pthread_cond_init(&getwork_fetch_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init getwork_fetch_cond");
+
 	notifier_init(submit_waiting_notifier);
 
+	stratum_curlsh_init();
+
 	sprintf(packagename, "%s %s", PACKAGE, VERSION);
 
 #ifdef WANT_CPUMINE
@@ -8151,6 +9456,24 @@ int main(int argc, char *argv[])
 		successful_connect = true;
 	}
 
+	if (opt_benchmark_stratum || opt_stratum_replay) {
+		if (opt_benchmark || total_pools)
+			quit(1, "--benchmark-stratum and --stratum-replay cannot be used with --benchmark or other pools");
+		mock_stratum_start(add_pool());
+	}
+
+	if (opt_benchmark_getwork) {
+		if (opt_benchmark || opt_benchmark_stratum || opt_stratum_replay || total_pools)
+			quit(1, "--benchmark-getwork cannot be used with other benchmarks or pools");
+		mock_getwork_start(add_pool());
+	}
+
+	if (opt_stratum_capture)
+		stratum_capture_open(opt_stratum_capture);
+	if (opt_trace)
+		trace_enabled = true;
+	sharelog_start();
+
     /* If no algorithm specified, default to NeoScrypt */
 #ifdef USE_NEOSCRYPT
     if(!opt_neoscrypt && !opt_scrypt && !opt_sha256d)
@@ -8387,8 +9710,10 @@ int main(int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
+	logging_start();
+
 	total_threads = mining_threads + 7;
-	thr_info = calloc(total_threads, sizeof(*thr));
+	thr_info = cacheline_calloc(total_threads, sizeof(*thr));
 	if (!thr_info)
 		quit(1, "Failed to calloc thr_info");
 
@@ -8566,6 +9891,14 @@ begin_bench:
 			quit(1, "submit_work thread create failed");
 	}
 
+	{
+		pthread_t getwork_fetch_thr;
+
+		notifier_init(getwork_fetch_notifier);
+		if (unlikely(pthread_create(&getwork_fetch_thr, NULL, getwork_fetch_thread, NULL)))
+			quit(1, "getwork_fetch thread create failed");
+	}
+
 	watchpool_thr_id = mining_threads + 2;
 	thr = &thr_info[watchpool_thr_id];
 	/* start watchpool thread */
@@ -8597,6 +9930,10 @@ begin_bench:
 	if (thr_info_create(thr, NULL, api_thread, thr))
 		quit(1, "API thread create failed");
 
+	stratum_proxy_start();
+	metrics_start();
+	history_start();
+
 #ifdef HAVE_CURSES
 	/* Create curses input thread for keyboard input. Create this last so
 	 * that we know all threads are created since this can call kill_work
@@ -8613,7 +9950,6 @@ begin_bench:
 		int ts, max_staged = opt_queue;
 		struct pool *pool, *cp;
 		bool lagging = false;
-		struct curl_ent *ce;
 		struct work *work;
 
 		cp = current_pool();
@@ -8626,7 +9962,7 @@ begin_bench:
 		mutex_lock(stgd_lock);
 		ts = __total_staged();
 
-		if (!cp->has_stratum && cp->proto != PLP_GETBLOCKTEMPLATE && !ts && !opt_fail_only)
+		if (!cp->has_stratum && cp->proto != PLP_GETBLOCKTEMPLATE && !ts && !cp->getworks_inflight && !opt_fail_only)
 			lagging = true;
 
 		/* Wait until hash_pop tells us we need to create more work */
@@ -8639,8 +9975,6 @@ begin_bench:
 		if (ts > max_staged)
 			continue;
 
-		work = make_work();
-
 		if (lagging && !pool_tset(cp, &cp->lagging)) {
 			applog(LOG_WARNING, "Pool %d not providing work fast enough", cp->pool_no);
 			cp->getfail_occasions++;
@@ -8658,6 +9992,13 @@ retry:
 				goto retry;
 			}
 			pool->last_work_time = time(NULL);
+			/* Rolling ntime of staged work saves a coinbase and
+			 * merkle root calculation */
+			if (opt_ntime_roll && clone_available(pool)) {
+				applog(LOG_DEBUG, "Cloned stratum work");
+				continue;
+			}
+			work = make_work();
 			gen_stratum_work(pool, work);
 			applog(LOG_DEBUG, "Generated stratum work");
 			stage_work(work);
@@ -8671,7 +10012,6 @@ retry:
 				{}
 			else
 			if (can_roll(last_work) && should_roll(last_work)) {
-				free_work(work);
 				work = make_clone(pool->last_work_copy);
 				mutex_unlock(&pool->last_work_lock);
 				roll_work(work);
@@ -8687,48 +10027,50 @@ retry:
 			mutex_unlock(&pool->last_work_lock);
 		}
 
-		if (clone_available()) {
+		if (clone_available(NULL)) {
 			applog(LOG_DEBUG, "Cloned getwork work");
-			free_work(work);
 			continue;
 		}
 
 		if (opt_benchmark) {
+			work = make_work();
 			get_benchmark_work(work);
 			applog(LOG_DEBUG, "Generated benchmark work");
 			stage_work(work);
 			continue;
 		}
 
-		work->pool = pool;
-		ce = pop_curl_entry3(pool, 2);
-		/* obtain new work from bitcoin via JSON-RPC */
-		if (!get_upstream_work(work, ce->curl)) {
-			struct pool *next_pool;
+		/* A pool whose last request failed is left alone for a while,
+		 * unless we switch away from it first */
+		if (pool->getwork_retry > time(NULL)) {
+			struct pool *next_pool = select_pool(!opt_fail_only);
 
-			/* Make sure the pool just hasn't stopped serving
-			 * requests but is up as we'll keep hammering it */
-			push_curl_entry(ce, pool);
-			++pool->seq_getfails;
-			pool_died(pool);
-			next_pool = select_pool(!opt_fail_only);
 			if (pool == next_pool) {
-				applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, retrying in 5s", pool->pool_no);
-				sleep(5);
-			} else {
-				applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, failover activated", pool->pool_no);
-				pool = next_pool;
+				struct timespec then = { .tv_sec = pool->getwork_retry };
+
+				mutex_lock(&getwork_fetch_lock);
+				pthread_cond_timedwait(&getwork_fetch_cond, &getwork_fetch_lock, &then);
+				mutex_unlock(&getwork_fetch_lock);
+				continue;
 			}
+			applog(LOG_DEBUG, "Pool %d failed on get work, failover activated", pool->pool_no);
+			pool = next_pool;
 			goto retry;
 		}
-		if (ts >= max_staged)
-			pool_tclear(pool, &pool->lagging);
-		if (pool_tclear(pool, &pool->idle))
-			pool_resus(pool);
 
-		applog(LOG_DEBUG, "Generated getwork work");
-		stage_work(work);
-		push_curl_entry(ce, pool);
+		/* obtain new work from bitcoin via JSON-RPC, staged by
+		 * getwork_fetch_thread once it arrives */
+		mutex_lock(&getwork_fetch_lock);
+		if (pool->getworks_inflight >= opt_getwork_inflight) {
+			/* Nothing to do until a request completes or we
+			 * switch pools */
+			pthread_cond_wait(&getwork_fetch_cond, &getwork_fetch_lock);
+			mutex_unlock(&getwork_fetch_lock);
+			continue;
+		}
+		pool->getworks_inflight++;
+		mutex_unlock(&getwork_fetch_lock);
+		queue_getwork_fetch(pool, make_work());
 	}
 
 	return 0;
@@ -52,6 +52,7 @@ typedef unsigned long long ullong;
 #include "uthash.h"
 #include "logging.h"
 #include "util.h"
+#include "timerwheel.h"
 
 #ifdef HAVE_OPENCL
 #include "CL/cl.h"
@@ -203,6 +204,10 @@ extern void nvml_shutdown();
 #define __maybe_unused		__attribute__((unused))
 #endif
 
+/* Keeps data written by different threads on separate cache lines */
+#define CACHELINE_SIZE		64
+#define __cacheline_aligned	__attribute__((aligned(CACHELINE_SIZE)))
+
 #define uninitialised_var(x) x = x
 
 #if defined(__i386__)
@@ -250,9 +255,11 @@ enum pool_strategy {
 	POOL_ROTATE,
 	POOL_LOADBALANCE,
 	POOL_BALANCE,
+	POOL_LATENCY,
+	POOL_ADAPTIVE,
 };
 
-#define TOP_STRATEGY (POOL_BALANCE)
+#define TOP_STRATEGY (POOL_ADAPTIVE)
 
 struct strategies {
 	const char *s;
@@ -385,6 +392,38 @@ enum {
 	MSG_POOLPRIO	= 73,
 };
 
+/* Latency histogram for --metrics-port; the last bucket is everything above
+ * the largest bound */
+#define LATENCY_BUCKETS 11
+struct latency_hist {
+	uint64_t bucket[LATENCY_BUCKETS + 1];
+	double sum;
+};
+
+/* Ring lengths of the time series kept for the history API command */
+#define HISTORY_SECS	300
+#define HISTORY_MINS	1440
+#define HISTORY_HOURS	720
+
+enum history_res {
+	HISTORY_SEC,
+	HISTORY_MIN,
+	HISTORY_HOUR,
+	HISTORY_RES,
+};
+
+/* What happened during one interval of a time series */
+struct history_sample {
+	time_t when;
+	uint32_t ms;
+	int hw_errors;
+	uint64_t hashes;
+	double diff_accepted;
+	double diff_rejected;
+};
+
+struct history;
+
 struct cgminer_stats {
 	struct timeval start_tv;
 	
@@ -392,6 +431,7 @@ struct cgminer_stats {
 	struct timeval getwork_wait;
 	struct timeval getwork_wait_max;
 	struct timeval getwork_wait_min;
+	struct latency_hist getwork_wait_hist;
 };
 
 // Just the actual network getworks to the pool
@@ -417,6 +457,20 @@ struct cgminer_pool_stats {
 	uint64_t times_received;
 	uint64_t bytes_received;
 	uint64_t net_bytes_received;
+	/* Stratum submit->ack round trip and notify inter-arrival, in seconds */
+	uint32_t stratum_rtt_count;
+	double stratum_rtt;
+	double stratum_rtt_rolling;
+	double stratum_rtt_max;
+	double stratum_rtt_min;
+	uint32_t notify_count;
+	struct timeval last_notify;
+	double notify_interval_rolling;
+	double notify_interval_max;
+	uint64_t stratum_works;
+	/* Work request and share submission round trips */
+	struct latency_hist getwork_hist;
+	struct latency_hist submit_hist;
 };
 
 struct cgpu_info {
@@ -453,22 +507,12 @@ struct cgpu_info {
 	pthread_mutex_t		device_mutex;
 
 	enum dev_enable deven;
-	int accepted;
-	int rejected;
-	int hw_errors;
-	double rolling;
-	double total_mhashes;
-	double utility;
-	double utility_diff1;
 	enum alive status;
 	char init[40];
-	struct timeval last_message_tv;
 
 	int threads;
 	struct thr_info **thr;
 
-	int64_t max_hashes;
-
 	const char *kname;
 #ifdef HAVE_OPENCL
 	bool mapped;
@@ -520,13 +564,6 @@ struct cgpu_info {
     bool has_nvml;
 #endif
 
-	double diff_accepted;
-	double diff_rejected;
-	int last_share_pool;
-	time_t last_share_pool_time;
-	double last_share_diff;
-
-	time_t device_last_well;
 	time_t device_last_not_well;
 	enum dev_reason device_not_well_reason;
 	float reinit_backoff;
@@ -541,7 +578,38 @@ struct cgpu_info {
 	int dev_comms_error_count;
 	int dev_throttle_count;
 
+	/* Owned by the history sampler */
+	struct history *history;
+
+	/* The counters below are grouped by the thread that writes them, each
+	 * group on its own cache lines, so hashing, result and submission
+	 * threads don't keep stealing each other's lines or those of the
+	 * read-mostly fields above */
+
+	/* Share results, written by the submit thread under stats_lock */
+	int accepted __cacheline_aligned;
+	int rejected;
+	double diff_accepted;
+	double diff_rejected;
+	double utility;
+	double utility_diff1;
+	int last_share_pool;
+	time_t last_share_pool_time;
+	double last_share_diff;
+
+	/* Written by whichever thread checks found nonces */
+	int hw_errors __cacheline_aligned;
+	int dup_nonces;
+
+	/* Written by the mining threads */
+	time_t device_last_well __cacheline_aligned;
+	int64_t max_hashes;
 	struct cgminer_stats cgminer_stats;
+
+	/* Written by the watchdog */
+	double rolling __cacheline_aligned;
+	double total_mhashes;
+	struct timeval last_message_tv;
 };
 
 extern void renumber_cgpu(struct cgpu_info *);
@@ -571,11 +639,26 @@ struct thr_info {
 
 	bool	pause;
 	time_t	getwork;
-	double	rolling;
 
-	bool	work_restart;
 	int		work_restart_fd;
 	int		_work_restart_fd_w;
+
+	/* Set by restart_threads and polled by the mining thread as it hashes,
+	 * so kept off the lines anything else writes */
+	bool	work_restart __cacheline_aligned;
+
+	/* Written by the watchdog; hashes_seen and hashing_us_seen are what it
+	 * had last aggregated from hash_slot */
+	double	rolling __cacheline_aligned;
+	uint64_t	hashes_seen;
+	uint64_t	hashing_us_seen;
+
+	/* Only ever written by the mining thread itself, with relaxed atomics,
+	 * so reporting progress never takes a shared lock */
+	struct {
+		uint64_t	hashes;
+		uint64_t	hashing_us;
+	} __cacheline_aligned hash_slot;
 };
 
 extern int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg);
@@ -787,8 +870,14 @@ extern int fulltest_le(const uint *hash, const uint *target);
 extern int opt_queue;
 extern int opt_scantime;
 extern int opt_expiry;
+extern int opt_standby_pools;
+extern bool opt_extranonce_subscribe;
+extern int opt_dns_cache_time;
+extern int opt_stratum_proxy;
+extern int opt_ntime_roll;
 
 extern pthread_mutex_t hash_lock;
+extern pthread_mutex_t stats_lock;
 extern pthread_mutex_t console_lock;
 extern pthread_mutex_t ch_lock;
 
@@ -813,8 +902,72 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 #endif
 
 extern void api(int thr_id);
+struct sockaddr_in;
+extern void api_listen_addr(struct sockaddr_in *);
+extern bool api_access_allowed(struct sockaddr_in *);
 
 extern struct pool *current_pool(void);
+
+/* Bytes of the upstream extranonce2 handed to stratum proxy clients as part
+ * of their extranonce1 */
+#define STRATUM_PROXY_N1_BYTES 2
+extern bool stratum_proxy_test(struct pool *, const char *job_id, const char *nonce2,
+			       const char *ntime, const char *nonce, bool *stale);
+extern void stratum_proxy_start(void);
+extern bool stratum_proxy_clients(void);
+extern int opt_metrics_port;
+extern void metrics_start(void);
+extern void metrics_update(void);
+enum trace_type {
+	TRACE_STAGE,
+	TRACE_HASH_POP,
+	TRACE_SCAN_BEGIN,
+	TRACE_SCAN_END,
+	TRACE_NONCE,
+	TRACE_SHARE,
+	TRACE_SUBMIT,
+	TRACE_RESULT,
+	TRACE_TYPES,
+};
+
+extern bool opt_sharelog_binary;
+extern char *set_sharelog(char *arg);
+extern char *set_sharelog_rotate(const char *arg);
+extern char *sharelog_to_csv(const char *arg);
+extern void sharelog(const char *disposition, const struct work *);
+extern void sharelog_start(void);
+extern void sharelog_flush(void);
+
+extern char *opt_trace;
+extern bool trace_enabled;
+extern void trace_event(enum trace_type, int work_id);
+extern void trace_dump(void);
+
+/* Costs one predicted branch unless --trace is on */
+#define trace_work(type, work) do { \
+	if (unlikely(trace_enabled)) \
+		trace_event(type, (work)->id); \
+} while (0)
+
+extern const char *history_res_names[HISTORY_RES];
+extern int history_get(struct history **, enum history_res, struct history_sample **);
+extern void history_start(void);
+extern const double latency_bounds[LATENCY_BUCKETS];
+extern void latency_hist_add(struct latency_hist *, double secs);
+extern void stratum_proxy_notify(struct pool *pool);
+extern bool stratum_proxy_result(struct pool *pool, int id, json_t *res_val, json_t *err_val);
+
+extern char *opt_benchmark_stratum;
+extern char *set_benchmark_stratum(const char *arg);
+extern char *opt_benchmark_getwork;
+extern char *set_benchmark_getwork(const char *arg);
+extern char *opt_stratum_capture;
+extern char *opt_stratum_replay;
+extern char *set_replay_speed(const char *arg);
+extern void mock_stratum_start(struct pool *pool);
+extern void mock_getwork_start(struct pool *pool);
+extern void mock_stratum_restarted(void);
+extern void mock_stratum_summary(void);
 extern int enabled_pools;
 extern bool detect_stratum(struct pool *pool, char *url);
 extern void print_summary(void);
@@ -971,11 +1124,23 @@ struct pool {
 	int seq_getfails;
 	int solved;
 
+	/* Getwork and GBT requests being fetched by getwork_fetch_thread */
+	int getworks_inflight;
+	time_t getwork_retry;
+
+	/* Work from this pool stays valid until then after a --soft-switch */
+	time_t drain_until;
+	struct timer_ent drain_timer;
+
 	char diff[8];
 
 	double diff_accepted;
 	double diff_rejected;
 	double diff_stale;
+	int hw_errors;
+
+	/* Owned by the history sampler */
+	struct history *history;
 
 	bool submit_fail;
 	bool idle;
@@ -1002,10 +1167,21 @@ struct pool {
 	unsigned int getfail_occasions;
 	unsigned int remotefail_occasions;
 	struct timeval tv_idle;
+	struct timer_ent idle_timer;
 
 	double utility;
 double last_shares, shares;
 
+	/* Decaying accepted and submitted difficulty, and share count, feeding
+	 * the adaptive strategy, and the resulting fraction of work */
+	double adaptive_accepted;
+	double adaptive_submitted;
+	double adaptive_shares;
+	double adaptive_last_accepted;
+	double adaptive_last_submitted;
+	int adaptive_last_shares;
+	double adaptive_weight;
+
 	char *rpc_url;
 	char *rpc_userpass;
 	char *rpc_user, *rpc_pass;
@@ -1016,7 +1192,6 @@ double last_shares, shares;
 	struct thread_q *submit_q;
 	struct thread_q *getwork_q;
 
-	pthread_t longpoll_thread;
 	pthread_t submit_thread;
 	pthread_t getwork_thread;
 
@@ -1029,6 +1204,12 @@ double last_shares, shares;
 	double last_share_diff;
 	uint64_t best_diff;
 
+	/* Time from switching to this pool until a device got work from it */
+	bool failover_pending;
+	struct timeval tv_failover;
+	double failover_time;
+	unsigned int failovers;
+
 	struct cgminer_stats cgminer_stats;
 	struct cgminer_pool_stats cgminer_pool_stats;
 
@@ -1041,6 +1222,8 @@ double last_shares, shares;
 	size_t sockbuf_size;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *nonce1;
+	char *sessionid;
+	bool session_resumed;
 	size_t n1_len;
 	uint32_t nonce2;
 	int n2size;
@@ -1080,6 +1263,8 @@ struct work {
 	int		thr_id;
 	struct pool	*pool;
 	struct timeval	tv_staged;
+	/* Discards the work once it goes stale while staged */
+	struct timer_ent expiry_timer;
 
 	bool		mined;
 	bool		clone;
@@ -1138,6 +1323,7 @@ extern void kill_work(void);
 extern int prioritize_pools(char *param, int *pid);
 extern void validate_pool_priorities(void);
 extern void switch_pools(struct pool *selected);
+extern bool pool_standby(struct pool *pool);
 extern void remove_pool(struct pool *pool);
 extern void write_config(FILE *fcfg);
 extern void zero_bestshare(void);
@@ -1187,7 +1373,6 @@ struct api_data {
 	enum api_data_type type;
 	char *name;
 	void *data;
-	bool data_was_malloc;
 	struct api_data *prev;
 	struct api_data *next;
 };
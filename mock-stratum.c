@@ -0,0 +1,886 @@
+/*
+ * Copyright 2015-2017 John Doering
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Built-in mock stratum pool for --benchmark-stratum. Unlike --benchmark, work
+ * arrives over a real local stratum connection, so notify parsing, stratum work
+ * generation, the staged queue and share submission are all exercised.
+ *
+ * With --stratum-replay the pool messages come from a --stratum-capture file
+ * instead, sent at their original pace or scaled by --replay-speed.
+ *
+ * --benchmark-getwork serves getwork over HTTP JSON-RPC instead, so the getwork
+ * scheduler and getwork_fetch_thread can be watched against a slow or failing
+ * pool: how many requests it keeps in flight and how often it asks.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <jansson.h>
+
+#include "compat.h"
+#include "miner.h"
+#include "util.h"
+
+#define MOCK_BUFSIZ		8192
+#define MOCK_MAX_MERKLES	32
+#define MOCK_MAX_PENDING	1024
+/* How often the results so far are logged while running */
+#define MOCK_REPORT_SECS	60
+
+#define MOCK_NONCE1		"f000000f"
+#define MOCK_N2SIZE		"4"
+/* A typical coinbase, the height push is where stratum_thread expects it */
+#define MOCK_COINBASE1		"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008"
+#define MOCK_COINBASE2		"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000"
+
+struct mock_reply {
+	char id[32];
+	struct timeval due;
+};
+
+struct replay_event {
+	uint64_t usecs;
+	char *line;
+	bool notify;
+	bool clean;
+};
+
+struct mock_stats {
+	uint64_t notifies;
+	uint64_t cleans;
+	uint64_t submits;
+	uint64_t restarts;
+	double restart_total;
+	double restart_max;
+	uint64_t getworks;
+	uint64_t getwork_fails;
+	int getworks_inflight;
+	int getworks_inflight_max;
+};
+
+char *opt_benchmark_stratum;
+char *opt_benchmark_getwork;
+char *opt_stratum_replay;
+
+static int mock_notify_ms = 1000;
+static int mock_clean_every = 10;
+static int mock_merkles = 12;
+static double mock_diff = 0.001;
+static int mock_delay_ms;
+static int mock_getwork_ms = 200;
+static int mock_getwork_fail_every;
+
+static pthread_mutex_t mock_lock;
+static struct mock_stats mock_stats;
+static struct timeval mock_tv_start;
+static struct timeval mock_tv_clean;
+static struct pool *mock_pool;
+static SOCKETTYPE mock_listener = INVSOCK;
+
+static struct mock_reply mock_pending[MOCK_MAX_PENDING];
+static int mock_pending_head, mock_pending_count;
+static unsigned int mock_job_id, mock_block;
+static bool mock_authorised;
+
+static double replay_speed = 1;
+static struct replay_event *replay_events;
+static int replay_count;
+static char *replay_subscribe;
+
+static void mock_tv_add_us(struct timeval *tv, uint64_t us)
+{
+	tv->tv_sec += us / 1000000;
+	tv->tv_usec += us % 1000000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+/* Parses notify_ms,clean_every,merkles,diff,delay_ms where any trailing
+ * fields may be left out to keep their defaults */
+char *set_benchmark_stratum(const char *arg)
+{
+	int notify_ms = mock_notify_ms, clean_every = mock_clean_every;
+	int merkles = mock_merkles, delay_ms = mock_delay_ms;
+	double diff = mock_diff;
+
+	if (*arg && sscanf(arg, "%d,%d,%d,%lf,%d", &notify_ms, &clean_every, &merkles, &diff, &delay_ms) < 1)
+		return "Invalid parameters for benchmark-stratum";
+	if (notify_ms < 1 || clean_every < 0 || merkles < 0 || merkles > MOCK_MAX_MERKLES ||
+	    diff <= 0 || delay_ms < 0)
+		return "Invalid value passed to benchmark-stratum";
+
+	mock_notify_ms = notify_ms;
+	mock_clean_every = clean_every;
+	mock_merkles = merkles;
+	mock_diff = diff;
+	mock_delay_ms = delay_ms;
+	free(opt_benchmark_stratum);
+	opt_benchmark_stratum = strdup(arg);
+
+	return NULL;
+}
+
+/* Parses reply_ms,fail_every where fail_every may be left out */
+char *set_benchmark_getwork(const char *arg)
+{
+	int reply_ms = mock_getwork_ms, fail_every = mock_getwork_fail_every;
+
+	if (*arg && sscanf(arg, "%d,%d", &reply_ms, &fail_every) < 1)
+		return "Invalid parameters for benchmark-getwork";
+	if (reply_ms < 0 || fail_every < 0)
+		return "Invalid value passed to benchmark-getwork";
+
+	mock_getwork_ms = reply_ms;
+	mock_getwork_fail_every = fail_every;
+	free(opt_benchmark_getwork);
+	opt_benchmark_getwork = strdup(arg);
+
+	return NULL;
+}
+
+char *set_replay_speed(const char *arg)
+{
+	char *end;
+	double speed = strtod(arg, &end);
+
+	if (end == arg || *end || speed < 0)
+		return "Invalid value passed to replay-speed";
+	replay_speed = speed;
+
+	return NULL;
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+
+	while (bytes--)
+		v = (v << 8) | p[bytes];
+
+	return v;
+}
+
+/* Loads the lines one pool sent us from a capture file. Requests and
+ * notifications are replayed in order, while responses are only used to
+ * answer mining.subscribe the way the pool did */
+static void replay_load(const char *filename)
+{
+	unsigned char hdr[STRATUM_CAPTURE_HDRLEN], magic[sizeof(STRATUM_CAPTURE_MAGIC) - 1];
+	int pool_no = -1, lines = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "rb");
+	if (unlikely(!fp))
+		quit(1, "Failed to open stratum capture %s", filename);
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, STRATUM_CAPTURE_MAGIC, sizeof(magic)))
+		quit(1, "%s is not a stratum capture", filename);
+
+	while (fread(hdr, sizeof(hdr), 1, fp) == 1) {
+		uint32_t len = get_le(hdr + 10, 4);
+		struct replay_event *ev;
+		const char *method;
+		json_t *val, *res_val;
+		json_error_t err;
+		char *line;
+
+		line = malloc(len + 1);
+		if (unlikely(!line))
+			quit(1, "Failed to malloc line in replay_load");
+		if (fread(line, 1, len, fp) != len) {
+			free(line);
+			break;
+		}
+		line[len] = '\0';
+		lines++;
+
+		if (hdr[8] != STRATUM_CAPTURE_RECV || (pool_no >= 0 && hdr[9] != pool_no) ||
+		    !(val = JSON_LOADS(line, &err))) {
+			free(line);
+			continue;
+		}
+		pool_no = hdr[9];
+
+		method = json_string_value(json_object_get(val, "method"));
+		res_val = json_object_get(val, "result");
+		if (!method) {
+			if (!replay_subscribe && json_is_array(res_val))
+				replay_subscribe = json_dumps_ANY(res_val, JSON_COMPACT);
+			free(line);
+		} else if (!strcmp(method, "client.reconnect"))
+			free(line);
+		else {
+			replay_events = realloc(replay_events, sizeof(*replay_events) * (replay_count + 1));
+			if (unlikely(!replay_events))
+				quit(1, "Failed to realloc replay_events in replay_load");
+			ev = &replay_events[replay_count++];
+			ev->usecs = get_le(hdr, 8);
+			ev->line = line;
+			ev->notify = !strcmp(method, "mining.notify");
+			ev->clean = ev->notify && json_is_true(json_array_get(json_object_get(val, "params"), 8));
+		}
+		json_decref(val);
+	}
+	fclose(fp);
+
+	if (!replay_count)
+		quit(1, "No stratum pool messages found in %s", filename);
+	applog(LOG_WARNING, "Stratum replay of %d messages from pool %d of %d captured lines in %s, speed %g",
+	       replay_count, pool_no, lines, filename, replay_speed);
+}
+
+static bool mock_send_raw(SOCKETTYPE sock, const char *s, size_t len)
+{
+	size_t sent = 0;
+	ssize_t n;
+
+	while (sent < len) {
+		n = send(sock, s + sent, len - sent, 0);
+		if (SOCKETFAIL(n))
+			return false;
+		sent += n;
+	}
+
+	return true;
+}
+
+static bool mock_send(SOCKETTYPE sock, const char *s)
+{
+	return mock_send_raw(sock, s, strlen(s)) && mock_send_raw(sock, "\n", 1);
+}
+
+static bool mock_reply(SOCKETTYPE sock, const char *id, const char *result)
+{
+	char s[256];
+
+	snprintf(s, sizeof(s), "{\"id\": %s, \"result\": %s, \"error\": null}", id, result);
+	return mock_send(sock, s);
+}
+
+static bool mock_notify(SOCKETTYPE sock, bool clean)
+{
+	char *s, prev_hash[65], merkle[65];
+	size_t len;
+	int i;
+
+	/* Every word of the previous hash changes so that block detection
+	 * sees a new block whichever word it keys on */
+	if (clean)
+		mock_block++;
+	for (i = 0; i < 8; i++)
+		sprintf(prev_hash + i * 8, "%08x", mock_block);
+
+	len = 512 + sizeof(MOCK_COINBASE1) + sizeof(MOCK_COINBASE2) + mock_merkles * 68;
+	s = malloc(len);
+	if (unlikely(!s))
+		quit(1, "Failed to malloc s in mock_notify");
+	sprintf(s, "{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"%x\", \"%s\", \"%s\", \"%s\", [",
+		++mock_job_id, prev_hash, MOCK_COINBASE1, MOCK_COINBASE2);
+	for (i = 0; i < mock_merkles; i++) {
+		snprintf(merkle, sizeof(merkle), "%08x%08x%048x", mock_job_id, i, 0);
+		sprintf(s + strlen(s), "%s\"%s\"", i ? ", " : "", merkle);
+	}
+	sprintf(s + strlen(s), "], \"00000002\", \"1d00ffff\", \"%08x\", %s]}",
+		(unsigned int)time(NULL), clean ? "true" : "false");
+
+	mutex_lock(&mock_lock);
+	mock_stats.notifies++;
+	if (clean) {
+		mock_stats.cleans++;
+		gettimeofday(&mock_tv_clean, NULL);
+	}
+	mutex_unlock(&mock_lock);
+
+	clean = mock_send(sock, s);
+	free(s);
+
+	return clean;
+}
+
+/* Returns false if the connection should be dropped */
+static bool mock_parse(SOCKETTYPE sock, char *line)
+{
+	json_t *val, *id_val;
+	json_error_t err;
+	const char *method;
+	char *id;
+	bool ret = true;
+
+	val = JSON_LOADS(line, &err);
+	if (!val)
+		return false;
+	method = json_string_value(json_object_get(val, "method"));
+	id_val = json_object_get(val, "id");
+	id = json_dumps_ANY(id_val ? id_val : json_null(), JSON_COMPACT);
+	if (!method)
+		goto out;
+
+	if (!strcmp(method, "mining.subscribe")) {
+		if (replay_subscribe) {
+			char *s = malloc(strlen(replay_subscribe) + strlen(id) + 64);
+
+			if (unlikely(!s))
+				quit(1, "Failed to malloc s in mock_parse");
+			sprintf(s, "{\"id\": %s, \"result\": %s, \"error\": null}", id, replay_subscribe);
+			ret = mock_send(sock, s);
+			free(s);
+		} else
+			ret = mock_reply(sock, id, "[[[\"mining.notify\", \"mock\"]], \"" MOCK_NONCE1 "\", " MOCK_N2SIZE "]");
+	} else if (!strcmp(method, "mining.authorize")) {
+		char s[128];
+
+		ret = mock_reply(sock, id, "true");
+		mock_authorised = true;
+		if (replay_count)
+			goto out;
+		sprintf(s, "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%f]}", mock_diff);
+		if (ret)
+			ret = mock_send(sock, s) && mock_notify(sock, true);
+	} else if (!strcmp(method, "mining.submit")) {
+		mutex_lock(&mock_lock);
+		mock_stats.submits++;
+		mutex_unlock(&mock_lock);
+		if (!mock_delay_ms)
+			ret = mock_reply(sock, id, "true");
+		else if (mock_pending_count < MOCK_MAX_PENDING) {
+			struct mock_reply *reply;
+
+			reply = &mock_pending[(mock_pending_head + mock_pending_count++) % MOCK_MAX_PENDING];
+			snprintf(reply->id, sizeof(reply->id), "%s", id);
+			gettimeofday(&reply->due, NULL);
+			mock_tv_add_us(&reply->due, mock_delay_ms * 1000ULL);
+		}
+	} else if (!json_is_null(id_val) && id_val) {
+		char s[256];
+
+		snprintf(s, sizeof(s), "{\"id\": %s, \"result\": null, \"error\": [20, \"Not supported\", null]}", id);
+		ret = mock_send(sock, s);
+	}
+
+out:
+	free(id);
+	json_decref(val);
+
+	return ret;
+}
+
+static void mock_report(void)
+{
+	struct cgminer_pool_stats *pool_stats = &mock_pool->cgminer_pool_stats;
+	struct mock_stats stats;
+	struct timeval now;
+	double secs;
+
+	gettimeofday(&now, NULL);
+	secs = tdiff(&now, &mock_tv_start);
+	if (secs <= 0)
+		return;
+
+	mutex_lock(&mock_lock);
+	stats = mock_stats;
+	mutex_unlock(&mock_lock);
+
+	if (opt_benchmark_getwork) {
+		applog(LOG_WARNING, "Getwork benchmark over %.0f secs:", secs);
+		applog(LOG_WARNING, " Getwork requests/sec: %.2f (%"PRIu64" failed)",
+		       stats.getworks / secs, stats.getwork_fails);
+		applog(LOG_WARNING, " Most requests in flight: %d", stats.getworks_inflight_max);
+		applog(LOG_WARNING, " Shares/sec: %.2f", stats.submits / secs);
+		return;
+	}
+
+	applog(LOG_WARNING, "Stratum benchmark over %.0f secs:", secs);
+	applog(LOG_WARNING, " Notifies sent: %"PRIu64" (%"PRIu64" clean)", stats.notifies, stats.cleans);
+	applog(LOG_WARNING, " Shares/sec: %.2f", stats.submits / secs);
+	applog(LOG_WARNING, " Work generated/sec: %.2f", pool_stats->stratum_works / secs);
+	if (stats.restarts)
+		applog(LOG_WARNING, " Notify to restart latency: %.3f ms average, %.3f ms max",
+		       stats.restart_total * 1000 / stats.restarts, stats.restart_max * 1000);
+	if (pool_stats->stratum_rtt_count)
+		applog(LOG_WARNING, " Submit RTT: %.3f ms average, %.3f ms min, %.3f ms max",
+		       pool_stats->stratum_rtt_rolling * 1000, pool_stats->stratum_rtt_min * 1000,
+		       pool_stats->stratum_rtt_max * 1000);
+}
+
+/* Called by the stratum thread when it restarts work after a clean notify */
+void mock_stratum_restarted(void)
+{
+	struct timeval now;
+	double latency;
+
+	if (!opt_benchmark_stratum && !opt_stratum_replay)
+		return;
+
+	gettimeofday(&now, NULL);
+	mutex_lock(&mock_lock);
+	if (mock_tv_clean.tv_sec) {
+		latency = tdiff(&now, &mock_tv_clean);
+		mock_stats.restarts++;
+		mock_stats.restart_total += latency;
+		if (latency > mock_stats.restart_max)
+			mock_stats.restart_max = latency;
+		mock_tv_clean.tv_sec = 0;
+	}
+	mutex_unlock(&mock_lock);
+}
+
+void mock_stratum_summary(void)
+{
+	if (mock_pool)
+		mock_report();
+}
+
+/* Sends the replayed messages that are due and sets when the next one is.
+ * The run ends a couple of seconds after the last one. */
+static bool replay_due(SOCKETTYPE sock, int *next_event, struct timeval *start,
+		       struct timeval *now, struct timeval *due)
+{
+	static bool done;
+	uint64_t offset;
+
+	if (done) {
+		applog(LOG_WARNING, "Stratum replay complete");
+		kill_work();
+	}
+
+	while (*next_event < replay_count) {
+		struct replay_event *ev = &replay_events[*next_event];
+
+		offset = 0;
+		if (replay_speed)
+			offset = (ev->usecs - replay_events[0].usecs) / replay_speed;
+		*due = *start;
+		mock_tv_add_us(due, offset);
+		if (timercmp(due, now, >))
+			return true;
+
+		mutex_lock(&mock_lock);
+		if (ev->notify)
+			mock_stats.notifies++;
+		if (ev->clean) {
+			mock_stats.cleans++;
+			gettimeofday(&mock_tv_clean, NULL);
+		}
+		mutex_unlock(&mock_lock);
+		if (!mock_send(sock, ev->line))
+			return false;
+		++*next_event;
+	}
+
+	done = true;
+	*due = *now;
+	due->tv_sec += 2;
+
+	return true;
+}
+
+static void mock_serve(SOCKETTYPE sock)
+{
+	struct timeval now, next_notify, next_report;
+	char buf[MOCK_BUFSIZ], *line, *eol;
+	struct timeval replay_start;
+	bool started = false;
+	size_t buflen = 0;
+	int notifies = 0, next_event = 0;
+	ssize_t n;
+
+	mock_pending_head = mock_pending_count = 0;
+	mock_authorised = false;
+
+	while (42) {
+		struct timeval timeout, *due;
+		fd_set rd;
+
+		gettimeofday(&now, NULL);
+		/* Work flows once authorised, start the clocks */
+		if (!started && mock_authorised) {
+			started = true;
+			next_notify = replay_start = now;
+			if (!replay_count)
+				mock_tv_add_us(&next_notify, mock_notify_ms * 1000ULL);
+			next_report = now;
+			next_report.tv_sec += MOCK_REPORT_SECS;
+		}
+		/* Send the delayed share results that are due */
+		while (mock_pending_count) {
+			struct mock_reply *reply = &mock_pending[mock_pending_head];
+
+			if (timercmp(&reply->due, &now, >))
+				break;
+			if (!mock_reply(sock, reply->id, "true"))
+				return;
+			mock_pending_head = (mock_pending_head + 1) % MOCK_MAX_PENDING;
+			mock_pending_count--;
+		}
+		if (started && replay_count && !timercmp(&next_notify, &now, >)) {
+			if (!replay_due(sock, &next_event, &replay_start, &now, &next_notify))
+				return;
+		} else if (started && !timercmp(&next_notify, &now, >)) {
+			bool clean = mock_clean_every && !(++notifies % mock_clean_every);
+
+			if (!mock_notify(sock, clean))
+				return;
+			next_notify = now;
+			mock_tv_add_us(&next_notify, mock_notify_ms * 1000ULL);
+		}
+		if (started && !timercmp(&next_report, &now, >)) {
+			mock_report();
+			next_report = now;
+			next_report.tv_sec += MOCK_REPORT_SECS;
+		}
+
+		due = NULL;
+		if (started) {
+			due = &next_notify;
+			if (timercmp(&next_report, due, <))
+				due = &next_report;
+		}
+		if (mock_pending_count && (!due || timercmp(&mock_pending[mock_pending_head].due, due, <)))
+			due = &mock_pending[mock_pending_head].due;
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if (due && timercmp(due, &now, >))
+			timersub(due, &now, &timeout);
+		else if (due)
+			timerclear(&timeout);
+
+		FD_ZERO(&rd);
+		FD_SET(sock, &rd);
+		if (select(sock + 1, &rd, NULL, NULL, &timeout) < 1)
+			continue;
+
+		n = recv(sock, buf + buflen, sizeof(buf) - 1 - buflen, 0);
+		if (n <= 0)
+			return;
+		buflen += n;
+		buf[buflen] = '\0';
+
+		line = buf;
+		while ((eol = strchr(line, '\n'))) {
+			*eol = '\0';
+			if (*line && !mock_parse(sock, line))
+				return;
+			line = eol + 1;
+		}
+		buflen = strlen(line);
+		memmove(buf, line, buflen + 1);
+		if (buflen >= sizeof(buf) - 1)
+			return;
+	}
+}
+
+static void *mock_stratum_thread(__maybe_unused void *userdata)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	SOCKETTYPE c;
+
+	pthread_detach(pthread_self());
+	RenameThread("mock_stratum");
+
+	while (42) {
+		clisiz = sizeof(cli);
+		c = accept(mock_listener, (struct sockaddr *)(&cli), &clisiz);
+		if (SOCKETFAIL(c)) {
+			nmsleep(100);
+			continue;
+		}
+		applog(LOG_DEBUG, "Mock stratum pool connection accepted");
+		mock_serve(c);
+		CLOSESOCKET(c);
+		applog(LOG_DEBUG, "Mock stratum pool connection closed");
+	}
+
+	return NULL;
+}
+
+/* Starts the mock pool on a free local port and points pool at it */
+void mock_stratum_start(struct pool *pool)
+{
+	struct sockaddr_in serv;
+	socklen_t servsiz = sizeof(serv);
+	pthread_t pth;
+	char url[64];
+
+	mutex_init(&mock_lock);
+
+	mock_listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (mock_listener == INVSOCK)
+		quit(1, "Mock stratum socket failed (%s)", SOCKERRMSG);
+
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (SOCKETFAIL(bind(mock_listener, (struct sockaddr *)(&serv), sizeof(serv))) ||
+	    SOCKETFAIL(listen(mock_listener, 1)) ||
+	    SOCKETFAIL(getsockname(mock_listener, (struct sockaddr *)(&serv), &servsiz)))
+		quit(1, "Mock stratum bind failed (%s)", SOCKERRMSG);
+
+	sprintf(url, "stratum+tcp://127.0.0.1:%d", ntohs(serv.sin_port));
+	if (!detect_stratum(pool, url))
+		quit(1, "Mock stratum pool setup failed");
+	pool->rpc_user = strdup("benchmark");
+	pool->rpc_pass = strdup("x");
+	mock_pool = pool;
+	gettimeofday(&mock_tv_start, NULL);
+
+	if (opt_stratum_replay)
+		replay_load(opt_stratum_replay);
+	else
+		applog(LOG_WARNING, "Stratum benchmark: notify every %d ms, clean every %d, %d merkles, diff %g, reply delay %d ms",
+		       mock_notify_ms, mock_clean_every, mock_merkles, mock_diff, mock_delay_ms);
+
+	if (unlikely(pthread_create(&pth, NULL, mock_stratum_thread, NULL)))
+		quit(1, "Mock stratum thread create failed");
+}
+
+/* A getwork target anything with a zero top byte meets, so shares flow */
+#define MOCK_GETWORK_TARGET	"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff00"
+
+static bool mock_http_reply(SOCKETTYPE sock, int code, const char *body)
+{
+	char hdr[256];
+	size_t len = strlen(body);
+
+	snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+		 "Content-Length: %lu\r\n\r\n", code, code == 200 ? "OK" : "Internal Server Error",
+		 (unsigned long)len);
+	return mock_send_raw(sock, hdr, strlen(hdr)) && mock_send_raw(sock, body, len);
+}
+
+/* Answers one JSON-RPC request, returns false if the connection should be
+ * dropped */
+static bool mock_getwork_request(SOCKETTYPE sock, const char *body)
+{
+	static unsigned int serial;
+	json_t *val, *params;
+	json_error_t err;
+	const char *method;
+	char *id, *s;
+	unsigned int n;
+	bool fail, ret;
+
+	val = JSON_LOADS(body, &err);
+	if (!val)
+		return false;
+	method = json_string_value(json_object_get(val, "method"));
+	params = json_object_get(val, "params");
+	id = json_dumps_ANY(json_object_get(val, "id") ? json_object_get(val, "id") : json_null(), JSON_COMPACT);
+	s = malloc(1024);
+	if (unlikely(!s))
+		quit(1, "Failed to malloc s in mock_getwork_request");
+
+	if (!method || strcmp(method, "getwork")) {
+		/* getblocktemplate included, so the miner falls back to getwork */
+		snprintf(s, 1024, "{\"id\": %s, \"result\": null, \"error\": {\"code\": -32601, \"message\": \"Method not found\"}}", id);
+		ret = mock_http_reply(sock, 200, s);
+	} else if (json_array_size(params)) {
+		mutex_lock(&mock_lock);
+		mock_stats.submits++;
+		mutex_unlock(&mock_lock);
+		snprintf(s, 1024, "{\"id\": %s, \"result\": true, \"error\": null}", id);
+		ret = mock_http_reply(sock, 200, s);
+	} else {
+		mutex_lock(&mock_lock);
+		n = ++serial;
+		mock_stats.getworks++;
+		if (++mock_stats.getworks_inflight > mock_stats.getworks_inflight_max)
+			mock_stats.getworks_inflight_max = mock_stats.getworks_inflight;
+		fail = mock_getwork_fail_every && !(n % mock_getwork_fail_every);
+		if (fail)
+			mock_stats.getwork_fails++;
+		mutex_unlock(&mock_lock);
+
+		nmsleep(mock_getwork_ms);
+
+		/* Each request gets its own merkle root; the rest is SHA256
+		 * padding for the 128 byte getwork data */
+		snprintf(s, 1024, "{\"id\": %s, \"error\": null, \"result\": {\"data\": \""
+			 "00000002%064x%08x%056x%08x1d00ffff00000000"
+			 "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000"
+			 "\", \"target\": \"" MOCK_GETWORK_TARGET "\"}}",
+			 id, mock_block, n, 0, (unsigned int)time(NULL));
+		if (fail)
+			ret = mock_http_reply(sock, 500, "{\"id\": null, \"result\": null, \"error\": \"Mock failure\"}");
+		else
+			ret = mock_http_reply(sock, 200, s);
+
+		mutex_lock(&mock_lock);
+		--mock_stats.getworks_inflight;
+		mutex_unlock(&mock_lock);
+	}
+
+	free(s);
+	free(id);
+	json_decref(val);
+
+	return ret;
+}
+
+/* Finds the first complete request in buf and returns its body, to be freed,
+ * with *used set to how much of buf it took, or NULL if more is needed.
+ * curl sends JSON-RPC bodies chunked */
+static char *mock_http_body(char *buf, size_t buflen, size_t *used)
+{
+	char *end, *hdr, *p, *eol, *body;
+	size_t len = 0, bodylen = 0;
+	bool chunked = false;
+
+	end = strstr(buf, "\r\n\r\n");
+	if (!end)
+		return NULL;
+	for (hdr = strstr(buf, "\r\n"); hdr && hdr < end; hdr = strstr(hdr + 2, "\r\n")) {
+		if (!strncasecmp(hdr + 2, "Content-Length:", 15))
+			len = strtoul(hdr + 17, NULL, 10);
+		else if (!strncasecmp(hdr + 2, "Transfer-Encoding: chunked", 26))
+			chunked = true;
+	}
+	p = end + 4;
+
+	body = malloc(buflen + 1);
+	if (unlikely(!body))
+		quit(1, "Failed to malloc body in mock_http_body");
+	if (!chunked) {
+		if (p + len > buf + buflen)
+			goto more;
+		memcpy(body, p, len);
+		body[len] = '\0';
+		*used = p + len - buf;
+		return body;
+	}
+
+	while ((eol = strstr(p, "\r\n"))) {
+		len = strtoul(p, NULL, 16);
+		p = eol + 2;
+		if (p + len + 2 > buf + buflen)
+			break;
+		if (!len) {
+			body[bodylen] = '\0';
+			*used = p + 2 - buf;
+			return body;
+		}
+		memcpy(body + bodylen, p, len);
+		bodylen += len;
+		p += len + 2;
+	}
+more:
+	free(body);
+	return NULL;
+}
+
+/* One thread per connection, since curl keeps several open and a slow reply
+ * must not hold up the others */
+static void *mock_getwork_conn(void *userdata)
+{
+	SOCKETTYPE sock = *(SOCKETTYPE *)userdata;
+	char buf[MOCK_BUFSIZ], *body;
+	size_t buflen = 0, used;
+	ssize_t n;
+
+	free(userdata);
+	pthread_detach(pthread_self());
+	RenameThread("mock_getwork");
+
+	while (42) {
+		buf[buflen] = '\0';
+		body = mock_http_body(buf, buflen, &used);
+		if (body) {
+			bool ok = mock_getwork_request(sock, body);
+
+			free(body);
+			if (!ok)
+				break;
+			buflen -= used;
+			memmove(buf, buf + used, buflen);
+			continue;
+		}
+		if (buflen >= sizeof(buf) - 1)
+			break;
+		n = recv(sock, buf + buflen, sizeof(buf) - 1 - buflen, 0);
+		if (n <= 0)
+			break;
+		buflen += n;
+	}
+
+	CLOSESOCKET(sock);
+	return NULL;
+}
+
+static void *mock_getwork_thread(__maybe_unused void *userdata)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	SOCKETTYPE *c;
+	pthread_t pth;
+
+	pthread_detach(pthread_self());
+	RenameThread("mock_getwork");
+
+	while (42) {
+		c = malloc(sizeof(*c));
+		if (unlikely(!c))
+			quit(1, "Failed to malloc c in mock_getwork_thread");
+		clisiz = sizeof(cli);
+		*c = accept(mock_listener, (struct sockaddr *)(&cli), &clisiz);
+		if (SOCKETFAIL(*c)) {
+			free(c);
+			nmsleep(100);
+			continue;
+		}
+		if (unlikely(pthread_create(&pth, NULL, mock_getwork_conn, c)))
+			quit(1, "Mock getwork connection thread create failed");
+	}
+
+	return NULL;
+}
+
+/* Starts the mock getwork pool on a free local port and points pool at it */
+void mock_getwork_start(struct pool *pool)
+{
+	struct sockaddr_in serv;
+	socklen_t servsiz = sizeof(serv);
+	pthread_t pth;
+	char url[64];
+
+	mutex_init(&mock_lock);
+
+	mock_listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (mock_listener == INVSOCK)
+		quit(1, "Mock getwork socket failed (%s)", SOCKERRMSG);
+
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (SOCKETFAIL(bind(mock_listener, (struct sockaddr *)(&serv), sizeof(serv))) ||
+	    SOCKETFAIL(listen(mock_listener, 16)) ||
+	    SOCKETFAIL(getsockname(mock_listener, (struct sockaddr *)(&serv), &servsiz)))
+		quit(1, "Mock getwork bind failed (%s)", SOCKERRMSG);
+
+	sprintf(url, "http://127.0.0.1:%d", ntohs(serv.sin_port));
+	pool->rpc_url = strdup(url);
+	pool->rpc_user = strdup("benchmark");
+	pool->rpc_pass = strdup("x");
+	mock_pool = pool;
+	gettimeofday(&mock_tv_start, NULL);
+
+	applog(LOG_WARNING, "Getwork benchmark: reply after %d ms, fail every %d", mock_getwork_ms, mock_getwork_fail_every);
+
+	if (unlikely(pthread_create(&pth, NULL, mock_getwork_thread, NULL)))
+		quit(1, "Mock getwork thread create failed");
+}
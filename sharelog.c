@@ -0,0 +1,420 @@
+/*
+ * Copyright 2011-2013 Luke Dashjr
+ * Copyright 2015-2017 John Doering
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Share log for --sharelog.  Share results only copy what the log needs into a
+ * record and push it onto a lock-free list; a writer thread picks the list up
+ * every SHARELOG_FLUSH_MS, formats the batch and writes it with one flush, so
+ * submission never waits for the disk.  Records go out as the CSV documented
+ * in the README or, with --sharelog-binary, as compact binary records that
+ * --sharelog-csv turns back into the same CSV.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "compat.h"
+#include "miner.h"
+#include "util.h"
+
+#define SHARELOG_FLUSH_MS	500
+#define SHARELOG_MAGIC		"NSGSHLG1"
+#define SHARELOG_MAGIC_LEN	8
+
+struct sharelog_rec {
+	struct sharelog_rec *next;
+	uint64_t when;
+	uint32_t device_id;
+	uint32_t thr_id;
+	char dev[8];
+	char disposition[40];
+	unsigned char target[32];
+	unsigned char hash[32];
+	unsigned char data[128];
+	char url[];
+};
+
+/* Binary record: a little endian length of what follows, then when,
+ * device_id, thr_id, target, hash, data and the dev, disposition and url
+ * strings, each after a one or two byte length */
+#define SHARELOG_BIN_FIXED	(8 + 4 + 4 + 32 + 32 + 128)
+/* Longest url that keeps the whole record within its 16 bit length */
+#define SHARELOG_URL_MAX	(65535 - SHARELOG_BIN_FIXED - 1 - 255 - 1 - 255 - 2)
+#define SHARELOG_BIN_MAX	(2 + 65535)
+
+bool opt_sharelog_binary;
+static int opt_sharelog_rotate_mb;
+static int opt_sharelog_rotate_secs;
+
+static pthread_mutex_t sharelog_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *sharelog_file;
+static char *sharelog_name;
+static time_t sharelog_opened;
+static bool sharelog_empty;
+static struct sharelog_rec *sharelog_pending;
+
+void sharelog(const char *disposition, const struct work *work)
+{
+	struct sharelog_rec *rec;
+	struct cgpu_info *cgpu;
+	const char *url;
+	size_t urllen;
+
+	if (!sharelog_file)
+		return;
+
+	cgpu = thr_info[work->thr_id].cgpu;
+	url = work->pool->rpc_url;
+	urllen = strlen(url);
+	if (urllen > SHARELOG_URL_MAX)
+		urllen = SHARELOG_URL_MAX;
+
+	rec = malloc(sizeof(*rec) + urllen + 1);
+	if (unlikely(!rec)) {
+		applog(LOG_ERR, "Failed to malloc sharelog record");
+		return;
+	}
+	rec->when = work->tv_work_found.tv_sec;
+	rec->device_id = cgpu->device_id;
+	rec->thr_id = work->thr_id;
+	snprintf(rec->dev, sizeof(rec->dev), "%s", cgpu->api->name);
+	snprintf(rec->disposition, sizeof(rec->disposition), "%s", disposition);
+	memcpy(rec->target, work->target, sizeof(rec->target));
+	memcpy(rec->hash, work->hash, sizeof(rec->hash));
+	memcpy(rec->data, work->data, sizeof(rec->data));
+	memcpy(rec->url, url, urllen);
+	rec->url[urllen] = '\0';
+
+	do
+		rec->next = sharelog_pending;
+	while (!__sync_bool_compare_and_swap(&sharelog_pending, rec->next, rec));
+}
+
+static int sharelog_csv(char *s, size_t siz, const struct sharelog_rec *rec)
+{
+	char target[sizeof(rec->target) * 2 + 1];
+	char hash[sizeof(rec->hash) * 2 + 1];
+	char data[sizeof(rec->data) * 2 + 1];
+
+	_bin2hex(target, rec->target, sizeof(rec->target));
+	_bin2hex(hash, rec->hash, sizeof(rec->hash));
+	_bin2hex(data, rec->data, sizeof(rec->data));
+
+	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+	return snprintf(s, siz, "%lu,%s,%s,%s,%s%u,%u,%s,%s\n",
+			(unsigned long int)rec->when, rec->disposition, target, rec->url,
+			rec->dev, rec->device_id, rec->thr_id, hash, data);
+}
+
+static unsigned char *sharelog_put(unsigned char *p, const void *v, size_t len)
+{
+	memcpy(p, v, len);
+	return p + len;
+}
+
+static size_t sharelog_bin(unsigned char *buf, const struct sharelog_rec *rec)
+{
+	size_t devlen = strlen(rec->dev);
+	size_t displen = strlen(rec->disposition);
+	size_t urllen = strlen(rec->url);
+	unsigned char *p = buf + 2;
+	uint64_t when = htole64(rec->when);
+	uint32_t device_id = htole32(rec->device_id);
+	uint32_t thr_id = htole32(rec->thr_id);
+	uint16_t len;
+
+	p = sharelog_put(p, &when, 8);
+	p = sharelog_put(p, &device_id, 4);
+	p = sharelog_put(p, &thr_id, 4);
+	p = sharelog_put(p, rec->target, 32);
+	p = sharelog_put(p, rec->hash, 32);
+	p = sharelog_put(p, rec->data, 128);
+	*p++ = devlen;
+	p = sharelog_put(p, rec->dev, devlen);
+	*p++ = displen;
+	p = sharelog_put(p, rec->disposition, displen);
+	*p++ = urllen & 0xff;
+	*p++ = urllen >> 8;
+	p = sharelog_put(p, rec->url, urllen);
+
+	len = htole16(p - buf - 2);
+	memcpy(buf, &len, 2);
+	return p - buf;
+}
+
+static void sharelog_opened_now(void)
+{
+	sharelog_opened = time(NULL);
+	/* Pipes and empty files need the binary header */
+	sharelog_empty = fseek(sharelog_file, 0, SEEK_END) || ftell(sharelog_file) <= 0;
+}
+
+char *set_sharelog(char *arg)
+{
+	char *r = "";
+	long int i = strtol(arg, &r, 10);
+
+	if ((!*r) && i >= 0 && i <= INT_MAX) {
+		sharelog_file = fdopen((int)i, "a");
+		if (!sharelog_file)
+			applog(LOG_ERR, "Failed to open fd %u for share log", (unsigned int)i);
+	} else if (!strcmp(arg, "-")) {
+		sharelog_file = stdout;
+		if (!sharelog_file)
+			applog(LOG_ERR, "Standard output missing for share log");
+	} else {
+		sharelog_file = fopen(arg, "a");
+		if (!sharelog_file)
+			applog(LOG_ERR, "Failed to open %s for share log", arg);
+		else
+			sharelog_name = strdup(arg);
+	}
+
+	if (sharelog_file)
+		sharelog_opened_now();
+
+	return NULL;
+}
+
+char *set_sharelog_rotate(const char *arg)
+{
+	int mb, secs = 0;
+
+	if (sscanf(arg, "%d,%d", &mb, &secs) < 1 || mb < 0 || secs < 0)
+		return "Invalid value passed to sharelog-rotate";
+
+	opt_sharelog_rotate_mb = mb;
+	opt_sharelog_rotate_secs = secs;
+
+	return NULL;
+}
+
+/* Only files opened by name can be rotated; the old one is renamed after the
+ * time it was rotated */
+static void sharelog_rotate(void)
+{
+	char newname[PATH_MAX];
+	char stamp[20];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(newname, sizeof(newname), "%s.%s", sharelog_name, stamp);
+
+	fclose(sharelog_file);
+	if (rename(sharelog_name, newname))
+		applog(LOG_ERR, "Failed to rename share log %s to %s", sharelog_name, newname);
+	sharelog_file = fopen(sharelog_name, "a");
+	if (!sharelog_file) {
+		applog(LOG_ERR, "Failed to reopen %s for share log, share logging stopped", sharelog_name);
+		return;
+	}
+	sharelog_opened_now();
+	applog(LOG_INFO, "Rotated share log to %s", newname);
+}
+
+static bool sharelog_rotate_due(void)
+{
+	long pos;
+
+	if (!sharelog_name || sharelog_empty)
+		return false;
+	if (opt_sharelog_rotate_secs && time(NULL) - sharelog_opened >= opt_sharelog_rotate_secs)
+		return true;
+	if (opt_sharelog_rotate_mb) {
+		pos = ftell(sharelog_file);
+		if (pos >= (long)opt_sharelog_rotate_mb * 1024 * 1024)
+			return true;
+	}
+
+	return false;
+}
+
+/* Writes out everything logged so far */
+void sharelog_flush(void)
+{
+	struct sharelog_rec *rec, *next, *batch = NULL;
+	static unsigned char *buf;
+	bool wrote = false;
+	size_t len;
+
+	mutex_lock(&sharelog_lock);
+	if (!sharelog_file)
+		goto out_unlock;
+
+	if (sharelog_rotate_due()) {
+		sharelog_rotate();
+		if (!sharelog_file)
+			goto out_unlock;
+	}
+
+	/* Taken newest first, so turn it round */
+	rec = __atomic_exchange_n(&sharelog_pending, NULL, __ATOMIC_ACQUIRE);
+	for (; rec; rec = next) {
+		next = rec->next;
+		rec->next = batch;
+		batch = rec;
+	}
+	if (!batch)
+		goto out_unlock;
+
+	if (!buf) {
+		buf = malloc(SHARELOG_BIN_MAX);
+		if (unlikely(!buf))
+			quit(1, "Failed to malloc sharelog buffer");
+	}
+
+	if (opt_sharelog_binary && sharelog_empty)
+		fwrite(SHARELOG_MAGIC, SHARELOG_MAGIC_LEN, 1, sharelog_file);
+	sharelog_empty = false;
+
+	for (rec = batch; rec; rec = next) {
+		int rv;
+
+		next = rec->next;
+		if (opt_sharelog_binary)
+			len = sharelog_bin(buf, rec);
+		else {
+			rv = sharelog_csv((char *)buf, SHARELOG_BIN_MAX, rec);
+			len = rv < SHARELOG_BIN_MAX ? rv : SHARELOG_BIN_MAX - 1;
+		}
+		if (fwrite(buf, len, 1, sharelog_file) != 1)
+			applog(LOG_ERR, "sharelog fwrite error");
+		free(rec);
+		wrote = true;
+	}
+	if (wrote)
+		fflush(sharelog_file);
+
+out_unlock:
+	mutex_unlock(&sharelog_lock);
+}
+
+static void *sharelog_thread(void __maybe_unused *userdata)
+{
+	RenameThread("sharelog");
+
+	while (42) {
+		nmsleep(SHARELOG_FLUSH_MS);
+		sharelog_flush();
+	}
+
+	return NULL;
+}
+
+void sharelog_start(void)
+{
+	pthread_t pth;
+
+	if (!sharelog_file)
+		return;
+	if ((opt_sharelog_rotate_mb || opt_sharelog_rotate_secs) && !sharelog_name)
+		applog(LOG_WARNING, "Share log is not a named file, --sharelog-rotate ignored");
+
+	if (unlikely(pthread_create(&pth, NULL, sharelog_thread, NULL)))
+		quit(1, "Share log thread create failed");
+	pthread_detach(pth);
+}
+
+static bool sharelog_get(FILE *f, void *v, size_t len)
+{
+	return fread(v, len, 1, f) == 1;
+}
+
+/* --sharelog-csv: print a binary share log as CSV and exit */
+char *sharelog_to_csv(const char *arg)
+{
+	char magic[SHARELOG_MAGIC_LEN];
+	unsigned char *buf, *p;
+	uint16_t reclen;
+	char *csv;
+	FILE *f;
+
+	f = fopen(arg, "rb");
+	if (!f)
+		return "Failed to open binary share log";
+	if (!sharelog_get(f, magic, sizeof(magic)) || memcmp(magic, SHARELOG_MAGIC, sizeof(magic))) {
+		fclose(f);
+		return "Not a binary share log";
+	}
+
+	buf = malloc(SHARELOG_BIN_MAX);
+	csv = malloc(SHARELOG_BIN_MAX);
+	if (unlikely(!buf || !csv))
+		quit(1, "Failed to malloc sharelog buffer");
+
+	while (sharelog_get(f, &reclen, 2)) {
+		struct sharelog_rec *rec;
+		size_t devlen, displen, urllen;
+		unsigned char *end;
+		uint64_t when;
+		uint32_t u32;
+
+		reclen = le16toh(reclen);
+		if (reclen < SHARELOG_BIN_FIXED + 4 || !sharelog_get(f, buf, reclen))
+			goto truncated;
+		end = buf + reclen;
+
+		p = buf + SHARELOG_BIN_FIXED;
+		devlen = *p++;
+		if (p + devlen + 1 > end)
+			goto truncated;
+		p += devlen;
+		displen = *p++;
+		if (p + displen + 2 > end)
+			goto truncated;
+		p += displen;
+		urllen = p[0] | (p[1] << 8);
+		p += 2;
+		if (p + urllen != end)
+			goto truncated;
+
+		rec = calloc(1, sizeof(*rec) + urllen + 1);
+		if (unlikely(!rec))
+			quit(1, "Failed to calloc sharelog record");
+		p = buf;
+		memcpy(&when, p, 8);
+		rec->when = le64toh(when);
+		memcpy(&u32, p + 8, 4);
+		rec->device_id = le32toh(u32);
+		memcpy(&u32, p + 12, 4);
+		rec->thr_id = le32toh(u32);
+		memcpy(rec->target, p + 16, 32);
+		memcpy(rec->hash, p + 48, 32);
+		memcpy(rec->data, p + 80, 128);
+		p += SHARELOG_BIN_FIXED + 1;
+		memcpy(rec->dev, p, devlen < sizeof(rec->dev) ? devlen : sizeof(rec->dev) - 1);
+		p += devlen + 1;
+		memcpy(rec->disposition, p, displen < sizeof(rec->disposition) ? displen : sizeof(rec->disposition) - 1);
+		p += displen + 2;
+		memcpy(rec->url, p, urllen);
+
+		sharelog_csv(csv, SHARELOG_BIN_MAX, rec);
+		fputs(csv, stdout);
+		free(rec);
+	}
+
+	fclose(f);
+	exit(0);
+
+truncated:
+	fclose(f);
+	fprintf(stderr, "Binary share log %s is truncated or corrupt\n", arg);
+	exit(1);
+}
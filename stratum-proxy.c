@@ -0,0 +1,601 @@
+/*
+ * Copyright 2015-2017 John Doering
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Local stratum proxy: downstream miners connect to us instead of the pool.
+ * Each gets a slice of the upstream extranonce2 space as its own extranonce1
+ * and its shares are forwarded upstream over our single pool connection.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <jansson.h>
+
+#include "compat.h"
+#include "miner.h"
+#include "util.h"
+#include "uthash.h"
+
+#define PROXY_MAX_CLIENTS	256
+#define PROXY_BUFSIZ		4096
+#define PROXY_QUEUE		16
+/* Upstream request ids used for forwarded shares, kept clear of swork_id */
+#define PROXY_ID_BASE		0x40000000
+#define PROXY_ID_MASK		0x3fffffff
+/* Forget forwarded shares the pool never answered after this long */
+#define PROXY_SHARE_EXPIRY	120
+
+struct proxy_client {
+	SOCKETTYPE sock;
+	unsigned int serial;
+	char buf[PROXY_BUFSIZ];
+	size_t buflen;
+	bool subscribed;
+	bool authorised;
+	double diff;
+	unsigned int accepted;
+	unsigned int rejected;
+};
+
+struct proxy_share {
+	UT_hash_handle hh;
+	int id;
+	int slot;
+	unsigned int serial;
+	json_t *reqid;
+	time_t sent;
+};
+
+static pthread_mutex_t proxy_lock;
+static struct proxy_client clients[PROXY_MAX_CLIENTS];
+static struct proxy_share *proxy_shares;
+static unsigned int proxy_serial;
+static int proxy_share_id;
+static struct pool *proxy_pool;
+static char *proxy_nonce1;
+static int proxy_clients;
+
+/* The extranonce1 suffix handed to a client slot; 0 is kept for local work */
+static inline unsigned int slot_prefix(int slot)
+{
+	return slot + 1;
+}
+
+/* The upstream extranonce2 must leave room for the client's own */
+static inline bool upstream_usable(struct pool *pool)
+{
+	return pool && pool->has_stratum && pool->stratum_active && pool->stratum_notify &&
+	       pool->nonce1 && pool->n2size > STRATUM_PROXY_N1_BYTES;
+}
+
+static inline bool is_hex(const char *s, size_t len)
+{
+	return strlen(s) == len && strspn(s, "0123456789abcdefABCDEF") == len;
+}
+
+static void __drop_client(int slot)
+{
+	struct proxy_client *client = &clients[slot];
+
+	if (client->sock == INVSOCK)
+		return;
+	applog(LOG_INFO, "Stratum proxy client %d disconnected (%u accepted, %u rejected)",
+	       slot, client->accepted, client->rejected);
+	CLOSESOCKET(client->sock);
+	client->sock = INVSOCK;
+	--proxy_clients;
+}
+
+/* Sends one line to a client. The socket is non-blocking, and a client that
+ * cannot keep up is dropped rather than stalling the pool connection. */
+static bool __client_send(int slot, const char *s)
+{
+	struct proxy_client *client = &clients[slot];
+	size_t len = strlen(s), sent = 0;
+	ssize_t n;
+
+	while (sent < len) {
+		n = send(client->sock, s + sent, len - sent, 0);
+		if (SOCKETFAIL(n)) {
+			applog(LOG_DEBUG, "Stratum proxy client %d send failed: %s", slot, SOCKERRMSG);
+			__drop_client(slot);
+			return false;
+		}
+		sent += n;
+	}
+	n = send(client->sock, "\n", 1, 0);
+	if (SOCKETFAIL(n) || n != 1) {
+		__drop_client(slot);
+		return false;
+	}
+
+	return true;
+}
+
+static void __client_reply(int slot, json_t *id, json_t *result, json_t *err)
+{
+	json_t *val = json_object();
+	char *s;
+
+	json_object_set(val, "id", id ? id : json_null());
+	json_object_set(val, "result", result ? result : json_null());
+	json_object_set(val, "error", err ? err : json_null());
+	s = json_dumps(val, JSON_COMPACT);
+	json_decref(val);
+	__client_send(slot, s);
+	free(s);
+}
+
+static void __client_error(int slot, json_t *id, int code, const char *msg)
+{
+	json_t *err = json_pack("[iso]", code, msg, json_null());
+
+	__client_reply(slot, id, NULL, err);
+	json_decref(err);
+}
+
+/* Builds the mining.notify for the current upstream job, forwarded as is
+ * since the coinbase only differs in the extranonce */
+static char *upstream_notify(struct pool *pool)
+{
+	json_t *params, *merkles, *val;
+	char *s;
+	int i;
+
+	mutex_lock(&pool->pool_lock);
+	merkles = json_array();
+	for (i = 0; i < pool->swork.merkles; i++)
+		json_array_append_new(merkles, json_string(pool->swork.merkle[i]));
+	params = json_pack("[sssso sssb]",
+			   pool->swork.job_id, pool->swork.prev_hash,
+			   pool->swork.coinbase1, pool->swork.coinbase2, merkles,
+			   pool->swork.bbversion, pool->swork.nbit, pool->swork.ntime,
+			   !pool->submit_old);
+	mutex_unlock(&pool->pool_lock);
+
+	val = json_pack("{s:o,s:s,s:o}", "id", json_null(), "method", "mining.notify", "params", params);
+	s = json_dumps(val, JSON_COMPACT);
+	json_decref(val);
+
+	return s;
+}
+
+static void __client_set_diff(int slot, double diff)
+{
+	char s[128];
+
+	if (clients[slot].diff == diff)
+		return;
+	clients[slot].diff = diff;
+	sprintf(s, "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%f]}", diff);
+	__client_send(slot, s);
+}
+
+/* Clients hold a slice of the old extranonce after a pool switch or an
+ * unresumed reconnect, so make them all subscribe again, except for keep */
+static void __check_upstream(struct pool *pool, int keep)
+{
+	int slot;
+
+	if (proxy_pool == pool && proxy_nonce1 && !strcmp(proxy_nonce1, pool->nonce1))
+		return;
+
+	if (proxy_clients > (keep >= 0))
+		applog(LOG_NOTICE, "Stratum proxy upstream extranonce changed, reconnecting clients");
+	for (slot = 0; slot < PROXY_MAX_CLIENTS; slot++)
+		if (slot != keep)
+			__drop_client(slot);
+	proxy_pool = pool;
+	free(proxy_nonce1);
+	proxy_nonce1 = strdup(pool->nonce1);
+}
+
+/* Called from the stratum thread for each notify from the current pool */
+void stratum_proxy_notify(struct pool *pool)
+{
+	char *notify;
+	double diff;
+	int slot;
+
+	if (!opt_stratum_proxy || !upstream_usable(pool))
+		return;
+
+	notify = upstream_notify(pool);
+	diff = pool->swork.diff;
+
+	mutex_lock(&proxy_lock);
+	__check_upstream(pool, -1);
+	for (slot = 0; slot < PROXY_MAX_CLIENTS; slot++) {
+		if (clients[slot].sock == INVSOCK || !clients[slot].subscribed)
+			continue;
+		__client_set_diff(slot, diff);
+		if (clients[slot].sock != INVSOCK)
+			__client_send(slot, notify);
+	}
+	mutex_unlock(&proxy_lock);
+
+	free(notify);
+}
+
+/* Called from parse_stratum_response, returns true if the response was for a
+ * share forwarded from one of our clients */
+bool stratum_proxy_result(struct pool *pool, int id, json_t *res_val, json_t *err_val)
+{
+	struct proxy_share *pshare;
+	struct proxy_client *client;
+	bool accepted = json_is_true(res_val);
+
+	if (!opt_stratum_proxy || id < PROXY_ID_BASE)
+		return false;
+
+	mutex_lock(&proxy_lock);
+	HASH_FIND_INT(proxy_shares, &id, pshare);
+	if (pshare)
+		HASH_DEL(proxy_shares, pshare);
+	mutex_unlock(&proxy_lock);
+	if (!pshare)
+		return false;
+
+	applog(LOG_DEBUG, "Stratum proxy share from client %d %s by pool %d",
+	       pshare->slot, accepted ? "accepted" : "rejected", pool->pool_no);
+
+	mutex_lock(&proxy_lock);
+	client = &clients[pshare->slot];
+	if (client->sock != INVSOCK && client->serial == pshare->serial) {
+		if (accepted)
+			client->accepted++;
+		else
+			client->rejected++;
+		__client_reply(pshare->slot, pshare->reqid, res_val, (err_val && !json_is_null(err_val)) ? err_val : NULL);
+	}
+	mutex_unlock(&proxy_lock);
+
+	json_decref(pshare->reqid);
+	free(pshare);
+
+	return true;
+}
+
+static void __client_subscribe(int slot, json_t *id)
+{
+	struct pool *pool = current_pool();
+	char nonce1[256], sid[16];
+	json_t *result;
+	char *notify;
+
+	if (!upstream_usable(pool)) {
+		__client_error(slot, id, 20, "No stratum upstream available");
+		return;
+	}
+
+	sprintf(sid, "%x", clients[slot].serial);
+	mutex_lock(&pool->pool_lock);
+	snprintf(nonce1, sizeof(nonce1), "%s%0*x", pool->nonce1, STRATUM_PROXY_N1_BYTES * 2, slot_prefix(slot));
+	result = json_pack("[[[ss][ss]]si]",
+			   "mining.set_difficulty", sid, "mining.notify", sid,
+			   nonce1, pool->n2size - STRATUM_PROXY_N1_BYTES);
+	mutex_unlock(&pool->pool_lock);
+
+	__check_upstream(pool, slot);
+	__client_reply(slot, id, result, NULL);
+	json_decref(result);
+	if (clients[slot].sock == INVSOCK)
+		return;
+
+	clients[slot].subscribed = true;
+	clients[slot].diff = 0;
+	__client_set_diff(slot, pool->swork.diff);
+	if (clients[slot].sock == INVSOCK)
+		return;
+	notify = upstream_notify(pool);
+	__client_send(slot, notify);
+	free(notify);
+}
+
+/* Queues a client share for upstream, returns false if it was rejected */
+static bool __client_submit(int slot, json_t *id, json_t *params, char **batch, size_t *batchlen)
+{
+	struct pool *pool = proxy_pool;
+	const char *job_id, *nonce2, *ntime, *nonce;
+	struct proxy_share *pshare;
+	char *s, *fullnonce2;
+	bool stale, good;
+	size_t len;
+	int n2len;
+
+	if (!clients[slot].subscribed || !clients[slot].authorised) {
+		__client_error(slot, id, 24, "Unauthorized worker");
+		return false;
+	}
+	if (!upstream_usable(pool) || pool != current_pool()) {
+		__client_error(slot, id, 20, "No stratum upstream available");
+		return false;
+	}
+
+	job_id = json_string_value(json_array_get(params, 1));
+	nonce2 = json_string_value(json_array_get(params, 2));
+	ntime = json_string_value(json_array_get(params, 3));
+	nonce = json_string_value(json_array_get(params, 4));
+	n2len = (pool->n2size - STRATUM_PROXY_N1_BYTES) * 2;
+	if (!job_id || !nonce2 || !ntime || !nonce || !is_hex(nonce2, n2len) ||
+	    !is_hex(ntime, 8) || !is_hex(nonce, 8)) {
+		__client_error(slot, id, 20, "Invalid share parameters");
+		return false;
+	}
+
+	/* Don't let a client spend our pool connection on worthless shares */
+	fullnonce2 = malloc(STRATUM_PROXY_N1_BYTES * 2 + n2len + 1);
+	if (unlikely(!fullnonce2))
+		quit(1, "Failed to malloc fullnonce2 in __client_submit");
+	sprintf(fullnonce2, "%0*x%s", STRATUM_PROXY_N1_BYTES * 2, slot_prefix(slot), nonce2);
+	good = stratum_proxy_test(pool, job_id, fullnonce2, ntime, nonce, &stale);
+	free(fullnonce2);
+	if (!good) {
+		clients[slot].rejected++;
+		if (stale)
+			__client_error(slot, id, 21, "Job not found");
+		else
+			__client_error(slot, id, 23, "Low difficulty share");
+		return false;
+	}
+
+	pshare = calloc(sizeof(*pshare), 1);
+	if (unlikely(!pshare))
+		quit(1, "Failed to calloc pshare in __client_submit");
+	pshare->id = PROXY_ID_BASE + (proxy_share_id++ & PROXY_ID_MASK);
+	pshare->slot = slot;
+	pshare->serial = clients[slot].serial;
+	pshare->reqid = json_incref(id ? id : json_null());
+	pshare->sent = time(NULL);
+	HASH_ADD_INT(proxy_shares, id, pshare);
+
+	s = malloc(1024);
+	if (unlikely(!s))
+		quit(1, "Failed to malloc s in __client_submit");
+	snprintf(s, 1024, "{\"params\": [\"%s\", \"%s\", \"%0*x%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+		 pool->rpc_user, job_id, STRATUM_PROXY_N1_BYTES * 2, slot_prefix(slot), nonce2,
+		 ntime, nonce, pshare->id);
+
+	/* Shares received in one pass are sent upstream in one write, leaving
+	 * room for the newline stratum_send appends */
+	len = strlen(s);
+	*batch = realloc(*batch, *batchlen + len + 3);
+	if (unlikely(!*batch))
+		quit(1, "Failed to realloc batch in __client_submit");
+	if (*batchlen)
+		(*batch)[(*batchlen)++] = '\n';
+	strcpy(*batch + *batchlen, s);
+	*batchlen += len;
+	free(s);
+
+	return true;
+}
+
+static void __client_line(int slot, char *line, char **batch, size_t *batchlen)
+{
+	json_t *val, *id, *method, *params;
+	json_error_t err;
+	const char *buf;
+
+	val = JSON_LOADS(line, &err);
+	if (!val) {
+		applog(LOG_DEBUG, "Stratum proxy client %d sent invalid JSON: %s", slot, err.text);
+		return;
+	}
+
+	id = json_object_get(val, "id");
+	method = json_object_get(val, "method");
+	params = json_object_get(val, "params");
+	buf = json_string_value(method);
+	if (!buf)
+		goto out;
+
+	if (!strcasecmp(buf, "mining.subscribe"))
+		__client_subscribe(slot, id);
+	else if (!strcasecmp(buf, "mining.authorize")) {
+		clients[slot].authorised = true;
+		__client_reply(slot, id, json_true(), NULL);
+	} else if (!strcasecmp(buf, "mining.submit"))
+		__client_submit(slot, id, params, batch, batchlen);
+	else if (id && !json_is_null(id))
+		__client_error(slot, id, 20, "Method not supported");
+
+out:
+	json_decref(val);
+}
+
+/* Shares to forward are added to batch, which the caller sends once it has
+ * dropped proxy_lock */
+static void __client_read(int slot, char **batch, size_t *batchlen)
+{
+	struct proxy_client *client = &clients[slot];
+	char *eol, *line;
+	ssize_t n;
+
+	n = recv(client->sock, client->buf + client->buflen, PROXY_BUFSIZ - 1 - client->buflen, 0);
+	if (n <= 0) {
+		if (!(n < 0 && sock_blocks()))
+			__drop_client(slot);
+		return;
+	}
+	client->buflen += n;
+	client->buf[client->buflen] = '\0';
+
+	line = client->buf;
+	while (client->sock != INVSOCK && (eol = strchr(line, '\n'))) {
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r')
+			eol[-1] = '\0';
+		if (*line)
+			__client_line(slot, line, batch, batchlen);
+		line = eol + 1;
+	}
+
+	if (client->sock != INVSOCK) {
+		client->buflen = strlen(line);
+		memmove(client->buf, line, client->buflen + 1);
+		if (client->buflen >= PROXY_BUFSIZ - 1) {
+			applog(LOG_INFO, "Stratum proxy client %d line too long", slot);
+			__drop_client(slot);
+		}
+	}
+}
+
+static void __expire_shares(void)
+{
+	struct proxy_share *pshare, *tmp;
+	time_t now = time(NULL);
+
+	HASH_ITER(hh, proxy_shares, pshare, tmp) {
+		if (now - pshare->sent > PROXY_SHARE_EXPIRY) {
+			HASH_DEL(proxy_shares, pshare);
+			json_decref(pshare->reqid);
+			free(pshare);
+		}
+	}
+}
+
+static void __accept_client(SOCKETTYPE listener)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz = sizeof(cli);
+	SOCKETTYPE c;
+	int slot;
+
+	c = accept(listener, (struct sockaddr *)(&cli), &clisiz);
+	if (SOCKETFAIL(c))
+		return;
+
+	if (!api_access_allowed(&cli)) {
+		applog(LOG_DEBUG, "Stratum proxy ignoring connection from %s", inet_ntoa(cli.sin_addr));
+		CLOSESOCKET(c);
+		return;
+	}
+
+	for (slot = 0; slot < PROXY_MAX_CLIENTS; slot++)
+		if (clients[slot].sock == INVSOCK)
+			break;
+	if (slot == PROXY_MAX_CLIENTS || !set_sock_nonblocking(c)) {
+		applog(LOG_WARNING, "Stratum proxy refusing client %s", inet_ntoa(cli.sin_addr));
+		CLOSESOCKET(c);
+		return;
+	}
+
+	clients[slot] = (struct proxy_client){
+		.sock = c,
+		.serial = ++proxy_serial,
+	};
+	++proxy_clients;
+	applog(LOG_INFO, "Stratum proxy client %d connected from %s", slot, inet_ntoa(cli.sin_addr));
+}
+
+static void *stratum_proxy_thread(__maybe_unused void *userdata)
+{
+	struct sockaddr_in serv;
+	SOCKETTYPE listener;
+	int slot, optval = 1;
+
+	pthread_detach(pthread_self());
+	RenameThread("stratum_proxy");
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == INVSOCK) {
+		applog(LOG_ERR, "Stratum proxy socket failed (%s)", SOCKERRMSG);
+		return NULL;
+	}
+
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	api_listen_addr(&serv);
+	serv.sin_port = htons(opt_stratum_proxy);
+	if (SOCKETFAIL(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
+		applog(LOG_DEBUG, "Stratum proxy setsockopt SO_REUSEADDR failed (ignored): %s", SOCKERRMSG);
+	if (SOCKETFAIL(bind(listener, (struct sockaddr *)(&serv), sizeof(serv))) ||
+	    SOCKETFAIL(listen(listener, PROXY_QUEUE))) {
+		applog(LOG_ERR, "Stratum proxy bind to port %d failed (%s)", opt_stratum_proxy, SOCKERRMSG);
+		CLOSESOCKET(listener);
+		return NULL;
+	}
+	applog(LOG_WARNING, "Stratum proxy listening on port %d", opt_stratum_proxy);
+
+	while (42) {
+		struct timeval timeout = {1, 0};
+		SOCKETTYPE maxfd = listener;
+		struct pool *pool;
+		char *batch = NULL;
+		size_t batchlen = 0;
+		fd_set rd;
+
+		FD_ZERO(&rd);
+		FD_SET(listener, &rd);
+		mutex_lock(&proxy_lock);
+		for (slot = 0; slot < PROXY_MAX_CLIENTS; slot++) {
+			if (clients[slot].sock == INVSOCK)
+				continue;
+			FD_SET(clients[slot].sock, &rd);
+			if (clients[slot].sock > maxfd)
+				maxfd = clients[slot].sock;
+		}
+		mutex_unlock(&proxy_lock);
+
+		if (select(maxfd + 1, &rd, NULL, NULL, &timeout) < 0)
+			continue;
+
+		mutex_lock(&proxy_lock);
+		if (FD_ISSET(listener, &rd))
+			__accept_client(listener);
+		for (slot = 0; slot < PROXY_MAX_CLIENTS; slot++)
+			if (clients[slot].sock != INVSOCK && FD_ISSET(clients[slot].sock, &rd))
+				__client_read(slot, &batch, &batchlen);
+		__expire_shares();
+		pool = proxy_pool;
+		mutex_unlock(&proxy_lock);
+
+		/* A slow pool must not hold up notifies or the other clients */
+		if (batch) {
+			if (!stratum_send(pool, batch, batchlen))
+				applog(LOG_INFO, "Stratum proxy failed to forward shares to pool %d", pool->pool_no);
+			free(batch);
+		}
+	}
+
+	return NULL;
+}
+
+/* Whether our own work must leave the client prefix of extranonce2 clear.
+ * Only the next work item's layout depends on it so no lock is needed.  Work
+ * made before the first client arrived can overlap its space until the next
+ * job, which at worst costs a duplicate share */
+bool stratum_proxy_clients(void)
+{
+	return opt_stratum_proxy && proxy_clients > 0;
+}
+
+void stratum_proxy_start(void)
+{
+	pthread_t pth;
+	int slot;
+
+	if (!opt_stratum_proxy)
+		return;
+
+	mutex_init(&proxy_lock);
+	for (slot = 0; slot < PROXY_MAX_CLIENTS; slot++)
+		clients[slot].sock = INVSOCK;
+
+	if (unlikely(pthread_create(&pth, NULL, stratum_proxy_thread, NULL)))
+		quit(1, "Stratum proxy thread create failed");
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright 2015-2017 John Doering
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Hierarchical timer wheel.  Deadlines are hashed into one of TW_LEVELS rings
+ * of TW_SIZE slots according to how far away they are, and are cascaded down
+ * a level each time the ring below wraps, so arming, cancelling and expiring
+ * a timer are all O(1).  Timer functions run on the timer thread with no
+ * locks held and must not block.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "miner.h"
+#include "timerwheel.h"
+
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+#define TW_SPAN		(1ULL << (TW_BITS * TW_LEVELS))
+#define TW_TICK_MS	100
+
+static pthread_mutex_t tw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tw_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tw_done_cond = PTHREAD_COND_INITIALIZER;
+static struct timer_ent *tw_slots[TW_LEVELS][TW_SIZE];
+/* Due but not yet run; still pending, so they can be moved or cancelled */
+static struct timer_ent *tw_expired;
+/* The entry whose function is running */
+static struct timer_ent *tw_running;
+static struct timeval tw_base;
+static uint64_t tw_now;
+static unsigned int tw_pending;
+
+static int64_t tw_ms(const struct timeval *tv)
+{
+	return (int64_t)(tv->tv_sec - tw_base.tv_sec) * 1000 +
+	       (tv->tv_usec - tw_base.tv_usec) / 1000;
+}
+
+/* The tick we are in now */
+static uint64_t tw_current(void)
+{
+	struct timeval now;
+	int64_t ms;
+
+	gettimeofday(&now, NULL);
+	ms = tw_ms(&now);
+	return ms > 0 ? ms / TW_TICK_MS : 0;
+}
+
+static void tw_link(struct timer_ent *te)
+{
+	uint64_t expires = te->expires, delta;
+	struct timer_ent **slot;
+	int level;
+
+	delta = expires - tw_now;
+	if (delta >= TW_SPAN) {
+		/* Parked in the top ring and relinked when it comes round */
+		expires = tw_now + TW_SPAN - 1;
+		delta = TW_SPAN - 1;
+	}
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < 1ULL << (TW_BITS * (level + 1)))
+			break;
+
+	slot = &tw_slots[level][(expires >> (TW_BITS * level)) & TW_MASK];
+	te->next = *slot;
+	if (te->next)
+		te->next->pprev = &te->next;
+	te->pprev = slot;
+	*slot = te;
+}
+
+static void tw_unlink(struct timer_ent *te)
+{
+	*te->pprev = te->next;
+	if (te->next)
+		te->next->pprev = te->pprev;
+	te->next = NULL;
+	te->pprev = NULL;
+}
+
+/* Move a whole slot of a higher ring down to where it now belongs.  Returns
+ * the slot index so the caller knows whether the ring above wrapped too. */
+static int tw_cascade(int level)
+{
+	int idx = (tw_now >> (TW_BITS * level)) & TW_MASK;
+	struct timer_ent *te = tw_slots[level][idx], *next;
+
+	tw_slots[level][idx] = NULL;
+	for (; te; te = next) {
+		next = te->next;
+		tw_link(te);
+	}
+	return idx;
+}
+
+/* Advance one tick, moving everything due onto the expired list */
+static void tw_advance(void)
+{
+	struct timer_ent *te, *next;
+	int idx, level;
+
+	++tw_now;
+	idx = tw_now & TW_MASK;
+	for (level = 1; !idx && level < TW_LEVELS; level++)
+		idx = tw_cascade(level);
+
+	te = tw_slots[0][tw_now & TW_MASK];
+	tw_slots[0][tw_now & TW_MASK] = NULL;
+	for (; te; te = next) {
+		next = te->next;
+		if (te->expires > tw_now) {
+			tw_link(te);
+			continue;
+		}
+		te->next = tw_expired;
+		if (te->next)
+			te->next->pprev = &te->next;
+		te->pprev = &tw_expired;
+		tw_expired = te;
+	}
+}
+
+void timer_init(struct timer_ent *te, timer_func_t func, void *arg)
+{
+	te->func = func;
+	te->arg = arg;
+	te->expires = 0;
+	te->pending = false;
+	te->next = NULL;
+	te->pprev = NULL;
+}
+
+/* Arms the timer, or moves it if it was already armed.  Deadlines in the past
+ * fire on the next tick. */
+void timer_set(struct timer_ent *te, const struct timeval *when)
+{
+	int64_t ms;
+
+	mutex_lock(&tw_lock);
+	if (!tw_base.tv_sec)
+		gettimeofday(&tw_base, NULL);
+	if (te->pending)
+		tw_unlink(te);
+	else if (!tw_pending++) {
+		/* Nothing was armed, so the wheel may have fallen behind */
+		tw_now = tw_current();
+		pthread_cond_signal(&tw_cond);
+	}
+
+	/* Round up so a timer never fires before its deadline */
+	ms = tw_ms(when);
+	te->expires = ms > 0 ? (ms + TW_TICK_MS - 1) / TW_TICK_MS : 0;
+	if (te->expires <= tw_now)
+		te->expires = tw_now + 1;
+	te->pending = true;
+	tw_link(te);
+	mutex_unlock(&tw_lock);
+}
+
+/* Returns false if the timer was not armed, including when its function is
+ * running */
+bool timer_cancel(struct timer_ent *te)
+{
+	bool ret;
+
+	mutex_lock(&tw_lock);
+	ret = te->pending;
+	if (ret) {
+		tw_unlink(te);
+		te->pending = false;
+		--tw_pending;
+	}
+	mutex_unlock(&tw_lock);
+
+	return ret;
+}
+
+/* Like timer_cancel() but if the function is running, waits for it to return
+ * first, so the entry is no longer in use at all once this returns.  Must not
+ * be called from the timer's own function, and the caller must not hold a
+ * lock that the function blocks on. */
+bool timer_cancel_sync(struct timer_ent *te)
+{
+	bool ret;
+
+	mutex_lock(&tw_lock);
+	while (tw_running == te)
+		pthread_cond_wait(&tw_done_cond, &tw_lock);
+	ret = te->pending;
+	if (ret) {
+		tw_unlink(te);
+		te->pending = false;
+		--tw_pending;
+	}
+	mutex_unlock(&tw_lock);
+
+	return ret;
+}
+
+static void *timer_thread(void __maybe_unused *userdata)
+{
+	struct timer_ent *te;
+	struct timespec abstime;
+	uint64_t target;
+
+	RenameThread("timer");
+
+	mutex_lock(&tw_lock);
+	while (42) {
+		if (!tw_pending) {
+			pthread_cond_wait(&tw_cond, &tw_lock);
+			continue;
+		}
+
+		target = tw_current();
+		if (target <= tw_now) {
+			uint64_t ms = (tw_now + 1) * TW_TICK_MS;
+
+			abstime.tv_sec = tw_base.tv_sec + ms / 1000;
+			abstime.tv_nsec = (tw_base.tv_usec + (ms % 1000) * 1000) * 1000;
+			if (abstime.tv_nsec >= 1000000000) {
+				abstime.tv_nsec -= 1000000000;
+				++abstime.tv_sec;
+			}
+			pthread_cond_timedwait(&tw_cond, &tw_lock, &abstime);
+			continue;
+		}
+
+		while (tw_now < target)
+			tw_advance();
+
+		/* Take them off one at a time, since while a function runs the
+		 * others can still be re-armed or cancelled */
+		while ((te = tw_expired)) {
+			tw_unlink(te);
+			te->pending = false;
+			--tw_pending;
+			tw_running = te;
+			mutex_unlock(&tw_lock);
+			te->func(te->arg);
+			mutex_lock(&tw_lock);
+			tw_running = NULL;
+			pthread_cond_broadcast(&tw_done_cond);
+		}
+	}
+
+	return NULL;
+}
+
+void timerwheel_start(void)
+{
+	pthread_t pth;
+
+	if (unlikely(pthread_create(&pth, NULL, timer_thread, NULL)))
+		quit(1, "Timer thread create failed");
+	pthread_detach(pth);
+}
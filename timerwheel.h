@@ -0,0 +1,28 @@
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+typedef void (*timer_func_t)(void *arg);
+
+/* Embed one of these in whatever owns the deadline.  Once its function has
+ * been called the wheel no longer references the entry, so the function may
+ * free it or arm it again. */
+struct timer_ent {
+	timer_func_t func;
+	void *arg;
+	uint64_t expires;
+	bool pending;
+	struct timer_ent *next;
+	struct timer_ent **pprev;
+};
+
+extern void timer_init(struct timer_ent *, timer_func_t, void *arg);
+extern void timer_set(struct timer_ent *, const struct timeval *when);
+extern bool timer_cancel(struct timer_ent *);
+extern bool timer_cancel_sync(struct timer_ent *);
+extern void timerwheel_start(void);
+
+#endif /* __TIMERWHEEL_H__ */
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2015-2017 John Doering
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Work lifecycle tracing for --trace.  Every thread that records an event gets
+ * its own ring of compact binary events the first time it does so, and only
+ * that thread ever writes to it, so recording is a timestamp and a store with
+ * no locks or shared cache lines.  Rings overwrite their oldest events, and at
+ * exit the lot is written out in the Chrome trace event format that
+ * chrome://tracing and Perfetto load.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_PRCTL_H
+# include <sys/prctl.h>
+#endif
+
+#include "miner.h"
+
+/* Per thread, a power of two */
+#define TRACE_EVENTS	16384
+#define TRACE_MASK	(TRACE_EVENTS - 1)
+
+struct trace_event {
+	uint64_t us;
+	int32_t work_id;
+	uint32_t type;
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	int tid;
+	char name[16];
+	/* Events ever recorded; only the owning thread writes it */
+	uint64_t head;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+static const struct {
+	const char *name;
+	char phase;
+} trace_types[TRACE_TYPES] = {
+	[TRACE_STAGE]		= { "stage_work",		'i' },
+	[TRACE_HASH_POP]	= { "hash_pop",			'i' },
+	[TRACE_SCAN_BEGIN]	= { "scanhash",			'B' },
+	[TRACE_SCAN_END]	= { "scanhash",			'E' },
+	[TRACE_NONCE]		= { "submit_nonce",		'i' },
+	[TRACE_SHARE]		= { "submit_work_async",	'i' },
+	[TRACE_SUBMIT]		= { "begin_submission",		'i' },
+	[TRACE_RESULT]		= { "stratum_share_result",	'i' },
+};
+
+char *opt_trace;
+bool trace_enabled;
+
+static __thread struct trace_ring *trace_mine;
+static struct trace_ring *trace_rings;
+static int trace_threads;
+
+static struct trace_ring *trace_ring_new(void)
+{
+	struct trace_ring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (unlikely(!ring))
+		quit(1, "Failed to calloc trace ring");
+	ring->tid = __sync_add_and_fetch(&trace_threads, 1);
+#ifdef PR_GET_NAME
+	prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+#endif
+	if (!ring->name[0])
+		sprintf(ring->name, "thread %d", ring->tid);
+
+	do
+		ring->next = trace_rings;
+	while (!__sync_bool_compare_and_swap(&trace_rings, ring->next, ring));
+
+	return ring;
+}
+
+void trace_event(enum trace_type type, int work_id)
+{
+	struct trace_ring *ring = trace_mine;
+	struct trace_event *ev;
+	struct timeval now;
+
+	if (unlikely(!ring))
+		ring = trace_mine = trace_ring_new();
+
+	gettimeofday(&now, NULL);
+	ev = &ring->events[ring->head & TRACE_MASK];
+	ev->us = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+	ev->work_id = work_id;
+	ev->type = type;
+	/* Publish the event before the dump can see it counted */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_dump_ring(FILE *f, struct trace_ring *ring, bool *first)
+{
+	struct trace_event *events;
+	uint64_t head, start, i;
+
+	events = malloc(sizeof(ring->events));
+	if (unlikely(!events))
+		return;
+
+	/* Threads may still be running, so copy first and then throw away
+	 * whatever was overwritten while we copied */
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	memcpy(events, ring->events, sizeof(ring->events));
+	start = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	start = start > TRACE_EVENTS ? start - TRACE_EVENTS + 1 : 0;
+
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		*first ? "" : ",", ring->tid, ring->name);
+	*first = false;
+
+	for (i = start; i < head; i++) {
+		struct trace_event *ev = &events[i & TRACE_MASK];
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%llu,\"pid\":1,\"tid\":%d,\"args\":{\"work\":%d}}",
+			trace_types[ev->type].name, trace_types[ev->type].phase,
+			trace_types[ev->type].phase == 'i' ? "\"s\":\"t\"," : "",
+			(ullong)ev->us, ring->tid, (int)ev->work_id);
+	}
+
+	free(events);
+}
+
+/* Called once on the way out */
+void trace_dump(void)
+{
+	struct trace_ring *ring;
+	bool first = true;
+	FILE *f;
+
+	if (!trace_enabled)
+		return;
+	trace_enabled = false;
+
+	f = fopen(opt_trace, "w");
+	if (!f) {
+		applog(LOG_ERR, "Failed to open %s for writing the trace", opt_trace);
+		return;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (ring = trace_rings; ring; ring = ring->next)
+		trace_dump_ring(f, ring, &first);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
@@ -44,6 +44,7 @@
 # include <netinet/in.h>
 # include <netinet/tcp.h>
 # include <netdb.h>
+# include <fcntl.h>
 #else
 # include <winsock2.h>
 # include <mstcpip.h>
@@ -1014,6 +1015,50 @@ bool extract_sockaddr(struct pool *pool, char *url)
 	return true;
 }
 
+static FILE *stratum_capture_file;
+static pthread_mutex_t stratum_capture_lock;
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+/* Opens the capture file that every stratum line sent or received is logged
+ * to, see STRATUM_CAPTURE_MAGIC for the format */
+void stratum_capture_open(const char *filename)
+{
+	mutex_init(&stratum_capture_lock);
+	stratum_capture_file = fopen(filename, "wb");
+	if (unlikely(!stratum_capture_file))
+		quit(1, "Failed to open %s for stratum capture", filename);
+	fwrite(STRATUM_CAPTURE_MAGIC, 1, strlen(STRATUM_CAPTURE_MAGIC), stratum_capture_file);
+	fflush(stratum_capture_file);
+}
+
+static void stratum_capture(struct pool *pool, unsigned char dir, const char *s, size_t len)
+{
+	unsigned char hdr[STRATUM_CAPTURE_HDRLEN];
+	struct timeval now;
+
+	if (!stratum_capture_file)
+		return;
+
+	gettimeofday(&now, NULL);
+	put_le(hdr, (uint64_t)now.tv_sec * 1000000 + now.tv_usec, 8);
+	hdr[8] = dir;
+	hdr[9] = pool->pool_no;
+	put_le(hdr + 10, len, 4);
+
+	mutex_lock(&stratum_capture_lock);
+	fwrite(hdr, 1, sizeof(hdr), stratum_capture_file);
+	fwrite(s, 1, len, stratum_capture_file);
+	fflush(stratum_capture_file);
+	mutex_unlock(&stratum_capture_lock);
+}
+
 enum send_ret {
 	SEND_OK,
 	SEND_SELECTFAIL,
@@ -1063,6 +1108,7 @@ bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force)
 
 	if (opt_protocol)
 		applog(LOG_DEBUG, "Pool %u: SEND: %s", pool->pool_no, s);
+	stratum_capture(pool, STRATUM_CAPTURE_SEND, s, len);
 
 	mutex_lock(&pool->stratum_lock);
 	if (pool->stratum_active || force)
@@ -1238,8 +1284,11 @@ char *recv_line(struct pool *pool)
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, sret);
+	else {
+		if (opt_protocol)
+			applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, sret);
+		stratum_capture(pool, STRATUM_CAPTURE_RECV, sret, len);
+	}
 	return sret;
 }
 
@@ -1331,6 +1380,31 @@ void stratum_probe_transparency(struct pool *pool)
 	pool->swork.transparency_probed = true;
 }
 
+/* Tracks the interval between notifies, the stratum equivalent of the
+ * getwork wait */
+static void stratum_notify_update(struct pool *pool)
+{
+	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
+	struct timeval now;
+	double interval;
+
+	gettimeofday(&now, NULL);
+	mutex_lock(&stats_lock);
+	if (pool_stats->notify_count++) {
+		interval = tdiff(&now, &pool_stats->last_notify);
+		if (pool_stats->notify_count == 2)
+			pool_stats->notify_interval_rolling = interval;
+		else {
+			pool_stats->notify_interval_rolling += interval * 0.63;
+			pool_stats->notify_interval_rolling /= 1.63;
+		}
+		if (interval > pool_stats->notify_interval_max)
+			pool_stats->notify_interval_max = interval;
+	}
+	pool_stats->last_notify = now;
+	mutex_unlock(&stats_lock);
+}
+
 static bool parse_notify(struct pool *pool, json_t *val)
 {
 	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
@@ -1433,6 +1507,8 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	pool->getwork_requested++;
 	total_getworks++;
 
+	stratum_notify_update(pool);
+
 	if ((merkles && (!pool->swork.transparency_probed || rand() <= RAND_MAX / (opt_skip_checks + 1))) || pool->swork.transparency_time != (time_t)-1)
 		if (pool->stratum_auth)
 			stratum_probe_transparency(pool);
@@ -1487,6 +1563,39 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 	return true;
 }
 
+static bool parse_extranonce(struct pool *pool, json_t *val)
+{
+	char *nonce1;
+	int n2size;
+
+	nonce1 = json_array_string(val, 0);
+	if (!nonce1)
+		return false;
+	n2size = json_integer_value(json_array_get(val, 1));
+	if (!n2size) {
+		free(nonce1);
+		return false;
+	}
+
+	mutex_lock(&pool->pool_lock);
+	free(pool->nonce1);
+	pool->nonce1 = nonce1;
+	pool->n1_len = strlen(nonce1) / 2;
+	pool->n2size = n2size;
+	pool->nonce2 = 0;
+	pool->swork.cb_len = pool->swork.cb1_len + pool->n1_len + pool->n2size + pool->swork.cb2_len;
+	/* Work already generated carries the old extranonce, so have the
+	 * stratum thread regenerate it as if the job was clean */
+	if (pool->stratum_notify)
+		pool->swork.clean = true;
+	mutex_unlock(&pool->pool_lock);
+
+	applog(LOG_NOTICE, "Pool %d set extranonce1 %s extranonce2 size %d",
+	       pool->pool_no, nonce1, n2size);
+
+	return true;
+}
+
 static bool send_version(struct pool *pool, json_t *val)
 {
 	char s[RBUFSIZE], *idstr;
@@ -1558,6 +1667,11 @@ bool parse_method(struct pool *pool, char *s)
 		goto out;
 	}
 
+	if (!strncasecmp(buf, "mining.set_extranonce", 21) && parse_extranonce(pool, params)) {
+		ret = true;
+		goto out;
+	}
+
 	if (!strncasecmp(buf, "client.reconnect", 16) && parse_reconnect(pool, params)) {
 		ret = true;
 		goto out;
@@ -1623,6 +1737,11 @@ bool auth_stratum(struct pool *pool)
 	pool->probed = true;
 	pool->stratum_auth = true;
 	successful_connect = true;
+
+	if (opt_extranonce_subscribe) {
+		sprintf(s, "{\"id\": \"xnsub\", \"method\": \"mining.extranonce.subscribe\", \"params\": []}");
+		stratum_send(pool, s, strlen(s));
+	}
 out:
 	if (val)
 		json_decref(val);
@@ -1633,6 +1752,78 @@ out:
 	return ret;
 }
 
+/* Finds the mining.notify subscription id in a mining.subscribe result, which
+ * can be passed back to the pool on reconnect to resume the session */
+static char *get_sessionid(json_t *val)
+{
+	json_t *arr_val, *arr;
+	char *notify;
+	int i, n;
+
+	arr_val = json_array_get(val, 0);
+	if (!arr_val || !json_is_array(arr_val))
+		return NULL;
+
+	/* Either a single ["mining.notify", id] pair or a list of pairs */
+	notify = __json_array_string(arr_val, 0);
+	if (notify && !strncasecmp(notify, "mining.notify", 13))
+		return json_array_string(arr_val, 1);
+
+	n = json_array_size(arr_val);
+	for (i = 0; i < n; i++) {
+		arr = json_array_get(arr_val, i);
+		notify = __json_array_string(arr, 0);
+		if (notify && !strncasecmp(notify, "mining.notify", 13))
+			return json_array_string(arr, 1);
+	}
+
+	return NULL;
+}
+
+/* All stratum connections share one curl DNS cache, so a reconnect does not
+ * wait on the resolver again while the cached addresses are fresh */
+static CURLSH *stratum_curlsh;
+static pthread_mutex_t stratum_curlsh_lock;
+
+static void stratum_curlsh_lockcb(__maybe_unused CURL *handle, __maybe_unused curl_lock_data data,
+				  __maybe_unused curl_lock_access access, __maybe_unused void *userptr)
+{
+	mutex_lock(&stratum_curlsh_lock);
+}
+
+static void stratum_curlsh_unlockcb(__maybe_unused CURL *handle, __maybe_unused curl_lock_data data,
+				    __maybe_unused void *userptr)
+{
+	mutex_unlock(&stratum_curlsh_lock);
+}
+
+void stratum_curlsh_init(void)
+{
+	mutex_init(&stratum_curlsh_lock);
+	stratum_curlsh = curl_share_init();
+	if (unlikely(!stratum_curlsh))
+		quit(1, "Failed to curl_share_init in stratum_curlsh_init");
+	curl_share_setopt(stratum_curlsh, CURLSHOPT_LOCKFUNC, stratum_curlsh_lockcb);
+	curl_share_setopt(stratum_curlsh, CURLSHOPT_UNLOCKFUNC, stratum_curlsh_unlockcb);
+	curl_share_setopt(stratum_curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+}
+
+/* Returns the delay before the next reconnect attempt. It doubles with each
+ * attempt up to max_ms and is randomised over its upper half so miners losing
+ * the same pool do not all come back in lockstep. */
+unsigned int backoff_ms(unsigned int *attempt, unsigned int min_ms, unsigned int max_ms)
+{
+	unsigned int delay = min_ms, i;
+
+	for (i = 0; i < *attempt && delay < max_ms; i++)
+		delay *= 2;
+	if (delay > max_ms)
+		delay = max_ms;
+	++*attempt;
+
+	return delay / 2 + rand() % (delay / 2 + 1);
+}
+
 curl_socket_t grab_socket_opensocket_cb(void *clientp, __maybe_unused curlsocktype purpose, struct curl_sockaddr *addr)
 {
 	struct pool *pool = clientp;
@@ -1641,17 +1832,22 @@ curl_socket_t grab_socket_opensocket_cb(void *clientp, __maybe_unused curlsockty
 	return sck;
 }
 
+/* How long to wait on the preferred address family before racing the other */
+#define STRATUM_EYEBALLS_MS 150
+
 bool initiate_stratum(struct pool *pool)
 {
 	json_t *val = NULL, *res_val, *err_val;
 	char curl_err_str[CURL_ERROR_SIZE];
-	char s[RBUFSIZE], *sret = NULL;
+	char s[RBUFSIZE], *sret = NULL, *nonce1, *sessionid;
 	CURL *curl = NULL;
 	json_error_t err;
 	bool ret = false;
+	int n2size;
 
 	applog(LOG_DEBUG, "initiate_stratum with sockbuf=%p", pool->sockbuf);
 	mutex_lock(&pool->stratum_lock);
+	pool->session_resumed = false;
 	pool->swork.transparency_time = (time_t)-1;
 	pool->stratum_active = false;
 	pool->stratum_auth = false;
@@ -1684,6 +1880,15 @@ bool initiate_stratum(struct pool *pool)
 	curl_easy_setopt(curl, CURLOPT_URL, s);
 	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 
+	/* Resolve through the shared DNS cache. Curl tries all the addresses a
+	 * name resolves to, racing IPv6 against IPv4 where it supports that */
+	if (stratum_curlsh)
+		curl_easy_setopt(curl, CURLOPT_SHARE, stratum_curlsh);
+	curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, (long)opt_dns_cache_time);
+#if LIBCURL_VERSION_NUM >= 0x073b00
+	curl_easy_setopt(curl, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, (long)STRATUM_EYEBALLS_MS);
+#endif
+
 	/* We use DEBUGFUNCTION to count bytes sent/received, and verbose is needed
 	 * to enable it */
 	curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, curl_debug_cb);
@@ -1723,7 +1928,12 @@ bool initiate_stratum(struct pool *pool)
 
 	mutex_unlock(&pool->stratum_lock);
 	
-	sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", swork_id++);
+resend:
+	if (pool->sessionid)
+		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\", \"%s\"]}",
+		        swork_id++, pool->sessionid);
+	else
+		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", swork_id++);
 
 	if (!_stratum_send(pool, s, strlen(s), true)) {
 		applog(LOG_DEBUG, "Failed to send s in initiate_stratum");
@@ -1762,22 +1972,48 @@ bool initiate_stratum(struct pool *pool)
 
 		free(ss);
 
+		/* Some pools refuse the session id, so try again without */
+		if (pool->sessionid) {
+			applog(LOG_DEBUG, "Pool %d failed to resume session, subscribing afresh", pool->pool_no);
+			free(pool->sessionid);
+			pool->sessionid = NULL;
+			json_decref(val);
+			val = NULL;
+			goto resend;
+		}
+
 		goto out;
 	}
 
-	free(pool->nonce1);
-	pool->nonce1 = json_array_string(res_val, 1);
-	if (!pool->nonce1) {
+	nonce1 = json_array_string(res_val, 1);
+	if (!nonce1) {
 		applog(LOG_INFO, "Failed to get nonce1 in initiate_stratum");
 		goto out;
 	}
-	pool->n1_len = strlen(pool->nonce1) / 2;
-	pool->n2size = json_integer_value(json_array_get(res_val, 2));
-	if (!pool->n2size) {
+	n2size = json_integer_value(json_array_get(res_val, 2));
+	if (!n2size) {
 		applog(LOG_INFO, "Failed to get n2size in initiate_stratum");
+		free(nonce1);
 		goto out;
 	}
 
+	/* The pool only resumed our session if it echoes back the session id we
+	 * offered along with the same extranonce; then work generated for it is
+	 * still valid. Pools that ignore the id can hand the same extranonce to
+	 * a fresh session, which must not be treated as resumed */
+	sessionid = get_sessionid(res_val);
+	mutex_lock(&pool->pool_lock);
+	pool->session_resumed = pool->sessionid && sessionid && !strcmp(pool->sessionid, sessionid) &&
+	                        pool->nonce1 && !strcmp(pool->nonce1, nonce1) && pool->n2size == n2size;
+	free(pool->nonce1);
+	pool->nonce1 = nonce1;
+	pool->n1_len = strlen(nonce1) / 2;
+	pool->n2size = n2size;
+	mutex_unlock(&pool->pool_lock);
+
+	free(pool->sessionid);
+	pool->sessionid = sessionid;
+
 	ret = true;
 out:
 	if (val)
@@ -1790,10 +2026,13 @@ out:
 		if (!pool->stratum_url)
 			pool->stratum_url = pool->sockaddr_url;
 		pool->stratum_active = true;
-		pool->swork.diff = 1;
+		if (!pool->session_resumed)
+			pool->swork.diff = 1;
 		if (opt_protocol) {
-			applog(LOG_DEBUG, "Pool %d confirmed mining.subscribe with extranonce1 %s extran2size %d",
-			       pool->pool_no, pool->nonce1, pool->n2size);
+			applog(LOG_DEBUG, "Pool %d confirmed mining.subscribe with extranonce1 %s extran2size %d session %s%s",
+			       pool->pool_no, pool->nonce1, pool->n2size,
+			       pool->sessionid ? pool->sessionid : "(none)",
+			       pool->session_resumed ? " resumed" : "");
 		}
 	} else
 	{
@@ -1879,6 +2118,28 @@ void *realloc_strcat(char *ptr, char *s)
 	return ret;
 }
 
+/* Zeroed allocation starting on a cache line boundary, so structures laid out
+ * with __cacheline_aligned members really do keep them apart.  The original
+ * pointer is kept just before the returned block for cacheline_free. */
+void *cacheline_calloc(size_t nmemb, size_t size)
+{
+	size_t len = nmemb * size + CACHELINE_SIZE + sizeof(void *);
+	char *mem, *ret;
+
+	mem = calloc(1, len);
+	if (unlikely(!mem))
+		return NULL;
+	ret = (char *)(((uintptr_t)mem + sizeof(void *) + CACHELINE_SIZE - 1) & ~(uintptr_t)(CACHELINE_SIZE - 1));
+	((void **)ret)[-1] = mem;
+	return ret;
+}
+
+void cacheline_free(void *ptr)
+{
+	if (ptr)
+		free(((void **)ptr)[-1]);
+}
+
 static
 bool sanechars[] = {
 	false, false, false, false, false, false, false, false,
@@ -1956,6 +2217,19 @@ static const char *WindowsErrorStr(DWORD dwMessageId)
 }
 #endif
 
+bool set_sock_nonblocking(SOCKETTYPE sock)
+{
+#ifdef WIN32
+	u_long nonblock = 1;
+
+	return !ioctlsocket(sock, FIONBIO, &nonblock);
+#else
+	int flags = fcntl(sock, F_GETFL, 0);
+
+	return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) >= 0;
+#endif
+}
+
 void notifier_init(notifier_t pipefd)
 {
 #ifdef WIN32
@@ -90,11 +90,27 @@ bool extract_sockaddr(struct pool *pool, char *url);
 bool auth_stratum(struct pool *pool);
 bool initiate_stratum(struct pool *pool);
 void suspend_stratum(struct pool *pool);
+void stratum_curlsh_init(void);
+
+/* A stratum capture file starts with the magic string, followed by a record
+ * per line: 8 byte microseconds since the epoch, a direction byte, the pool
+ * number byte and a 4 byte length, all little endian, then the line itself
+ * without its newline */
+#define STRATUM_CAPTURE_MAGIC	"NSGCAP1\n"
+#define STRATUM_CAPTURE_HDRLEN	14
+#define STRATUM_CAPTURE_RECV	'<'
+#define STRATUM_CAPTURE_SEND	'>'
+void stratum_capture_open(const char *filename);
+unsigned int backoff_ms(unsigned int *attempt, unsigned int min_ms, unsigned int max_ms);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
+extern void *cacheline_calloc(size_t nmemb, size_t size);
+extern void cacheline_free(void *);
 extern char *sanestr(char *o, char *s);
 void RenameThread(const char* name);
 
+extern bool set_sock_nonblocking(SOCKETTYPE);
+
 typedef SOCKETTYPE notifier_t[2];
 extern void notifier_init(notifier_t);
 extern void notifier_wake(notifier_t);